@@ -0,0 +1,505 @@
+#include "chat-archive.h"
+#include "chat-log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+/**
+ * Archives
+ *
+ * When a room's retention policy evicts its oldest chunk, the chunk is
+ * appended to <log>.<room>.archive as one segment, so /chats can still
+ * read the chats it held. Archived chats don't change anymore, a reaction
+ * to one is refused. Without a log there is nowhere to put them and
+ * evicted chats are dropped.
+ *
+ * Segments refer to users and reaction tokens by their index in the room's
+ * name tables, which are never evicted, so a segment is only the chunk's
+ * columns, its groups and its messages. The archive keeps the offset of
+ * every chunk's segment in memory, 8 bytes per CHUNK_CHATS chats. Readers
+ * look it up under the archive's lock and read the segment with pread,
+ * one chunk at a time.
+ *
+ * A chunk's segment is reserved while the room's lock is held, then built
+ * and written by the evicting post once the lock is released, so posts
+ * and reactions in the room don't wait for the disk. Readers that want a
+ * segment still being written wait for it, see archive_load.
+ *
+ * Segments are appended without syncing. The log covers them until a
+ * snapshot drops its segments, so snapshots sync the archives first (see
+ * chat-snapshot.c). Replaying the log evicts the same chunks again, those
+ * already in the archive are not written twice. Opening an archive keeps
+ * the segments up to the first torn or corrupt header and cuts off the
+ * rest, the body of a segment is checked when it is read.
+ *
+ * Segment layout, integers in native byte order, every section 8-byte aligned:
+ *      SegmentHeader
+ *      int64    time[num_chats]
+ *      uint32   user[num_chats]
+ *      uint32   num_groups[num_chats]
+ *      uint16   message_len[num_chats]
+ *      ArchiveGroup groups[num_groups]         in chat order
+ *      uint32   reaction_users[num_reactions]  every group's users, in group order
+ *      char     messages[]                     NUL-terminated, in chat order
+ */
+#define ARCHIVE_MAGIC "CHATARCV"
+#define ARCHIVE_VERSION 1
+
+#define NO_SEGMENT UINT64_MAX
+#define PENDING_SEGMENT (UINT64_MAX - 1)   //reserved by archive_reserve, archive_spill is writing it
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_chats;         //always CHUNK_CHATS
+    uint64_t chunk;             //chunk number, its first chat has id chunk * CHUNK_CHATS
+    uint64_t num_groups;
+    uint64_t num_reactions;
+    uint64_t messages_len;
+    uint64_t body_len;
+    uint32_t body_crc;
+    uint32_t header_crc;        //of the header with header_crc set to 0
+};
+typedef struct SegmentHeader SegmentHeader;
+
+struct ArchiveGroup {
+    uint32_t token;
+    uint32_t count;
+};
+typedef struct ArchiveGroup ArchiveGroup;
+
+enum Section {
+    SECTION_TIME,
+    SECTION_USER,
+    SECTION_GROUP_COUNT,
+    SECTION_MESSAGE_LEN,
+    SECTION_GROUPS,
+    SECTION_REACTION_USERS,
+    SECTION_MESSAGES,
+    NUM_SECTIONS
+};
+
+struct Archive {
+    char *path;
+    int fd;
+
+    pthread_mutex_t lock;       //guards the rest, the writers append while readers look them up
+    uint64_t end;               //where the next segment goes
+    uint64_t *offset;           //segment of each chunk number, NO_SEGMENT if it has none
+    uint64_t num_offsets;
+    uint64_t capacity;
+    int pending;                //segments reserved and not written yet
+    pthread_cond_t written;     //signalled when one of them is
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+static char *archive_path = NULL;
+
+/**
+ * Fills offset with where each section starts in the body, offset[NUM_SECTIONS] is its length
+ */
+static void layout(const SegmentHeader *header, uint64_t offset[NUM_SECTIONS + 1]){
+    uint64_t chats = header->num_chats;
+    uint64_t size[NUM_SECTIONS] = {
+        chats * sizeof(int64_t),
+        chats * sizeof(uint32_t),
+        chats * sizeof(uint32_t),
+        chats * sizeof(uint16_t),
+        header->num_groups * sizeof(ArchiveGroup),
+        header->num_reactions * sizeof(uint32_t),
+        header->messages_len
+    };
+
+    uint64_t at = 0;
+    for(int i = 0; i < NUM_SECTIONS; i++){
+        offset[i] = at;
+        at = ALIGN8(at + size[i]);
+    }
+    offset[NUM_SECTIONS] = at;
+}
+
+static uint32_t header_crc(SegmentHeader header){
+    header.header_crc = 0;
+    return crc32_update(0, &header, sizeof(header));
+}
+
+/**
+ * Archives go next to the log at path, without calling this evicted chats are dropped
+ */
+void archive_init(const char *path){
+    archive_path = strdup(path);
+    if(archive_path == NULL){
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Records where chunk number's segment is
+ *
+ * Called with the archive's lock held, or while it's opened.
+ *
+ * @return 0 on success, -1 if realloc failed
+ */
+static int set_offset(Archive *archive, uint64_t number, uint64_t offset){
+    if(number >= archive->capacity){
+        uint64_t capacity = archive->capacity ? archive->capacity : 64;
+        while(capacity <= number){
+            capacity *= 2;
+        }
+        uint64_t *grown = realloc(archive->offset, sizeof(uint64_t) * capacity);
+        if(grown == NULL){
+            return -1;
+        }
+        archive->offset = grown;
+        archive->capacity = capacity;
+    }
+    while(archive->num_offsets <= number){
+        archive->offset[archive->num_offsets++] = NO_SEGMENT;
+    }
+    archive->offset[number] = offset;
+    return 0;
+}
+
+/**
+ * Opens the room's archive, creating it if it doesn't exist yet
+ *
+ * Exits if the file can't be opened.
+ *
+ * @return the archive, NULL if evicted chats are dropped
+ */
+Archive *archive_open(const char *room){
+    if(archive_path == NULL){
+        return NULL;
+    }
+
+    Archive *archive = calloc(1, sizeof(Archive));
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%s.archive", archive_path, room);
+    if(archive == NULL || (archive->path = strdup(path)) == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&archive->lock, NULL);
+    pthread_cond_init(&archive->written, NULL);
+
+    archive->fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat info;
+    if(archive->fd < 0 || fstat(archive->fd, &info) < 0){
+        perror("open of archive failed");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t size = (uint64_t)info.st_size;
+    if(size == 0){
+        sync_directory(path);
+    }
+
+    //only the headers are read, a segment's body is checked when it is loaded
+    uint64_t at = 0;
+    SegmentHeader header;
+    while(at + sizeof(header) <= size && pread(archive->fd, &header, sizeof(header), (off_t)at) == sizeof(header)){
+        uint64_t offset[NUM_SECTIONS + 1];
+        if(memcmp(header.magic, ARCHIVE_MAGIC, 8) != 0 || header.version != ARCHIVE_VERSION ||
+           header_crc(header) != header.header_crc || header.num_chats != CHUNK_CHATS ||
+           header.chunk > INT_MAX / CHUNK_CHATS){
+            break;
+        }
+        layout(&header, offset);
+        if(header.body_len != offset[NUM_SECTIONS] || at + sizeof(header) + header.body_len > size){
+            break;
+        }
+        if(set_offset(archive, header.chunk, at) < 0){
+            perror("realloc failed");
+            exit(EXIT_FAILURE);
+        }
+        at += sizeof(header) + header.body_len;
+    }
+
+    if(at < size){
+        printf("SERVER LOG: cut %llu torn bytes off the end of %s\n", (unsigned long long)(size - at), path);
+        if(ftruncate(archive->fd, (off_t)at) < 0){
+            perror("ftruncate of archive failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    archive->end = at;
+    return archive;
+}
+
+void archive_close(Archive *archive){
+    if(archive == NULL){
+        return;
+    }
+    close(archive->fd);
+    pthread_mutex_destroy(&archive->lock);
+    pthread_cond_destroy(&archive->written);
+    free(archive->offset);
+    free(archive->path);
+    free(archive);
+}
+
+/**
+ * Deletes the archive's file when its room is reset, readers that still
+ * have it open keep reading the old chats
+ */
+void archive_remove(Archive *archive){
+    if(archive != NULL && unlink(archive->path) == 0){
+        sync_directory(archive->path);
+    }
+}
+
+/**
+ * Reserves the segment of chunk number, unless the archive already has it
+ *
+ * Called with the room's lock held exclusively, when the chunk is evicted.
+ * A reserved segment has to be written with archive_spill.
+ *
+ * @return 1 if it was reserved, 0 if it is already there, -1 if allocation failed
+ */
+int archive_reserve(Archive *archive, uint64_t number){
+    pthread_mutex_lock(&archive->lock);
+    int reserved = 0;
+    if(number >= archive->num_offsets || archive->offset[number] == NO_SEGMENT){
+        reserved = set_offset(archive, number, PENDING_SEGMENT) < 0 ? -1 : 1;
+        archive->pending += reserved > 0;
+    }
+    pthread_mutex_unlock(&archive->lock);
+    return reserved;
+}
+
+/**
+ * Appends the segment of chunk number that archive_reserve reserved
+ *
+ * Called without the room's lock. The chunk was evicted, so no reaction
+ * changes it anymore, and it is pinned until the segment is written.
+ * Exits if allocation or the write fails, like the log does.
+ */
+void archive_spill(Archive *archive, ChatChunk *chunk, uint64_t number){
+    SegmentHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, 8);
+    header.version = ARCHIVE_VERSION;
+    header.num_chats = CHUNK_CHATS;
+    header.chunk = number;
+    for(int i = 0; i < CHUNK_CHATS; i++){
+        header.num_groups += chunk->num_groups[i];
+        for(uint32_t g = 0; g < chunk->num_groups[i]; g++){
+            header.num_reactions += chunk->groups[i][g].count;
+        }
+        header.messages_len += chunk->message_len[i] + 1;
+    }
+
+    uint64_t offset[NUM_SECTIONS + 1];
+    layout(&header, offset);
+    header.body_len = offset[NUM_SECTIONS];
+
+    //calloc zeroes the padding between the sections
+    char *body = calloc(1, header.body_len);
+    if(body == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(body + offset[SECTION_TIME], chunk->time, sizeof(chunk->time));
+    memcpy(body + offset[SECTION_USER], chunk->user, sizeof(chunk->user));
+    memcpy(body + offset[SECTION_GROUP_COUNT], chunk->num_groups, sizeof(chunk->num_groups));
+    memcpy(body + offset[SECTION_MESSAGE_LEN], chunk->message_len, sizeof(chunk->message_len));
+
+    ArchiveGroup *groups = (ArchiveGroup*)(body + offset[SECTION_GROUPS]);
+    uint32_t *users = (uint32_t*)(body + offset[SECTION_REACTION_USERS]);
+    char *messages = body + offset[SECTION_MESSAGES];
+    for(int i = 0; i < CHUNK_CHATS; i++){
+        for(uint32_t g = 0; g < chunk->num_groups[i]; g++){
+            ReactionGroup *group = &chunk->groups[i][g];
+            groups->token = group->token;
+            groups->count = group->count;
+            groups++;
+            memcpy(users, group->users, sizeof(uint32_t) * group->count);
+            users += group->count;
+        }
+        memcpy(messages, chunk->message[i], chunk->message_len[i] + 1);
+        messages += chunk->message_len[i] + 1;
+    }
+
+    header.body_crc = crc32_update(0, body, header.body_len);
+    header.header_crc = header_crc(header);
+
+    //segments of chunks evicted one after the other may be written at the same time
+    pthread_mutex_lock(&archive->lock);
+    uint64_t start = archive->end;
+    archive->end += sizeof(header) + header.body_len;
+    pthread_mutex_unlock(&archive->lock);
+
+    uint64_t at = start;
+    const char *parts[2] = {(const char*)&header, body};
+    size_t lens[2] = {sizeof(header), header.body_len};
+    for(int p = 0; p < 2; p++){
+        const char *data = parts[p];
+        size_t len = lens[p];
+        while(len > 0){
+            ssize_t n = pwrite(archive->fd, data, len, (off_t)at);
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            if(n < 0){
+                perror("write to archive failed");
+                exit(EXIT_FAILURE);
+            }
+            data += n;
+            len -= n;
+            at += n;
+        }
+    }
+    free(body);
+
+    pthread_mutex_lock(&archive->lock);
+    archive->offset[number] = start;
+    archive->pending--;
+    pthread_cond_broadcast(&archive->written);
+    pthread_mutex_unlock(&archive->lock);
+}
+
+/**
+ * Syncs the segments appended so far, before a snapshot lets the log drop
+ * them, waiting for the ones that are reserved to be written first
+ */
+void archive_sync(Archive *archive){
+    if(archive == NULL){
+        return;
+    }
+    pthread_mutex_lock(&archive->lock);
+    while(archive->pending > 0){
+        pthread_cond_wait(&archive->written, &archive->lock);
+    }
+    pthread_mutex_unlock(&archive->lock);
+
+    if(fdatasync(archive->fd) < 0){
+        perror("fdatasync of archive failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Frees a chunk from archive_load
+ */
+void archive_free_chunk(ChatChunk *chunk){
+    for(int i = 0; i < CHUNK_CHATS; i++){
+        free(chunk->groups[i]);
+    }
+    free_arena(&chunk->messages);
+    free(chunk);
+}
+
+static ChatChunk *corrupt_segment(Archive *archive, ChatChunk *chunk, uint64_t number){
+    fprintf(stderr, "%s: segment of chats #%llu to #%llu is corrupt\n", archive->path,
+            (unsigned long long)(number * CHUNK_CHATS + 1), (unsigned long long)((number + 1) * CHUNK_CHATS));
+    archive_free_chunk(chunk);
+    return NULL;
+}
+
+/**
+ * Reads chunk number back from the archive
+ *
+ * The chunk has no transcript, its messages and groups point into its
+ * copy of the segment. Free it with archive_free_chunk.
+ *
+ * @return the chunk, NULL if the archive doesn't have it or it is corrupt
+ */
+ChatChunk *archive_load(Archive *archive, ChatList *list, uint64_t number){
+    if(archive == NULL){
+        return NULL;
+    }
+
+    //a chunk evicted just now may still be on its way to the disk
+    pthread_mutex_lock(&archive->lock);
+    uint64_t at = number < archive->num_offsets ? archive->offset[number] : NO_SEGMENT;
+    while(at == PENDING_SEGMENT){
+        pthread_cond_wait(&archive->written, &archive->lock);
+        at = archive->offset[number];
+    }
+    pthread_mutex_unlock(&archive->lock);
+    if(at == NO_SEGMENT){
+        return NULL;
+    }
+
+    //the header was checked when the archive was opened or the segment was written
+    SegmentHeader header;
+    if(pread(archive->fd, &header, sizeof(header), (off_t)at) != sizeof(header)){
+        return NULL;
+    }
+    uint64_t offset[NUM_SECTIONS + 1];
+    layout(&header, offset);
+
+    ChatChunk *chunk = calloc(1, sizeof(ChatChunk));
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + header.body_len);
+    if(chunk == NULL || block == NULL){
+        free(chunk);
+        free(block);
+        return NULL;
+    }
+    block->next = NULL;
+    block->used = header.body_len;
+    chunk->messages.blocks = block;
+    chunk->number = number;
+
+    char *body = block->data;
+    if(pread(archive->fd, body, header.body_len, (off_t)(at + sizeof(header))) != (ssize_t)header.body_len ||
+       crc32_update(0, body, header.body_len) != header.body_crc){
+        return corrupt_segment(archive, chunk, number);
+    }
+
+    memcpy(chunk->time, body + offset[SECTION_TIME], sizeof(chunk->time));
+    memcpy(chunk->user, body + offset[SECTION_USER], sizeof(chunk->user));
+    memcpy(chunk->num_groups, body + offset[SECTION_GROUP_COUNT], sizeof(chunk->num_groups));
+    memcpy(chunk->message_len, body + offset[SECTION_MESSAGE_LEN], sizeof(chunk->message_len));
+
+    //indexes are checked against the room's tables, the segment may be from before a reset
+    uint32_t num_users = list->users.count;
+    uint32_t num_tokens = list->tokens.count;
+    const ArchiveGroup *groups = (const ArchiveGroup*)(body + offset[SECTION_GROUPS]);
+    uint32_t *users = (uint32_t*)(body + offset[SECTION_REACTION_USERS]);
+    uint64_t group = 0, reaction = 0, message = 0;
+    for(int i = 0; i < CHUNK_CHATS; i++){
+        if(chunk->user[i] >= num_users || group + chunk->num_groups[i] > header.num_groups ||
+           message + chunk->message_len[i] >= header.messages_len ||
+           body[offset[SECTION_MESSAGES] + message + chunk->message_len[i]] != '\0'){
+            return corrupt_segment(archive, chunk, number);
+        }
+        chunk->message[i] = body + offset[SECTION_MESSAGES] + message;
+        message += chunk->message_len[i] + 1;
+
+        if(chunk->num_groups[i] == 0){
+            continue;
+        }
+        chunk->groups[i] = malloc(sizeof(ReactionGroup) * chunk->num_groups[i]);
+        if(chunk->groups[i] == NULL){
+            archive_free_chunk(chunk);
+            return NULL;
+        }
+        for(uint32_t g = 0; g < chunk->num_groups[i]; g++, group++){
+            if(groups[group].token >= num_tokens || groups[group].count > header.num_reactions - reaction){
+                return corrupt_segment(archive, chunk, number);
+            }
+            ReactionGroup *restored = &chunk->groups[i][g];
+            memset(restored, 0, sizeof(ReactionGroup));
+            restored->token = groups[group].token;
+            restored->count = groups[group].count;
+            restored->users = users + reaction;
+            reaction += groups[group].count;
+            for(uint32_t j = 0; j < restored->count; j++){
+                if(restored->users[j] >= num_users){
+                    return corrupt_segment(archive, chunk, number);
+                }
+            }
+        }
+    }
+    return chunk;
+}
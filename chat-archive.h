@@ -0,0 +1,24 @@
+#ifndef CHAT_ARCHIVE_H
+#define CHAT_ARCHIVE_H
+
+#include "chat-store.h"
+
+#include <stdint.h>
+
+/**
+ * Evicted chats of a room on disk, see chat-archive.c
+ */
+typedef struct Archive Archive;
+
+void archive_init(const char *path);
+Archive *archive_open(const char *room);
+void archive_close(Archive *archive);
+void archive_remove(Archive *archive);
+
+int archive_reserve(Archive *archive, uint64_t number);
+void archive_spill(Archive *archive, ChatChunk *chunk, uint64_t number);
+ChatChunk *archive_load(Archive *archive, ChatList *list, uint64_t number);
+void archive_free_chunk(ChatChunk *chunk);
+void archive_sync(Archive *archive);
+
+#endif
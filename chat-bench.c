@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/**
+ * GENERAL STRUCTURE OF THE FILE ->
+ *
+ * Load generator for chat-server, run by "make bench"
+ *
+ * Histogram -- log-linear latency buckets, like HdrHistogram
+ *
+ * Connections -- one keep-alive HTTP/1.1 connection per client thread
+ *
+ * Clients -- closed loop (next request when the answer is in) or open loop
+ *            (requests at a fixed rate, late answers count from when the
+ *            request should have gone out)
+ *
+ * main()
+ *
+ * Usage: ./chat-bench [-h host] [-p port] [-c connections] [-d seconds] [-r rate]
+ *                     [-m post=N,react=N,chats=N] [-H history] [-n rooms] [-q query]
+ */
+
+
+/**
+ * Histogram
+ *
+ * Values below 2^LINEAR_BITS nanoseconds get a bucket each, every power of
+ * two above that is split into SUB_BUCKETS buckets, so a recorded latency
+ * is off by at most 1/SUB_BUCKETS. Percentiles report the top of their
+ * bucket, like HdrHistogram's highest equivalent value.
+ */
+#define SUB_BITS 6
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define LINEAR_BITS (SUB_BITS + 1)
+#define NUM_BUCKETS ((1 << LINEAR_BITS) + (64 - LINEAR_BITS) * SUB_BUCKETS)
+
+struct Histogram {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[NUM_BUCKETS];
+};
+typedef struct Histogram Histogram;
+
+static int bucket_of(uint64_t value){
+    if(value < (1 << LINEAR_BITS)){
+        return (int)value;
+    }
+    int magnitude = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (magnitude - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return (1 << LINEAR_BITS) + (magnitude - LINEAR_BITS) * SUB_BUCKETS + sub;
+}
+
+//highest value that lands in the bucket
+static uint64_t bucket_top(int bucket){
+    if(bucket < (1 << LINEAR_BITS)){
+        return (uint64_t)bucket;
+    }
+    int magnitude = (bucket - (1 << LINEAR_BITS)) / SUB_BUCKETS + LINEAR_BITS;
+    uint64_t sub = (uint64_t)((bucket - (1 << LINEAR_BITS)) % SUB_BUCKETS);
+    uint64_t width = 1ULL << (magnitude - SUB_BITS);
+    return ((SUB_BUCKETS + sub) << (magnitude - SUB_BITS)) + width - 1;
+}
+
+static void record(Histogram *histogram, uint64_t value){
+    histogram->buckets[bucket_of(value)]++;
+    histogram->count++;
+    if(value > histogram->max){
+        histogram->max = value;
+    }
+}
+
+static void merge(Histogram *into, const Histogram *from){
+    for(int i = 0; i < NUM_BUCKETS; i++){
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if(from->max > into->max){
+        into->max = from->max;
+    }
+}
+
+static uint64_t percentile(const Histogram *histogram, double p){
+    if(histogram->count == 0){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)histogram->count + 0.5);
+    if(rank == 0){
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < NUM_BUCKETS; i++){
+        seen += histogram->buckets[i];
+        if(seen >= rank){
+            uint64_t top = bucket_top(i);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+/**
+ * Settings shared by every client, see main() for the defaults
+ */
+#define OP_POST 0
+#define OP_REACT 1
+#define OP_CHATS 2
+#define NUM_OPS 3
+
+static const char *op_names[NUM_OPS] = {"post", "react", "chats"};
+
+struct Settings {
+    struct sockaddr_in address;
+    int connections;
+    int seconds;
+    double rate;                //requests per second over all connections, 0 for a closed loop
+    int mix[NUM_OPS];           //relative weights
+    int history;                //chats posted to every room before measuring
+    int rooms;
+    const char *query;          //added to every /chats
+};
+typedef struct Settings Settings;
+
+static Settings settings;
+
+static uint64_t now_nanos(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t nanos){
+    struct timespec ts = {.tv_sec = (time_t)(nanos / 1000000000ULL), .tv_nsec = (long)(nanos % 1000000000ULL)};
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR){
+    }
+}
+
+
+/**
+ * Connections
+ *
+ * A request is sent whole and its answer read up to the end of the body
+ * given by Content-Length. The connection is opened again if the server
+ * closed it.
+ */
+#define RESPONSE_BUFFER (64 * 1024)
+#define RECEIVE_TIMEOUT 5       //seconds, an answer taking longer counts as a failed request
+
+struct Connection {
+    int fd;
+    char in[RESPONSE_BUFFER];
+    size_t in_len;
+};
+typedef struct Connection Connection;
+
+static int open_connection(Connection *conn){
+    conn->in_len = 0;
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->fd < 0){
+        return -1;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    //so a client stuck on an answer notices the end of the run
+    struct timeval timeout = {.tv_sec = RECEIVE_TIMEOUT, .tv_usec = 0};
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(connect(conn->fd, (struct sockaddr*)&settings.address, sizeof(settings.address)) < 0){
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void close_connection(Connection *conn){
+    if(conn->fd >= 0){
+        close(conn->fd);
+    }
+    conn->fd = -1;
+}
+
+static int send_all(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Sends the request and waits for the whole answer
+ *
+ * @return the status code, -1 if the connection failed
+ */
+static int exchange(Connection *conn, const char *request, size_t request_len, uint64_t *body_bytes){
+    if(conn->fd < 0 && open_connection(conn) < 0){
+        return -1;
+    }
+    if(send_all(conn->fd, request, request_len) < 0){
+        close_connection(conn);
+        return -1;
+    }
+
+    //read the head
+    conn->in_len = 0;
+    char *head_end = NULL;
+    while(head_end == NULL){
+        if(conn->in_len == sizeof(conn->in) - 1){
+            close_connection(conn);
+            return -1;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len, 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            close_connection(conn);
+            return -1;
+        }
+        conn->in_len += (size_t)n;
+        conn->in[conn->in_len] = '\0';
+        head_end = strstr(conn->in, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if(sscanf(conn->in, "HTTP/1.%*d %d", &status) != 1){
+        close_connection(conn);
+        return -1;
+    }
+    char *length = strcasestr(conn->in, "\r\ncontent-length:");
+    if(length == NULL || length > head_end){
+        close_connection(conn);
+        return -1;
+    }
+    size_t body_len = strtoull(length + strlen("\r\ncontent-length:"), NULL, 10);
+    char *close_header = strcasestr(conn->in, "\r\nconnection: close");
+    int closing = close_header != NULL && close_header < head_end;
+
+    //skip the body, only its size matters
+    size_t have = conn->in_len - (size_t)(head_end + 4 - conn->in);
+    while(have < body_len){
+        size_t want = body_len - have < sizeof(conn->in) ? body_len - have : sizeof(conn->in);
+        ssize_t n = recv(conn->fd, conn->in, want, 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            close_connection(conn);
+            return -1;
+        }
+        have += (size_t)n;
+    }
+    *body_bytes += body_len;
+
+    if(closing){
+        close_connection(conn);
+    }
+    return status;
+}
+
+
+/**
+ * Clients
+ */
+struct Client {
+    pthread_t thread;
+    int index;
+    uint64_t random;
+    Connection conn;
+
+    Histogram latency[NUM_OPS];
+    uint64_t errors[NUM_OPS];
+    uint64_t bytes;
+};
+typedef struct Client Client;
+
+static uint64_t next_random(Client *client){
+    //xorshift64
+    uint64_t x = client->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    client->random = x;
+    return x;
+}
+
+static int pick_op(Client *client){
+    int total = settings.mix[OP_POST] + settings.mix[OP_REACT] + settings.mix[OP_CHATS];
+    int r = (int)(next_random(client) % (uint64_t)total);
+    for(int op = 0; op < NUM_OPS; op++){
+        if(r < settings.mix[op]){
+            return op;
+        }
+        r -= settings.mix[op];
+    }
+    return OP_CHATS;
+}
+
+/**
+ * @return length of the request line and headers written to request
+ */
+static int format_request(Client *client, int op, char *request, size_t size){
+    int room = (int)(next_random(client) % (uint64_t)settings.rooms);
+    int n = (int)(next_random(client) % 100000);
+    const char *end = " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    //posts and reactions only ask for an ack, so they measure the write path
+    if(op == OP_POST){
+        return snprintf(request, size, "GET /post?room=bench%d&user=client%d&message=benchmark%%20message%%20%d&reply=ack%s",
+                        room, client->index, n, end);
+    }
+    if(op == OP_REACT){
+        int id = settings.history > 0 ? 1 + (int)(next_random(client) % (uint64_t)settings.history) : 1;
+        return snprintf(request, size, "GET /react?room=bench%d&id=%d&user=client%d&message=%%2B1&reply=ack%s",
+                        room, id, client->index, end);
+    }
+    return snprintf(request, size, "GET /chats?room=bench%d%s%s%s", room, settings.query[0] ? "&" : "", settings.query, end);
+}
+
+static _Atomic int stop = 0;
+
+static void *run_client(void *arg){
+    Client *client = (Client*)arg;
+    char request[512];
+
+    //in an open loop every connection sends at rate / connections, starting a bit apart
+    uint64_t interval = settings.rate > 0 ? (uint64_t)(1e9 * settings.connections / settings.rate) : 0;
+    uint64_t next = now_nanos() + (interval * (uint64_t)client->index) / (uint64_t)settings.connections;
+
+    while(!atomic_load(&stop)){
+        int op = pick_op(client);
+        int len = format_request(client, op, request, sizeof(request));
+
+        uint64_t start;
+        if(interval > 0){
+            sleep_until(next);
+            start = next;
+            next += interval;
+        }
+        else{
+            start = now_nanos();
+        }
+
+        int status = exchange(&client->conn, request, (size_t)len, &client->bytes);
+        uint64_t done = now_nanos();
+        if(atomic_load(&stop)){
+            break;
+        }
+
+        //an answer that arrived late counts from when the request was due, so a stall isn't hidden
+        record(&client->latency[op], done - start);
+        if(status != 200){
+            client->errors[op]++;
+        }
+    }
+
+    close_connection(&client->conn);
+    return NULL;
+}
+
+/**
+ * Resets the bench rooms and posts history chats to each
+ */
+static void fill_history(){
+    Client *client = calloc(1, sizeof(Client));
+    if(client == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    client->conn.fd = -1;
+    client->random = 88172645463325252ULL;
+
+    char request[512];
+    for(int room = 0; room < settings.rooms; room++){
+        int len = snprintf(request, sizeof(request), "GET /reset?room=bench%d HTTP/1.1\r\nHost: localhost\r\n\r\n", room);
+        if(exchange(&client->conn, request, (size_t)len, &client->bytes) != 200){
+            fprintf(stderr, "chat-bench: cannot reach the server on port %d\n", ntohs(settings.address.sin_port));
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < settings.history; i++){
+            len = snprintf(request, sizeof(request),
+                           "GET /post?room=bench%d&user=history%d&message=history%%20chat%%20%d&reply=ack HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                           room, i % 50, i);
+            if(exchange(&client->conn, request, (size_t)len, &client->bytes) != 200){
+                fprintf(stderr, "chat-bench: posting the history failed at chat %d of room bench%d\n", i + 1, room);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    close_connection(&client->conn);
+    free(client);
+}
+
+static void print_row(const char *name, const Histogram *histogram, uint64_t errors, double seconds){
+    printf("%-6s %10llu %8llu %11.0f", name, (unsigned long long)histogram->count, (unsigned long long)errors,
+           (double)histogram->count / seconds);
+    double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    for(int i = 0; i < 5; i++){
+        printf(" %9.1f", (double)percentile(histogram, percentiles[i]) / 1000.0);
+    }
+    printf(" %9.1f\n", (double)histogram->max / 1000.0);
+}
+
+static int parse_mix(char *mix){
+    int weights[NUM_OPS] = {0, 0, 0};
+    for(char *part = strtok(mix, ","); part != NULL; part = strtok(NULL, ",")){
+        char *equals = strchr(part, '=');
+        if(equals == NULL){
+            return -1;
+        }
+        *equals = '\0';
+
+        int op = 0;
+        while(op < NUM_OPS && strcmp(part, op_names[op]) != 0){
+            op++;
+        }
+        int weight = atoi(equals + 1);
+        if(op == NUM_OPS || weight < 0){
+            return -1;
+        }
+        weights[op] = weight;
+    }
+    if(weights[OP_POST] + weights[OP_REACT] + weights[OP_CHATS] == 0){
+        return -1;
+    }
+    memcpy(settings.mix, weights, sizeof(weights));
+    return 0;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-d seconds] [-r rate] "
+                    "[-m post=N,react=N,chats=N] [-H history] [-n rooms] [-q query]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+/**
+ * The main function
+ *
+ * -c connections, one thread each, 16 by default
+ * -d seconds to measure, 10 by default
+ * -r requests per second over all connections for an open loop, a closed
+ *    loop without it
+ * -m relative weights of the requests, post=40,react=20,chats=40 by default
+ * -H chats posted to each room before measuring, 1000 by default
+ * -n rooms the requests are spread over, bench0 to bench<n-1>, 1 by default
+ * -q query string added to every /chats, "tail=100" by default
+ */
+int main(int argc, char *argv[]){
+    const char *host = "127.0.0.1";
+    int port = 8080;
+    settings.connections = 16;
+    settings.seconds = 10;
+    settings.rate = 0;
+    settings.mix[OP_POST] = 40;
+    settings.mix[OP_REACT] = 20;
+    settings.mix[OP_CHATS] = 40;
+    settings.history = 1000;
+    settings.rooms = 1;
+    settings.query = "tail=100";
+
+    int option;
+    while((option = getopt(argc, argv, "h:p:c:d:r:m:H:n:q:")) != -1){
+        switch(option){
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': settings.connections = atoi(optarg); break;
+            case 'd': settings.seconds = atoi(optarg); break;
+            case 'r': settings.rate = atof(optarg); break;
+            case 'm':
+                if(parse_mix(optarg) < 0){
+                    usage(argv[0]);
+                }
+                break;
+            case 'H': settings.history = atoi(optarg); break;
+            case 'n': settings.rooms = atoi(optarg); break;
+            case 'q': settings.query = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(settings.connections <= 0 || settings.seconds <= 0 || settings.rooms <= 0 || settings.history < 0 || settings.rate < 0){
+        usage(argv[0]);
+    }
+
+    settings.address.sin_family = AF_INET;
+    settings.address.sin_port = htons((uint16_t)port);
+    if(inet_pton(AF_INET, host, &settings.address.sin_addr) != 1){
+        fprintf(stderr, "chat-bench: %s is not an IPv4 address\n", host);
+        exit(EXIT_FAILURE);
+    }
+
+    fill_history();
+
+    Client *clients = calloc((size_t)settings.connections, sizeof(Client));
+    if(clients == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t started = now_nanos();
+    for(int i = 0; i < settings.connections; i++){
+        clients[i].index = i;
+        clients[i].random = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+        clients[i].conn.fd = -1;
+        if(pthread_create(&clients[i].thread, NULL, run_client, &clients[i]) != 0){
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sleep_until(started + (uint64_t)settings.seconds * 1000000000ULL);
+    atomic_store(&stop, 1);
+
+    for(int i = 0; i < settings.connections; i++){
+        pthread_join(clients[i].thread, NULL);
+    }
+    double seconds = (double)(now_nanos() - started) / 1e9;
+
+    Histogram *totals = calloc(NUM_OPS + 1, sizeof(Histogram));
+    uint64_t errors[NUM_OPS + 1] = {0};
+    uint64_t bytes = 0;
+    if(totals == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < settings.connections; i++){
+        for(int op = 0; op < NUM_OPS; op++){
+            merge(&totals[op], &clients[i].latency[op]);
+            merge(&totals[NUM_OPS], &clients[i].latency[op]);
+            errors[op] += clients[i].errors[op];
+            errors[NUM_OPS] += clients[i].errors[op];
+        }
+        bytes += clients[i].bytes;
+    }
+
+    printf("chat-bench: %d connections, %.1f s, ", settings.connections, seconds);
+    if(settings.rate > 0){
+        printf("open loop at %.0f req/s", settings.rate);
+    }
+    else{
+        printf("closed loop");
+    }
+    printf(", post=%d react=%d chats=%d, %d room(s) with %d chats of history, /chats?%s\n",
+           settings.mix[OP_POST], settings.mix[OP_REACT], settings.mix[OP_CHATS], settings.rooms, settings.history, settings.query);
+    printf("%-6s %10s %8s %11s %9s %9s %9s %9s %9s %9s   (latency in us)\n",
+           "", "requests", "errors", "req/s", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    for(int op = 0; op < NUM_OPS; op++){
+        if(settings.mix[op] > 0){
+            print_row(op_names[op], &totals[op], errors[op], seconds);
+        }
+    }
+    print_row("all", &totals[NUM_OPS], errors[NUM_OPS], seconds);
+    printf("%.1f MB/s of response bodies\n", (double)bytes / seconds / 1e6);
+
+    free(totals);
+    free(clients);
+    return 0;
+}
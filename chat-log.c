@@ -0,0 +1,635 @@
+#include "chat-log.h"
+#include "chat-store.h"
+#include "chat-snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <zlib.h>
+
+
+/**
+ * Write-ahead log
+ *
+ * add_chat, add_reaction and reset_chats append a record for every change
+ * while they still hold the lock that orders it, so the log has the changes
+ * in the order they were made. Appending only copies the record into the
+ * pending buffer. The log thread takes whatever is pending, writes it with
+ * one write() and syncs it with one fdatasync(), so every request that came
+ * in while the previous sync ran shares the next one (group commit).
+ *
+ * The position right after a record is its LSN. With DURABILITY_SYNC the
+ * handler holds its response until the log thread released that LSN, the
+ * worker keeps serving other connections in the meantime.
+ *
+ * The log is split into segments, <log>.1, <log>.2 and so on. A snapshot
+ * (see chat-snapshot.c) rotates to a new segment at the moment it copies
+ * the chats, so it covers exactly the segments before that one, which are
+ * deleted once the snapshot is on disk.
+ *
+ * On startup the snapshot is loaded and the segments after it are replayed
+ * through the same store functions. A torn or corrupt record at the end of
+ * the last segment, from a crash in the middle of a write, is cut off and
+ * appending continues from the last good record.
+ *
+ * Segment layout, integers in native byte order:
+ *      "CHATLOG2"
+ *      records: uint32 length of the rest, uint32 crc32 of the rest, uint8 type,
+ *               uint8 room name length, room name, fields
+ *
+ *      LOG_CHAT      int64 time, uint8 username length, uint16 message length, username, message
+ *      LOG_REACTION  uint32 chat id, uint8 username length, uint16 message length, username, message
+ *      LOG_RESET     no fields
+ */
+#define LOG_MAGIC "CHATLOG2"
+#define LOG_MAGIC_LEN 8
+#define LOG_HEADER 8            //length and crc
+#define LOG_MAX_RECORD 1024     //type and fields of the largest record, with room to spare
+
+#define LOG_CHAT 1
+#define LOG_REACTION 2
+#define LOG_RESET 3
+
+static char *log_path = NULL;
+static int log_fd = -1;        //the segment the log thread writes to
+static int log_durability = DURABILITY_SYNC;
+static int log_running = 0;     //records are only appended once log_start ran, not while replaying
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+//records appended since the log thread last took them
+static char *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_capacity = 0;
+static uint64_t appended_lsn = 0;
+
+//segments, newest_segment and rotate_lsn are guarded by log_lock
+#define NO_ROTATION UINT64_MAX
+static uint64_t first_segment = 1;      //oldest segment on disk
+static uint64_t newest_segment = 1;     //the segment new records go to
+static uint64_t rotate_lsn = NO_ROTATION;   //records from here on go to the next segment
+
+//LSN of the last record the current thread appended, for log_commit_ticket
+static _Thread_local uint64_t last_lsn = 0;
+
+
+/**
+ * Extends crc over len more bytes, start with 0
+ *
+ * zlib's CRC-32, the one gzip uses too. Nothing is added for len 0, zlib
+ * would start over on a NULL buffer.
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len){
+    return len > 0 ? (uint32_t)crc32_z(crc, data, len) : crc;
+}
+
+
+/**
+ * @return one of the DURABILITY_ modes, -1 if the name is not one
+ */
+int parse_durability(const char *name){
+    if(strcmp(name, "sync") == 0){
+        return DURABILITY_SYNC;
+    }
+    if(strcmp(name, "batch") == 0){
+        return DURABILITY_BATCH;
+    }
+    if(strcmp(name, "async") == 0){
+        return DURABILITY_ASYNC;
+    }
+    return -1;
+}
+
+
+/**
+ * Appending records
+ */
+
+/**
+ * Frames the record in record[LOG_HEADER..LOG_HEADER + len) and queues it for the log thread
+ */
+static void append_record(char *record, size_t len){
+    if(!log_running){
+        return;
+    }
+
+    uint32_t body_len = (uint32_t)len;
+    uint32_t crc = crc32_update(0, record + LOG_HEADER, len);
+    memcpy(record, &body_len, 4);
+    memcpy(record + 4, &crc, 4);
+    len += LOG_HEADER;
+
+    pthread_mutex_lock(&log_lock);
+
+    if(pending_len + len > pending_capacity){
+        size_t capacity = pending_capacity ? pending_capacity : 64 * 1024;
+        while(capacity < pending_len + len){
+            capacity *= 2;
+        }
+        char *grown = realloc(pending, capacity);
+        if(grown == NULL){
+            //the change is already made, it can't be allowed to go unlogged
+            perror("log buffer allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+
+    memcpy(pending + pending_len, record, len);
+    pending_len += len;
+    appended_lsn += len;
+    last_lsn = appended_lsn;
+
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Writes type and room after the header
+ *
+ * @return where the fields go
+ */
+static char *encode_room(char *record, uint8_t type, const char *room){
+    uint8_t room_len = (uint8_t)strnlen(room, ROOM_NAME - 1);
+
+    char *at = record + LOG_HEADER;
+    *at++ = type;
+    *at++ = room_len;
+    memcpy(at, room, room_len);
+    return at + room_len;
+}
+
+/**
+ * Writes type, room, the number and the two strings after the header
+ *
+ * @return length of the record without the header
+ */
+static size_t encode_record(char *record, uint8_t type, const char *room, const void *number, size_t number_len,
+                            const char *username, const char *message){
+    uint8_t username_len = (uint8_t)strnlen(username, 255);
+    uint16_t message_len = (uint16_t)strnlen(message, 255);
+
+    char *at = encode_room(record, type, room);
+    memcpy(at, number, number_len);
+    at += number_len;
+    memcpy(at, &username_len, 1);
+    memcpy(at + 1, &message_len, 2);
+    at += 3;
+    memcpy(at, username, username_len);
+    at += username_len;
+    memcpy(at, message, message_len);
+    at += message_len;
+
+    return at - (record + LOG_HEADER);
+}
+
+void log_chat(const char *room, int64_t time, const char *username, const char *message){
+    char record[LOG_HEADER + LOG_MAX_RECORD];
+    append_record(record, encode_record(record, LOG_CHAT, room, &time, sizeof(time), username, message));
+}
+
+void log_reaction(const char *room, int id, const char *username, const char *message){
+    char record[LOG_HEADER + LOG_MAX_RECORD];
+    uint32_t chat = (uint32_t)id;
+    append_record(record, encode_record(record, LOG_REACTION, room, &chat, sizeof(chat), username, message));
+}
+
+void log_reset(const char *room){
+    char record[LOG_HEADER + 2 + ROOM_NAME];
+    append_record(record, encode_room(record, LOG_RESET, room) - (record + LOG_HEADER));
+}
+
+/**
+ * Ticket to hold the current request's response for, see http_hold_response
+ *
+ * @return the LSN of the last record the calling thread appended with
+ *         DURABILITY_SYNC, 0 otherwise
+ */
+uint64_t log_commit_ticket(){
+    uint64_t ticket = log_durability == DURABILITY_SYNC ? last_lsn : 0;
+    last_lsn = 0;
+    return ticket;
+}
+
+
+/**
+ * Starts a new segment at the current end of the log
+ *
+ * Called by the snapshot with every room's lock held exclusively, so no record is
+ * being appended and the snapshot has exactly the changes before the new
+ * segment.
+ *
+ * @return the new segment, 0 if the previous rotation isn't done yet
+ */
+uint64_t log_rotate(){
+    pthread_mutex_lock(&log_lock);
+    if(rotate_lsn != NO_ROTATION){
+        pthread_mutex_unlock(&log_lock);
+        return 0;
+    }
+    rotate_lsn = appended_lsn;
+    uint64_t next = ++newest_segment;
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_lock);
+    return next;
+}
+
+/**
+ * @return how many bytes of records were appended since the server started
+ */
+uint64_t log_position(){
+    pthread_mutex_lock(&log_lock);
+    uint64_t lsn = appended_lsn;
+    pthread_mutex_unlock(&log_lock);
+    return lsn;
+}
+
+static void segment_path(uint64_t segment, char *path, size_t size){
+    snprintf(path, size, "%s.%llu", log_path, (unsigned long long)segment);
+}
+
+/**
+ * Deletes the segments before the given one, once a snapshot covers them
+ */
+void log_remove_segments(uint64_t before){
+    char path[4096];
+    for(; first_segment < before; first_segment++){
+        segment_path(first_segment, path, sizeof(path));
+        unlink(path);
+    }
+}
+
+/**
+ * Copies the directory part of path into dir
+ *
+ * @return the file name part of path
+ */
+static const char *split_path(const char *path, char *dir, size_t size){
+    const char *slash = strrchr(path, '/');
+    if(slash == NULL){
+        snprintf(dir, size, ".");
+        return path;
+    }
+    snprintf(dir, size, "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    return slash + 1;
+}
+
+/**
+ * fsyncs the directory the file at path is in, so a file created or
+ * renamed there survives a crash
+ */
+void sync_directory(const char *path){
+    char dir[4096];
+    split_path(path, dir, sizeof(dir));
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd >= 0){
+        fsync(fd);
+        close(fd);
+    }
+}
+
+
+/**
+ * Log thread
+ */
+static void write_all(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0){
+            perror("write to log failed");
+            exit(EXIT_FAILURE);
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Opens a segment for appending, new ones start with the magic
+ */
+static int open_segment(uint64_t segment){
+    char path[4096];
+    segment_path(segment, path, sizeof(path));
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0){
+        perror("open of log segment failed");
+        exit(EXIT_FAILURE);
+    }
+    if(lseek(fd, 0, SEEK_END) == 0){
+        write_all(fd, LOG_MAGIC, LOG_MAGIC_LEN);
+        sync_directory(path);
+    }
+    return fd;
+}
+
+static void *run_log(void *arg){
+    char *writing = NULL;
+    size_t writing_capacity = 0;
+
+    while(1){
+        //batches gather what came in during the pause, sync and async go right away
+        if(log_durability == DURABILITY_BATCH){
+            struct timespec pause = {0, LOG_BATCH_MS * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+
+        pthread_mutex_lock(&log_lock);
+        while(pending_len == 0 && rotate_lsn == NO_ROTATION){
+            pthread_cond_wait(&log_wake, &log_lock);
+        }
+
+        //swap buffers, appenders fill the other one while this one is written
+        char *full = pending;
+        size_t full_len = pending_len;
+        size_t full_capacity = pending_capacity;
+        pending = writing;
+        pending_capacity = writing_capacity;
+        pending_len = 0;
+        writing = full;
+        writing_capacity = full_capacity;
+        uint64_t lsn = appended_lsn;
+        uint64_t rotate_at = rotate_lsn;
+
+        pthread_mutex_unlock(&log_lock);
+
+        //the records before the rotation finish the old segment
+        size_t before = 0;
+        if(rotate_at != NO_ROTATION){
+            before = rotate_at - (lsn - full_len);
+            write_all(log_fd, writing, before);
+            if(fdatasync(log_fd) < 0){
+                perror("fdatasync of log failed");
+                exit(EXIT_FAILURE);
+            }
+            close(log_fd);
+
+            pthread_mutex_lock(&log_lock);
+            uint64_t segment = newest_segment;
+            pthread_mutex_unlock(&log_lock);
+            log_fd = open_segment(segment);
+
+            pthread_mutex_lock(&log_lock);
+            rotate_lsn = NO_ROTATION;
+            pthread_mutex_unlock(&log_lock);
+        }
+
+        write_all(log_fd, writing + before, full_len - before);
+        if(log_durability != DURABILITY_ASYNC && fdatasync(log_fd) < 0){
+            perror("fdatasync of log failed");
+            exit(EXIT_FAILURE);
+        }
+        if(log_durability == DURABILITY_SYNC){
+            http_release(lsn);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Replaying
+ */
+
+/**
+ * Reads the fields of a LOG_CHAT or LOG_REACTION record into username and message
+ *
+ * @return 0 on success, -1 if the lengths don't add up
+ */
+static int decode_strings(const char *fields, size_t len, char *username, char *message){
+    if(len < 3){
+        return -1;
+    }
+    uint8_t username_len;
+    uint16_t message_len;
+    memcpy(&username_len, fields, 1);
+    memcpy(&message_len, fields + 1, 2);
+    if((size_t)3 + username_len + message_len != len){
+        return -1;
+    }
+
+    memcpy(username, fields + 3, username_len);
+    username[username_len] = '\0';
+    memcpy(message, fields + 3 + username_len, message_len);
+    message[message_len] = '\0';
+    return 0;
+}
+
+/**
+ * Applies one record to the store
+ *
+ * @return 0 on success, -1 if the record is malformed
+ */
+static int replay_record(const char *record, size_t len){
+    char room_name[ROOM_NAME];
+    char username[256];
+    char message[LOG_MAX_RECORD];
+
+    //type and room
+    if(len < 2 || (uint8_t)record[1] >= ROOM_NAME || len < (size_t)2 + (uint8_t)record[1]){
+        return -1;
+    }
+    memcpy(room_name, record + 2, (uint8_t)record[1]);
+    room_name[(uint8_t)record[1]] = '\0';
+    const char *fields = record + 2 + (uint8_t)record[1];
+    len -= fields - record;
+
+    Room *room = get_room(room_name, 1);
+    if(room == NULL){
+        fprintf(stderr, "room %s can't be created, the log has more than %d rooms\n", room_name, MAX_ROOMS);
+        exit(EXIT_FAILURE);
+    }
+
+    switch(record[0]){
+        case LOG_CHAT: {
+            int64_t time;
+            if(len < sizeof(time) || decode_strings(fields + sizeof(time), len - sizeof(time), username, message) < 0){
+                return -1;
+            }
+            memcpy(&time, fields, sizeof(time));
+            add_chat_at(room, username, message, time);
+            return 0;
+        }
+        case LOG_REACTION: {
+            uint32_t id;
+            if(len < sizeof(id) || decode_strings(fields + sizeof(id), len - sizeof(id), username, message) < 0){
+                return -1;
+            }
+            memcpy(&id, fields, sizeof(id));
+            add_reaction(room, username, message, (int)id);
+            return 0;
+        }
+        case LOG_RESET:
+            if(len != 0){
+                return -1;
+            }
+            reset_chats(room);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Replays one segment
+ *
+ * A bad record ends the replay. In the last segment that is a torn write,
+ * everything from there on is cut off, in any other segment it is a hole
+ * in the history and the server refuses to start.
+ *
+ * @return number of records replayed
+ */
+static int replay_segment(uint64_t segment, int last){
+    char path[4096];
+    segment_path(segment, path, sizeof(path));
+
+    int fd = open(path, O_RDWR);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "rb");
+    if(file == NULL){
+        perror("open of log segment failed");
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[LOG_MAGIC_LEN];
+    size_t magic_len = fread(magic, 1, LOG_MAGIC_LEN, file);
+    if(magic_len > 0 && (magic_len < LOG_MAGIC_LEN || memcmp(magic, LOG_MAGIC, LOG_MAGIC_LEN) != 0)){
+        fprintf(stderr, "%s is not a chat log\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    //good is the end of the last record that was read in full and checked out
+    uint64_t good = magic_len;
+    int records = 0;
+    char record[LOG_MAX_RECORD];
+    while(magic_len > 0){
+        uint32_t header[2];
+        if(fread(header, 1, LOG_HEADER, file) != LOG_HEADER){
+            break;
+        }
+        uint32_t len = header[0];
+        if(len == 0 || len > LOG_MAX_RECORD || fread(record, 1, len, file) != len){
+            break;
+        }
+        if(crc32_update(0, record, len) != header[1] || replay_record(record, len) < 0){
+            break;
+        }
+        good += LOG_HEADER + len;
+        records++;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+
+    if((uint64_t)size > good){
+        if(!last){
+            fprintf(stderr, "%s is corrupt at byte %llu\n", path, (unsigned long long)good);
+            exit(EXIT_FAILURE);
+        }
+        printf("SERVER LOG: cut %llu bytes of torn or corrupt records off the end of %s\n",
+               (unsigned long long)(size - good), path);
+        if(ftruncate(fd, (off_t)good) < 0){
+            perror("ftruncate of log failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(file);
+    return records;
+}
+
+/**
+ * @return the highest segment number of the log on disk, 0 if there is none
+ */
+static uint64_t last_segment_on_disk(){
+    char dir[4096];
+    const char *name = split_path(log_path, dir, sizeof(dir));
+
+    DIR *entries = opendir(dir);
+    if(entries == NULL){
+        perror("opendir of log directory failed");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t last = 0;
+    size_t name_len = strlen(name);
+    struct dirent *entry;
+    while((entry = readdir(entries)) != NULL){
+        const char *suffix = entry->d_name + name_len + 1;
+        if(strncmp(entry->d_name, name, name_len) != 0 || entry->d_name[name_len] != '.' ||
+           *suffix < '1' || *suffix > '9' || strspn(suffix, "0123456789") != strlen(suffix)){
+            continue;
+        }
+        uint64_t segment = strtoull(suffix, NULL, 10);
+        if(segment > last){
+            last = segment;
+        }
+    }
+    closedir(entries);
+    return last;
+}
+
+/**
+ * Loads the snapshot and replays the log segments after it into the store
+ *
+ * path is the log's base name, the segments are path.1, path.2, ... and
+ * the snapshot is path.snapshot. Exits if the files can't be read or
+ * aren't a chat log.
+ */
+void log_open(const char *path){
+    log_path = strdup(path);
+    if(log_path == NULL){
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    //segments before the snapshot's are left over from a crash before they were deleted
+    first_segment = snapshot_load(path);
+    uint64_t last = last_segment_on_disk();
+    log_remove_segments(first_segment);
+
+    int records = 0;
+    for(uint64_t segment = first_segment; segment <= last; segment++){
+        char segment_file[4096];
+        segment_path(segment, segment_file, sizeof(segment_file));
+        if(access(segment_file, F_OK) != 0){
+            fprintf(stderr, "%s is missing\n", segment_file);
+            exit(EXIT_FAILURE);
+        }
+        records += replay_segment(segment, segment == last);
+    }
+
+    newest_segment = last > first_segment ? last : first_segment;
+    log_fd = open_segment(newest_segment);
+    printf("SERVER LOG: replayed %d log records from %s\n", records, path);
+}
+
+/**
+ * Starts logging, every change from now on gets a record
+ */
+void log_start(int durability){
+    if(log_fd < 0){
+        return;
+    }
+    log_durability = durability;
+    log_running = 1;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, run_log, NULL) != 0){
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,38 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Write-ahead log of every change to the chats, see chat-log.c
+ *
+ * DURABILITY_SYNC  -- a /post or /react is answered once its record is on disk
+ * DURABILITY_BATCH -- answered right away, the log is synced every LOG_BATCH_MS
+ * DURABILITY_ASYNC -- answered right away, syncing is left to the kernel
+ */
+#define DURABILITY_SYNC 0
+#define DURABILITY_BATCH 1
+#define DURABILITY_ASYNC 2
+
+#define LOG_BATCH_MS 10
+
+int parse_durability(const char *name);
+
+void log_open(const char *path);
+void log_start(int durability);
+
+void log_chat(const char *room, int64_t time, const char *username, const char *message);
+void log_reaction(const char *room, int id, const char *username, const char *message);
+void log_reset(const char *room);
+
+uint64_t log_commit_ticket();
+
+uint64_t log_rotate();
+uint64_t log_position();
+void log_remove_segments(uint64_t before);
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+void sync_directory(const char *path);
+
+#endif
@@ -1,9 +1,19 @@
 #include "http-server.h"
+#include "chat-store.h"
+#include "chat-log.h"
+#include "chat-snapshot.h"
+#include "chat-archive.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <malloc.h>
+#include <errno.h>
+#include <limits.h>
 
 
 /**
@@ -11,19 +21,9 @@
  * 
  * HTTP constant codes
  * 
- * Struct objects:
- *      Reaction
- *      Chat
- *      ChatList
+ * Chat storage, the transcript cache and add_chat()/add_reaction() live in chat-store.c
  * 
- * Constructors for each struct object type
- * 
- * get_time() -- function to easily get time string
- * 
- * Chat server methods:
- *      uint8_t add_chat(char* username, char* message)
- *      uint8_t add_reaction(char* username, char* message, char* id)
- *      unit8_t reset()
+ * Query parameters: copy_param(), get_param(), parse_page(), parse_reply(), parse_room()
  * 
  * Handler methods:
  *      Error handling: 404
@@ -31,8 +31,10 @@
  *      handle_chat()
  *      handle_path()
  *      handle_react()
+ *      handle_subscribe()
  *      handle_reset()
- *      handle_response()
+ *      handle_metrics()
+ *      find_route(), handle_response()
  * 
  * main()
  */
@@ -40,197 +42,255 @@
 
 /**
  * HTTP Codes and Errors
+ * Status line and headers, the server adds the framing headers and the blank line
  * 
  * 404: NOT FOUND error
+ * 304: the page the client has is still current, no body
  * 200: OK reponse, everything is good
+ * 200 json/ndjson: for format=json|ndjson
+ * 200 event stream: for /subscribe
+ * 200 metrics: Prometheus text format, for /metrics
  */
-char const HTTP_404_NOT_FOUND[] = "HTTP/1.1 404 Not found\r\nContent-Type: text/plain\r\n\r\n";
-char const HTTP_200_OK[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-char const HTTP_500_INTERNAL_SERVER[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/plain\r\n\r\n";
+char const HTTP_404_NOT_FOUND[] = "HTTP/1.1 404 Not found\r\nContent-Type: text/plain\r\n";
+char const HTTP_304_NOT_MODIFIED[] = "HTTP/1.1 304 Not Modified\r\n";
+char const HTTP_200_OK[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n";
+char const HTTP_500_INTERNAL_SERVER[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/plain\r\n";
+char const HTTP_200_JSON[] = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n";
+char const HTTP_200_NDJSON[] = "HTTP/1.1 200 OK\r\nContent-Type: application/x-ndjson\r\n";
+char const HTTP_200_EVENT_STREAM[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n";
+char const HTTP_200_METRICS[] = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n";
 
 
 /**
- * Objects: 
+ * Query parameters
  * 
- * Reaction
- * Chat
- * ChatList
+ * copy_param()    -- copies a parameter value out of the request
+ * get_param()     -- value of one parameter of the query string or form body
+ * parse_page()    -- since/limit/tail/time/format of a transcript response
+ * parse_reply()   -- what /post and /react answer with
+ * parse_room()    -- which room a request is for
  */
-struct Reaction {
-    char ruser[16];
-    char rmessage[256];
-};
-typedef struct Reaction Reaction;
-
-struct Chat {
-    uint32_t id;
-    char user[16];
-    char message[350];
-    char timestamp[20];
-    uint32_t num_reactions;
-    uint32_t reaction_capacity;
-    struct Reaction *reactions;
-};
-typedef struct Chat Chat;
 
-struct ChatList{
-    int size;
-    int capacity;
-    struct Chat *chat;
-};
-typedef struct ChatList ChatList;
+/**
+ * Copies a parameter value into dest and NUL-terminates it, the server
+ * decoded it already
+ *
+ * @return length of the value, -1 if it is longer than size - 1 bytes,
+ *         dest then holds as much of it as fits
+ */
+int copy_param(const HttpParam *param, char *dest, size_t size){
+    size_t len = param->value.len;
+    if(len > size - 1){
+        memcpy(dest, param->value.data, size - 1);
+        dest[size - 1] = '\0';
+        return -1;
+    }
 
+    memcpy(dest, param->value.data, len);
+    dest[len] = '\0';
+    return (int)len;
+}
 
 /**
- * Object constructors for:
+ * Copies the decoded value of the parameter into value
  * 
- * Reaction
- * Chat
- * ChatList
+ * @return 1 if the parameter is present, 0 otherwise
  */
-Reaction *new_reaction(char *username, char *message){
-    Reaction *newReaction = (Reaction*)malloc(sizeof(Reaction));
-    
-    //check if malloc failed
-    if(newReaction == NULL){
-        return NULL;
+int get_param(HttpRequest *request, char *name, char *value, size_t size){
+    const HttpParam *param = http_param(request, name);
+    if(param == NULL){
+        return 0;
     }
 
-    strncpy(newReaction->ruser, username, 15);
-    newReaction->ruser[15] = '\0';
+    //a value that is too long is cut off
+    copy_param(param, value, size);
+    return 1;
+}
 
-    strncpy(newReaction->rmessage, message, 255);
-    newReaction->rmessage[255] = '\0';
+/**
+ * Reads a non-negative number parameter
+ * 
+ * @return 1 if present and valid, 0 if absent, -1 if malformed
+ */
+int get_number_param(HttpRequest *request, char *name, long *number){
+    char value[16];
+    if(!get_param(request, name, value, sizeof(value))){
+        return 0;
+    }
 
-    return newReaction;
+    char *end;
+    *number = strtol(value, &end, 10);
+    if(value[0] == '\0' || *end != '\0' || *number < 0){
+        return -1;
+    }
+    return 1;
 }
 
-Chat *new_chat(int id, char* username, char* message, char* timestamp){
-    Chat *newChat = (Chat*)malloc(sizeof(Chat));
-    
-    //checking if malloc failed
-    if(newChat == NULL){
-        return NULL;
-    }
-
-    //assigning values to the object
-    newChat->id = id;
-    
-    strncpy(newChat->user, username, sizeof(newChat->user) - 1);
-    newChat->user[15] = '\0';
-    
-    strncpy(newChat->message, message, sizeof(newChat->message) - 1);
-    newChat->message[350] = '\0';
-    
-    strncpy(newChat->timestamp, timestamp, sizeof(newChat->timestamp) - 1);
-    newChat->timestamp[19] = '\0';
-
-    newChat->num_reactions = 0;
-    newChat->reaction_capacity = 100;
-
-    newChat->reactions = calloc(100, sizeof(Reaction));
-    
-    return newChat;
-}
+/**
+ * Which part of the transcript a response covers
+ * 
+ * since -- only chats after #since, the chat numbers double as a cursor
+ * limit -- at most this many chats
+ * tail  -- only the last tail chats, instead of since
+ * time  -- TIME_LOCAL or TIME_EPOCH, picked with time=local|epoch
+ * format -- one of the FORMAT_ values, picked with format=text|json|ndjson
+ *           or else by an Accept header asking for JSON or NDJSON
+ * 
+ * -1 means not given. Every transcript response carries the number of its
+ * last chat in an X-Chat-Cursor header, to be passed as the next since.
+ */
+struct Page {
+    long since;
+    long limit;
+    long tail;
+    int time;
+    int format;
+    int reactions;
+};
+typedef struct Page Page;
 
-ChatList* new_list(){
-    ChatList* list = (ChatList*)malloc(sizeof(ChatList));
-    
-    //checking if malloc failed
-    if(list == NULL){
-        return NULL;
-    }
+//how a transcript response is written
+#define FORMAT_TEXT 0       //the padded lines of the transcript
+#define FORMAT_JSON 1       //{"cursor":N,"chats":[...]}
+#define FORMAT_NDJSON 2     //one chat object per line, for streaming long histories
 
-    list->chat = calloc(5, sizeof(Chat));
-    
-    //checking if calloc failed
-    if(list->chat == NULL){
-        free(list);
-        return NULL;
+/**
+ * @return one of the FORMAT_ values, -1 if format= is not a known format
+ */
+int parse_format(HttpRequest *request){
+    char value[16];
+    if(get_param(request, "format", value, sizeof(value))){
+        if(strcmp(value, "text") == 0){
+            return FORMAT_TEXT;
+        }
+        if(strcmp(value, "json") == 0){
+            return FORMAT_JSON;
+        }
+        if(strcmp(value, "ndjson") == 0){
+            return FORMAT_NDJSON;
+        }
+        return -1;
     }
 
-    list->size = 0;
-    list->capacity = 5;
-
-    return list;
+    //no q-values, the first JSON type mentioned wins
+    Slice accept;
+    if(http_header(request, "accept", &accept)){
+        if(memmem(accept.data, accept.len, "application/x-ndjson", 20) != NULL ||
+           memmem(accept.data, accept.len, "application/ndjson", 18) != NULL){
+            return FORMAT_NDJSON;
+        }
+        if(memmem(accept.data, accept.len, "application/json", 16) != NULL){
+            return FORMAT_JSON;
+        }
+    }
+    return FORMAT_TEXT;
 }
 
-
 /**
- * time module to get the current time
- * 
- * @return "YYY-MM-DD HH:MM"
+ * @return the status line and headers of a successful response in the format
  */
-char* get_time(){
-    time_t t = time(NULL);
-
-    //converts to local time
-    struct tm tm = *localtime(&t);
-
-    // "YYYY-MM-DD HH:MM" requires 16 characters and 1 for null terminator
-    static char time_str[20];
-    
-    //formats the time into the timr_str string
-    snprintf(time_str, sizeof(time_str), "%04d-%02d-%02d %02d:%02d:%02d", 
-        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-        tm.tm_hour, tm.tm_min, tm.tm_sec);
-
-    //returns a string in format "20XX-MM-DD HH:MM"
-    return time_str;
+const char *ok_status(int format){
+    if(format == FORMAT_JSON){
+        return HTTP_200_JSON;
+    }
+    if(format == FORMAT_NDJSON){
+        return HTTP_200_NDJSON;
+    }
+    return HTTP_200_OK;
 }
 
-
 /**
- * Chat server methods:
- * 
- * uint8_t add_chat(char* username, char* message)
- * uint8_t add_reaction(char* username, char* message, char* id)
+ * @return 0 on success, -1 with an error message if a parameter is malformed
  */
-ChatList* chatList = NULL;  //to check for initialization
-int chat_id = 0;            //same number as 'size' but keeps the concepts separate
+int parse_page(HttpRequest *request, Page *page, char *error, size_t size){
+    page->since = page->limit = page->tail = -1;
 
-uint8_t add_chat(char* username, char* message){
-    if(chatList == NULL){
-        chatList = new_list();
+    page->format = parse_format(request);
+    if(page->format < 0){
+        snprintf(error, size, "Invalid format--must be text, json or ndjson\n");
+        return -1;
     }
 
-    Chat *newChat = new_chat(chat_id, username, message, get_time());
-    //check is size has reached maximum capacity
-    if(chatList->size >= chatList->capacity){
-        Chat* new_array = realloc(chatList->chat, sizeof(Chat) * chatList->capacity*2);
+    char *names[] = {"since", "limit", "tail"};
+    long *fields[] = {&page->since, &page->limit, &page->tail};
+    for(int i = 0; i < 3; i++){
+        if(get_number_param(request, names[i], fields[i]) < 0){
+            snprintf(error, size, "Invalid %s--must be a non-negative number\n", names[i]);
+            return -1;
+        }
+    }
 
-        //reallocate the chat array to the new array
-        chatList->chat = new_array;
-        chatList->capacity *= 2;
+    char value[8];
+    page->time = TIME_LOCAL;
+    if(get_param(request, "time", value, sizeof(value)) && strcmp(value, "local") != 0){
+        if(strcmp(value, "epoch") != 0){
+            snprintf(error, size, "Invalid time--must be local or epoch\n");
+            return -1;
+        }
+        page->time = TIME_EPOCH;
     }
-    
-    //copy the new list into the chatList at the next index size
-    //then incrememnt the size so the next chat can be copied there
-    chatList->chat[chatList->size] = *newChat;
-    chatList->size++;
 
-    //update current chat_id so the next function call has a new chat_id
-    chat_id++;
+    char reactions[8];
+    page->reactions = REACTIONS_ALL;
+    if(get_param(request, "reactions", reactions, sizeof(reactions)) && strcmp(reactions, "all") != 0){
+        if(strcmp(reactions, "summary") != 0){
+            snprintf(error, size, "Invalid reactions--must be all or summary\n");
+            return -1;
+        }
+        page->reactions = REACTIONS_SUMMARY;
+    }
+    return 0;
+}
 
-    //this will free the memory used by newChat
-    //this is okay because newChat was copied into chatList at index size
-    free(newChat);
+//what /post and /react answer with, picked with reply=
+#define REPLY_ALL 0     //the transcript, or the page of it that was asked for
+#define REPLY_NEW 1     //only the chat that was added or reacted to
+#define REPLY_ACK 2     //a one line acknowledgement
 
-    // returning one if successful for assert testing purposes
-    return 1;
+/**
+ * @return one of the REPLY_ modes, -1 if reply= is not a known mode
+ */
+int parse_reply(HttpRequest *request){
+    char value[8];
+    if(!get_param(request, "reply", value, sizeof(value)) || strcmp(value, "all") == 0){
+        return REPLY_ALL;
+    }
+    if(strcmp(value, "new") == 0){
+        return REPLY_NEW;
+    }
+    if(strcmp(value, "ack") == 0){
+        return REPLY_ACK;
+    }
+    return -1;
 }
 
-uint8_t add_reaction(char* username, char* message, int id){
-    Reaction *newReaction = new_reaction(username, message);
-
-    chatList->chat[id].reactions[chatList->chat[id].num_reactions] = *newReaction;
+/**
+ * Copies the room= name into name, DEFAULT_ROOM without one
+ *
+ * Room names are 1 to ROOM_NAME - 1 letters, digits, '-' or '_'.
+ *
+ * @return 0 on success, -1 with an error message if the name is not valid
+ */
+int parse_room(HttpRequest *request, char *name, char *error, size_t size){
+    char value[ROOM_NAME + 1];
+    if(!get_param(request, "room", value, sizeof(value))){
+        snprintf(name, ROOM_NAME, "%s", DEFAULT_ROOM);
+        return 0;
+    }
 
-    chatList->chat[id].num_reactions++;
+    size_t len = strlen(value);
+    int valid = len > 0 && len < ROOM_NAME;
+    for(size_t i = 0; valid && i < len; i++){
+        char c = value[i];
+        valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+    }
+    if(!valid){
+        snprintf(error, size, "Invalid room--must be 1 to %d letters, digits, '-' or '_'\n", ROOM_NAME - 1);
+        return -1;
+    }
 
-    free(newReaction);
-    
-    // returning one is successful for assert testing purposes
-    return 1;
+    memcpy(name, value, len + 1);
+    return 0;
 }
 
 
@@ -246,126 +306,268 @@ uint8_t add_reaction(char* username, char* message, int id){
  *      /post
  *      /react
  *      /reset
+ *      /metrics
  */
 
 /**
  * Handles 404 errors
  */
-void handle_404(int client_socket, char *path){
-    printf("SERVER LOG: Got request for unrecognized path: \%s\"\r\n", path);
+void handle_404(int client_socket, HttpRequest *request){
+    int path_len = (int)(request->path.len < 256 ? request->path.len : 256);
+    printf("SERVER LOG: Got request for unrecognized path: \%.*s\"\r\n", path_len, request->path.data);
 
     char response_buff[BUFFER_SIZE];
-    snprintf(response_buff, BUFFER_SIZE, "Error 404:\r\nUnrecognized path \%s\"\r\n", path);
+    snprintf(response_buff, BUFFER_SIZE, "Error 404:\r\nUnrecognized path \%.*s\"\r\n", path_len, request->path.data);
     //snprintf includes a null-terminator
 
     //send response back to client
-    write(client_socket, HTTP_404_NOT_FOUND, strlen(HTTP_404_NOT_FOUND));
-    write(client_socket, response_buff, strlen(response_buff));
+    http_begin_response(client_socket, HTTP_404_NOT_FOUND);
+    http_write(client_socket, response_buff, strlen(response_buff));
 }
 
 
 /**
  * Handles the "/" path -- root path
  */
-void handle_root(int client_socket, char *path){
-    write(client_socket, HTTP_200_OK, strlen(HTTP_200_OK));
+void handle_root(int client_socket, HttpRequest *request){
+    http_begin_response(client_socket, HTTP_200_OK);
 
     char instructions_str[] = "Different requests you can make:\n";
     char chats_str[] = "/chats                                          -- for all chats\n";
+    char page_str[] = "/chats?since=<id>&limit=<n>                     -- at most n chats after chat #id\n";
+    char tail_str[] = "/chats?tail=<n>                                 -- the last n chats\n";
+    char time_str[] = "    &time=local|epoch                           -- timestamps as local time or epoch seconds\n";
+    char reactions_str[] = "    &reactions=all|summary                      -- every reaction or a count of each\n";
     char post_str[] = "/post?user=<username>&message=<message>         -- to post a chat\n";
     char react_str[] = "/react?id=<id>&user<username>&message=<message> -- to add a reaction\n";
-    char reset_str[] = "/reset                                          -- to reset everything\n";
+    char reply_str[] = "    &reply=all|new|ack                          -- answer with all chats, the new one or an ack\n";
+    char format_str[] = "    &format=text|json|ndjson                    -- plain text, JSON or NDJSON, Accept works too\n";
+    char subscribe_str[] = "/subscribe                                      -- stream new chats and reactions (text/event-stream)\n";
+    char reset_str[] = "/reset                                          -- to reset everything in the room\n";
+    char metrics_str[] = "/metrics                                        -- request, latency and memory metrics (Prometheus)\n";
+    char room_str[] = "    &room=<room> on any of them                 -- use that room instead of \"" DEFAULT_ROOM "\"\n";
 
     char message[BUFFER_SIZE];
-    snprintf(message, sizeof(message), "%s%s%s%s%s",
-            instructions_str, chats_str, post_str, react_str, reset_str);
+    snprintf(message, sizeof(message), "%s%s%s%s%s%s%s%s%s%s%s%s%s%s",
+            instructions_str, chats_str, page_str, tail_str, time_str, reactions_str, post_str, react_str, reply_str, format_str, subscribe_str, reset_str, room_str, metrics_str);
 
-    write(client_socket, message, strlen(message));
+    http_write(client_socket, message, strlen(message));
 }
 
 
+/**
+ * Chats [first, last) of the list that the page asks for
+ *
+ * Called between reader_enter and reader_exit.
+ */
+void page_range(ChatList *list, Page *page, int *first, int *last){
+    //chat #N sits at index N-1, so "after #since" starts at index since
+    int size = list == NULL ? 0 : atomic_load_explicit(&list->size, memory_order_acquire);
+    *first = 0;
+    if(page->tail >= 0){
+        *first = page->tail < size ? size - page->tail : 0;
+    }
+    else if(page->since >= 0){
+        *first = page->since < size ? page->since : size;
+    }
+
+    *last = size;
+    if(page->limit >= 0 && page->limit < *last - *first){
+        *last = *first + page->limit;
+    }
+}
+
 /**
  * Handles /chats path
- * Prints out all the chats
+ * Prints out all the chats, or the page of them that was asked for
  * 
  * Format:
  * [#N 20XX-MM-DD HH:MM]   <username>: <message>
                     (<rusername>)  <reaction>
-                    ... [more reactions] ...
+                    ... [more reactions, grouped by reaction] ...
     ... [more chats] ...
+ *
+ * or with reactions=summary one line of counts under each chat instead,
+ * "          (<reaction> xN) ...", or the same chats as JSON objects, see
+ * write_chats_json()
  */
-void responds_with_chat(int client_socket, char* path){
-    char message[BUFFER_SIZE];
+void responds_with_chat(Room *room, int client_socket, Page *page){
+    //no room lock, posts go on while the chats are copied and /reset leaves the list to us until we're done
+    reader_enter();
+
+    //a room nobody posted to yet doesn't exist
+    ChatList *list = room == NULL ? NULL : room->list;
+    int first, last;
+    page_range(list, page, &first, &last);
+
+    char cursor[32];
+    int cursor_id = last > first ? last : first;
+    snprintf(cursor, sizeof(cursor), "X-Chat-Cursor: %d", cursor_id);
+    http_add_header(client_socket, cursor);
 
     //code to print out the chats and reactions
-    if(chatList == NULL){
-        write(client_socket, "No chats available\n", strlen("No chats available\n"));
-    }
-
-    //19 spaces + 1 null terminator
-    char reaction_user_space[20] = "                   ";
-    for (int i = 0; i < chat_id; i++) {
-        //printing out the formatter chat
-        
-        //finding out the max len username
-        int max_user_len = 0;
-        for(int j = 0; j < chat_id; j++){
-            int username_len = strlen(chatList->chat[j].user);
-            if(username_len > max_user_len){ 
-                max_user_len = username_len; 
-            }
+    if(page->format == FORMAT_TEXT){
+        if(list == NULL){
+            http_write(client_socket, "No chats available\n", strlen("No chats available\n"));
+        }
+        else{
+            write_chats(list, client_socket, first, last, page->time, page->reactions);
         }
+        reader_exit();
+        return;
+    }
 
-        //finding the required padding
-        int padding_amount = max_user_len - strlen(chatList->chat[i].user);
-        char padded_username[BUFFER_SIZE];
+    JsonWriter json;
+    json_begin(&json, client_socket);
+    if(page->format == FORMAT_JSON){
+        json_raw(&json, "{\"cursor\":", 10);
+        json_int(&json, cursor_id);
+        json_raw(&json, ",\"chats\":[", 10);
+    }
+    if(list != NULL){
+        write_chats_json(list, &json, first, last, page->time, page->reactions, page->format == FORMAT_NDJSON);
+    }
+    if(page->format == FORMAT_JSON){
+        json_raw(&json, "]}\n", 3);
+    }
+    json_flush(&json);
 
-        //copying the spaces into the padded_username
-        strncpy(padded_username, reaction_user_space, padding_amount);
-        padded_username[padding_amount] = '\0';
+    reader_exit();
+}
 
-        //appending the actual username
-        strcat(padded_username, chatList->chat[i].user);
+/**
+ * Entity tags of /chats pages
+ *
+ * "<start>-<version>-<width>-<format><time><reactions>": start tells this
+ * run of the server from the ones before, whose versions counted up from 0
+ * too, version is what chats_version() gives for the chats of the page,
+ * width is how wide the usernames are padded, and the digits after it are
+ * the page's FORMAT_, TIME_ and REACTIONS_ values. A compressed page gets
+ * "-gzip" or "-deflate" after that, its bytes differ from the plain one's.
+ *
+ * The format can come from Accept and the encoding from Accept-Encoding,
+ * so the same URL has several representations, answers carry a Vary for
+ * both. Only which chats the page covers is left to the URL.
+ */
+uint64_t etag_start = 0;
+
+void page_etag(Room *room, Page *page, int encoding, char *etag, size_t size){
+    reader_enter();
+    ChatList *list = room == NULL ? NULL : room->list;
+    int first, last;
+    page_range(list, page, &first, &last);
+    uint64_t version = chats_version(room, list, first, last);
+    int width = list == NULL ? 0 : atomic_load(&list->width);
+    reader_exit();
+
+    const char *suffix = encoding == ENCODING_GZIP ? "-gzip" : encoding == ENCODING_DEFLATE ? "-deflate" : "";
+    snprintf(etag, size, "\"%llx-%llx-%d-%d%d%d%s\"", (unsigned long long)etag_start, (unsigned long long)version, width,
+             page->format, page->time, page->reactions, suffix);
+}
 
-        //printing the padded username
-        snprintf(message, BUFFER_SIZE, "[#%u %s] %.17s: %s\n",
-                                        chatList->chat[i].id + 1,
-                                        chatList->chat[i].timestamp,
-                                        padded_username,
-                                        chatList->chat[i].message);
-        write(client_socket, message, strlen(message));
+/**
+ * Whether If-None-Match names the tag, or is "*"
+ *
+ * It is compared weakly, a W/ in front of a tag doesn't matter.
+ */
+int etag_matches(HttpRequest *request, const char *etag){
+    Slice header;
+    if(!http_header(request, "if-none-match", &header)){
+        return 0;
+    }
 
+    size_t etag_len = strlen(etag);
+    const char *p = header.data, *end = header.data + header.len;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')){
+            p++;
+        }
+        const char *tag = p;
+        while(p < end && *p != ','){
+            p++;
+        }
+        const char *tag_end = p;
+        while(tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t')){
+            tag_end--;
+        }
+        if(tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/'){
+            tag += 2;
+        }
 
-        //printing out formated reactions
-        if(chatList->chat[i].num_reactions > 0){
-            for(int j = 0; j < chatList->chat[i].num_reactions; j++){
-                //the line that's going to be printed out
-                char reaction_line[BUFFER_SIZE];
+        size_t len = tag_end - tag;
+        if((len == 1 && *tag == '*') || (len == etag_len && memcmp(tag, etag, len) == 0)){
+            return 1;
+        }
+    }
+    return 0;
+}
 
-                //calculating the number of spaces needed from the left
-                int username_len = strlen(chatList->chat[i].reactions[j].ruser);
-                int total_spaces = 17 - username_len;
+/**
+ * Answers /chats with the page, or with a 304 without rendering anything
+ * if the client already has the current one. The page is compressed when
+ * Accept-Encoding allows gzip or deflate.
+ */
+void handle_chat(int client_socket, HttpRequest *request){
+    char server_message[BUFFER_SIZE];
+
+    Page page;
+    char room_name[ROOM_NAME];
+    if(parse_page(request, &page, server_message, sizeof(server_message)) < 0 ||
+       parse_room(request, room_name, server_message, sizeof(server_message)) < 0){
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
 
-                //copying the total number of spaces into the reaction_user_space
-                strncpy(reaction_line, reaction_user_space, total_spaces);
-                reaction_line[total_spaces] = '\0';
+    //the tag is taken before the chats are read, so they're never older than it says
+    Room *room = get_room(room_name, 0);
+    int encoding = http_accepted_encoding(request);
+    char etag[64];
+    char etag_header[80];
+    page_etag(room, &page, encoding, etag, sizeof(etag));
+    snprintf(etag_header, sizeof(etag_header), "ETag: %s", etag);
+
+    if(etag_matches(request, etag)){
+        http_begin_response(client_socket, HTTP_304_NOT_MODIFIED);
+        http_add_header(client_socket, etag_header);
+        http_add_header(client_socket, "Vary: Accept, Accept-Encoding");
+        return;
+    }
 
-                //adding the username inside () and the emohji
-                snprintf(reaction_line + total_spaces, BUFFER_SIZE - total_spaces,
-                        "          (%s) %s",
-                        chatList->chat[i].reactions[j].ruser,
-                        chatList->chat[i].reactions[j].rmessage);
+    http_begin_response(client_socket, ok_status(page.format));
+    http_add_header(client_socket, etag_header);
+    http_add_header(client_socket, "Vary: Accept, Accept-Encoding");
+    http_set_encoding(client_socket, encoding);
+    responds_with_chat(room, client_socket, &page);
+}
 
-                write(client_socket, reaction_line, strlen(reaction_line));
-                write(client_socket, "\n", strlen("\n"));
-            }
+
+/**
+ * Answers a /post or /react that changed chat #id the way reply= asked for
+ */
+void reply_with_chat(Room *room, int client_socket, int reply, Page *page, int id, char *ack){
+    http_begin_response(client_socket, ok_status(page->format));
+
+    if(reply == REPLY_ACK){
+        char message[64];
+        if(page->format == FORMAT_TEXT){
+            snprintf(message, sizeof(message), "%s #%d\n", ack, id + 1);
         }
+        else{
+            snprintf(message, sizeof(message), "{\"ok\":true,\"id\":%d}\n", id + 1);
+        }
+        http_write(client_socket, message, strlen(message));
+        return;
     }
-}
 
-void handle_chat(int client_socket, char* path){
-    write(client_socket, HTTP_200_OK, strlen(HTTP_200_OK));
-    responds_with_chat(client_socket, path);
+    if(reply == REPLY_NEW){
+        Page only = {.since = id, .limit = 1, .tail = -1, .time = page->time, .format = page->format,
+                     .reactions = page->reactions};
+        responds_with_chat(room, client_socket, &only);
+        return;
+    }
+
+    responds_with_chat(room, client_socket, page);
 }
 
 
@@ -375,105 +577,88 @@ void handle_chat(int client_socket, char* path){
  * 
  * Prints out all the chats, including the newest one
  */
-void handle_post(int client_socket, char* path){
-    write(client_socket, HTTP_200_OK, strlen(HTTP_200_OK));
+void handle_post(int client_socket, HttpRequest *request){
     char server_message[BUFFER_SIZE];
 
-    //checking if it's null
-    if(chatList == NULL) {
-        chatList = new_list();
+    //what to answer with, checked before anything is added
+    Page page;
+    int reply = parse_reply(request);
+    if(reply < 0){
+        snprintf(server_message, sizeof(server_message), "Invalid reply--must be all, new or ack\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
     }
-
-    //check that the new chat does not exceed 100,000 chats
-    if(chatList->size >= 100000){
-        snprintf(server_message, sizeof(server_message), "Cannot add more chats--limit 100,000\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+    char room_name[ROOM_NAME];
+    if(parse_page(request, &page, server_message, sizeof(server_message)) < 0 ||
+       parse_room(request, room_name, server_message, sizeof(server_message)) < 0){
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
 
-    //points to the first instance of the string specified
-    char user_string[] = "user=";
-    char *username_pointer = strstr(path, user_string);
-
-    //check if it doesn't exist -- NULL
-    if(!username_pointer || 
-        *(username_pointer + strlen(user_string)) == '&' || 
-        *(username_pointer + strlen(user_string)) == '\0')
-    {
+    //the username and the message are copied straight into where they're kept
+    const HttpParam *user_param = http_param(request, "user");
+    if(user_param == NULL || user_param->value.len == 0){
         snprintf(server_message, sizeof(server_message), "Invalid, user can not be empty\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
-    } 
-
-    //checking if username is longer than 15 bytes/characters
-    username_pointer += 5;
-    int i = 0;
-    while(i < 16 && username_pointer[i] != '&' && username_pointer[i] != '\0'){
-        i++;
     }
 
     //prints out error mesasge if max length reached
-    if(i==16){
+    char username[16];
+    if(copy_param(user_param, username, sizeof(username)) < 0){
         snprintf(server_message, sizeof(server_message), "Username cannot be longer than 15 characters\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //copies username into username[]
-    char username[16];
-    int j = 0;
-    for(; j < i; j++){
-        username[j] = username_pointer[j];
-    }
-    username[j] = '\0';
-
-
 
     //same process, but for message this time
-    char message_string[] = "message=";
-    char *message_pointer = strstr(path, message_string);
-
-    //check if it doesn't exist -- NULL
-    if(!message_pointer) {
+    const HttpParam *message_param = http_param(request, "message");
+    if(message_param == NULL){
         snprintf(server_message, sizeof(server_message), "Missing message field 'messag=<message>'\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //getting the length of the message
-    message_pointer += 8;
-    i = 0;
-    printf("%d\n", i);
-    while(i < 256 && message_pointer[i] != '&' && message_pointer[i] != '\0'){
-        i++;
-    }
-
     //prints out error if max length breached
-    if(i==256){
+    char message[256];
+    if(copy_param(message_param, message, sizeof(message)) < 0){
         snprintf(server_message, sizeof(server_message), "Message cannot be longer than 255 characters\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
-    
-    //copies message into message[]
-    char message[256];
-    j = 0;
-    for(; j < i; j++){
-        message[j] = message_pointer[j];
-    }
-    message[j] = '\0';
 
 
 
+    //posting is what creates a room
+    Room *room = get_room(room_name, 1);
+    if(room == NULL){
+        snprintf(server_message, sizeof(server_message), "Cannot add more rooms--limit %d\n", MAX_ROOMS);
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+
     //adds the new chat, and the prints all chats including the new one
-    add_chat(username, message);
-    responds_with_chat(client_socket, path);
+    //add_chat evicts the oldest chats the room doesn't keep, it only refuses the chat if that fails
+    int new_id = add_chat(room, username, message);
+    if(new_id < 0){
+        snprintf(server_message, sizeof(server_message), "Cannot add more chats\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+    reply_with_chat(room, client_socket, reply, &page, new_id, "Posted chat");
+
+    //with -d sync the answer waits until the chat is on disk
+    http_hold_response(client_socket, log_commit_ticket());
 }
 
 
@@ -482,208 +667,354 @@ void handle_post(int client_socket, char* path){
  * 
  * Given the chat id, it adds a reaction to that chat
  */
-void handle_react(int client_socket, char* path){
-    write(client_socket, HTTP_200_OK, strlen(HTTP_200_OK));
+void handle_react(int client_socket, HttpRequest *request){
     char server_message[BUFFER_SIZE];
 
+    //what to answer with, checked before anything is added
+    Page page;
+    int reply = parse_reply(request);
+    if(reply < 0){
+        snprintf(server_message, sizeof(server_message), "Invalid reply--must be all, new or ack\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+    char room_name[ROOM_NAME];
+    if(parse_page(request, &page, server_message, sizeof(server_message)) < 0 ||
+       parse_room(request, room_name, server_message, sizeof(server_message)) < 0){
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+
     //checking if it's null
-    if(chatList == NULL){
-        write(client_socket, "No chats to add reactions to", strlen("No chats to add reactions to"));
-        write(client_socket, "\n", strlen("\n"));
+    Room *room = get_room(room_name, 0);
+    int num_chats = room == NULL ? -1 : chat_count(room);
+    if(num_chats < 0){
+        http_begin_response(client_socket, ok_status(page.format));
+        if(page.format == FORMAT_TEXT){
+            http_write(client_socket, "No chats to add reactions to", strlen("No chats to add reactions to"));
+            http_write(client_socket, "\n", strlen("\n"));
+        }
+        else{
+            http_write(client_socket, "{\"error\":\"No chats to add reactions to\"}\n", strlen("{\"error\":\"No chats to add reactions to\"}\n"));
+        }
         return;
     }
 
 
     //extracting the id
-    char id_string[] = "id=";
-    char* id_pointer = strstr(path, id_string);
-
-    //check if the field doesn't exist -- NULL
-    if(!id_pointer || 
-        *(id_pointer + strlen(id_string)) == '&' ||
-        *(id_pointer + strlen(id_string)) == '\0')
-    {
+    const HttpParam *id_param = http_param(request, "id");
+    if(id_param == NULL || id_param->value.len == 0){
         snprintf(server_message, sizeof(server_message), "Invalid, id field cannot be empty\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //get the id into a string and null terminate it
-    char id[7];
-    id_pointer += 3;
-    int i = 0;
-    for(; i < 7 && id_pointer[i] != '&' && id_pointer[i] != '\0'; i++){
-        id[i] = id_pointer[i];
+    //the whole value has to be the number, one too long for the buffer is already out of range
+    char id[24];
+    int id_len = copy_param(id_param, id, sizeof(id));
+    char *id_end = id;
+    long number = -1;
+    if(id_len > 0 && id[0] >= '0' && id[0] <= '9'){
+        errno = 0;
+        number = strtol(id, &id_end, 10);
     }
-    id[i] = '\0';
-
-
-    //check if the id --chat id-- is valid or not
-    int chat_id = atoi(id) - 1;
-    if(chat_id < 0 || chat_id >= chatList->size){
-        snprintf(server_message, sizeof(server_message), "Invalid id--chat with specified id does not exist\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+    if(id_end != id + id_len || errno == ERANGE || number > INT_MAX){
+        snprintf(server_message, sizeof(server_message), "Invalid id--id has to be a chat number\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //if the id is valid, we now check for the number of reactions in the given chat
-    if(chatList->chat[atoi(id)-1].num_reactions >= 100){
-        snprintf(server_message, sizeof(server_message), "Max number of reactions reached (100) - cannot add more\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+    //check if the id --chat id-- is valid or not
+    int chat_id = (int)number - 1;
+    if(chat_id < 0 || chat_id >= num_chats){
+        snprintf(server_message, sizeof(server_message), "Invalid id--chat with specified id does not exist\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
 
-
-    //if id and number of reactions are vlid, then we take care of separating the r-user and the r-message
-
-    //extracting the username
-    char ruser_string[] = "user=";
-    char *ruser_pointer = strstr(path, ruser_string);
-
-    //check if the field does not exist
-    if(!ruser_pointer ||
-        *(ruser_pointer + strlen(ruser_string)) == '&' ||
-        *(ruser_pointer + strlen(ruser_string)) == '\0')
-    {
+    //if the id is vlid, then we take care of the r-user and the r-message
+    const HttpParam *ruser_param = http_param(request, "user");
+    if(ruser_param == NULL || ruser_param->value.len == 0){
         snprintf(server_message, sizeof(server_message), "Invalid, user field cannot be empty\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //checking if the username length is bigger than 15 characters/bytes
-    ruser_pointer += 5;
-    i = 0;
-    while(i < 16 && ruser_pointer[i] != '&' && ruser_pointer[i] != '\0'){
-        i++;
-    }
-
     //prints out error message if max length reached
-    if(i == 16){
+    char ruser[16];
+    if(copy_param(ruser_param, ruser, sizeof(ruser)) < 0){
         snprintf(server_message, sizeof(server_message), "Username cannot be longer than 15 characters\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //if everything passes, copy it into a char array
-    char ruser[16];
-    int j = 0;
-    for(; j < i; j++){
-        ruser[j] = ruser_pointer[j];
-    }
-    ruser[j] = '\0';
-
-
 
     //same process, but for the message this time
-
-    //extracting the message
-    char rmessage_string[] = "message=";
-    char *rmessage_pointer = strstr(path, rmessage_string);
-
-    //check if the field does not exist
-    if(!rmessage_pointer) {
+    const HttpParam *rmessage_param = http_param(request, "message");
+    if(rmessage_param == NULL){
         snprintf(server_message, sizeof(server_message), "Invalid, missing message field 'message=<message>'\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //checking if the username length is bigger than 15 characters/bytes
-    rmessage_pointer += strlen(rmessage_string);
-    i = 0;
-    while(i < 16 && rmessage_pointer[i] != '&' && rmessage_pointer[i] != '\0'){
-        i++;
-    }
-
     //prints out error message if max length reached
-    if(i == 16){
+    char rmessage[16];
+    if(copy_param(rmessage_param, rmessage, sizeof(rmessage)) < 0){
         snprintf(server_message, sizeof(server_message), "Reaction message cannot be longer than 15 characters\n");
-        write(client_socket, HTTP_500_INTERNAL_SERVER, strlen(HTTP_500_INTERNAL_SERVER));
-        write(client_socket, server_message, strlen(server_message));
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
         return;
     }
 
-    //if everything passes, copy it into a char array
-    char rmessage[16];
-    j = 0;
-    for(; j < i; j++){
-        rmessage[j] = rmessage_pointer[j];
+
+
+    //convert string to int before passing in the method and then prints out all the chats with the new reaction
+    //the chat can be gone by now, add_reaction checks under the lock
+    //reacting the same way twice is not an error, it just isn't counted again
+    uint8_t result = add_reaction(room, ruser, rmessage, chat_id);
+    if(result == REACTION_NO_CHAT){
+        snprintf(server_message, sizeof(server_message), "Invalid id--chat with specified id does not exist\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+    if(result == REACTION_ARCHIVED){
+        snprintf(server_message, sizeof(server_message), "Invalid id--chat is too old to react to\n");
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
     }
-    rmessage[j] = '\0';
+    reply_with_chat(room, client_socket, reply, &page, chat_id,
+                    result == REACTION_REPEATED ? "Already reacted to chat" : "Reacted to chat");
+    http_hold_response(client_socket, log_commit_ticket());
+}
 
 
+/**
+ * Handles /subscribe request
+ * 
+ * Keeps the connection open as a text/event-stream and pushes every new
+ * chat, reaction and reset of the room as an event:
+ * 
+ * event: chat       data: [#N 20XX-MM-DD HH:MM:SS] <username>: <message>
+ * event: reaction   data: #N (<rusername>) <reaction>
+ * event: reset      data: (empty)
+ */
+void handle_subscribe(int client_socket, HttpRequest *request){
+    char server_message[BUFFER_SIZE];
 
-    //convert string to int before passing in the method and then prints out all the chats with the new reaction
-    add_reaction(ruser, rmessage, atoi(id)-1);
-    responds_with_chat(client_socket, path);
+    //subscribing creates the room, so it can be watched before the first post
+    char room_name[ROOM_NAME];
+    if(parse_room(request, room_name, server_message, sizeof(server_message)) < 0){
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+    Room *room = get_room(room_name, 1);
+    if(room == NULL){
+        snprintf(server_message, sizeof(server_message), "Cannot add more rooms--limit %d\n", MAX_ROOMS);
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+
+    http_subscribe(client_socket, HTTP_200_EVENT_STREAM, room->events);
 }
 
 
 /**
  * Handles /reset request
  * 
- * Resets everything
- * Frees all used heap memory
+ * Resets everything in the room, the other rooms are left alone
+ * Frees all used heap memory of the room
  */
-void handle_reset(int client_socket, char* path){
-    // Check if chatList is initialized
-    if (chatList != NULL) {
-        // Free each chat and its reactions
-        for (int i = 0; i < chatList->size; i++) {
-            // Free reactions array if it exists
-            if (chatList->chat[i].reactions != NULL) {
-                free(chatList->chat[i].reactions);
-            }
-        }
-        
-        // Free the chat array
-        free(chatList->chat);
-        
-        // Free the chatList structure itself
-        free(chatList);
-    }
-    
-    // Reset global variables to initial state
-    chatList = NULL;
-    chat_id = 0;
-
-    write(client_socket, HTTP_200_OK, strlen(HTTP_200_OK));
+void handle_reset(int client_socket, HttpRequest *request){
+    char server_message[BUFFER_SIZE];
+
+    char room_name[ROOM_NAME];
+    if(parse_room(request, room_name, server_message, sizeof(server_message)) < 0){
+        http_begin_response(client_socket, HTTP_500_INTERNAL_SERVER);
+        http_write(client_socket, server_message, strlen(server_message));
+        return;
+    }
+
+    //a room that doesn't exist has nothing to reset
+    Room *room = get_room(room_name, 0);
+    if(room != NULL){
+        reset_chats(room);
+    }
+
+    http_begin_response(client_socket, HTTP_200_OK);
+    http_hold_response(client_socket, log_commit_ticket());
 }
 
 
 
-uint8_t hex_to_byte(char c) {
-	if ('0' <= c && c <= '9') return c - '0';
-	if ('a' <= c && c <= 'f') return c - 'a' + 10;
-	if ('A' <= c && c <= 'F') return c - 'A' + 10;
-	return -1;
+/**
+ * Routes, counted and timed for /metrics by handle_response
+ */
+#define ROUTE_ROOT 0
+#define ROUTE_CHATS 1
+#define ROUTE_POST 2
+#define ROUTE_REACT 3
+#define ROUTE_SUBSCRIBE 4
+#define ROUTE_RESET 5
+#define ROUTE_METRICS 6
+#define ROUTE_NOT_FOUND 7
+#define NUM_ROUTES 8
+
+char const *route_names[NUM_ROUTES] = {"/", "/chats", "/post", "/react", "/subscribe", "/reset", "/metrics", "not_found"};
 
+/**
+ * Adds printf-formatted text to the response
+ */
+void write_format(int client_socket, const char *format, ...){
+    char line[BUFFER_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    http_write(client_socket, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
 }
 
-void url_decode(char *src, char *dest){
-	int i = 0;
-	char *dest_ptr = dest;
-	while (*(src+i) != 0){
-		if(*(src+i)=='%'){
-			uint8_t a = hex_to_byte(*(src+i+1));
-		       	uint8_t b = hex_to_byte(*(src+i+2));
-			*dest_ptr=(unsigned char)((a<< 4)| b);
-			dest_ptr++;
-			i +=2; 
-		} else {
-			*dest_ptr = *(src+i);
-			dest_ptr++;
-
-		}	
-		i++;
-	}
-	*dest_ptr = 0;
+/**
+ * Handles /metrics request
+ *
+ * Everything since the server started, in the Prometheus text format.
+ * Latencies are the time spent handling the request, without the wait for
+ * the log of a held response.
+ */
+void handle_metrics(int client_socket, HttpRequest *request){
+    MetricsSlot total;
+    metrics_sum(&total);
+
+    http_begin_response(client_socket, HTTP_200_METRICS);
+
+    write_format(client_socket, "# HELP chat_requests_total Requests handled, by route.\n# TYPE chat_requests_total counter\n");
+    for(int route = 0; route < NUM_ROUTES; route++){
+        write_format(client_socket, "chat_requests_total{route=\"%s\"} %llu\n",
+                     route_names[route], (unsigned long long)total.requests[route]);
+    }
+
+    write_format(client_socket, "# HELP chat_responses_total Responses sent, by status code.\n# TYPE chat_responses_total counter\n");
+    for(int status = MIN_STATUS; status < MAX_STATUS; status++){
+        if(total.responses[status - MIN_STATUS] > 0){
+            write_format(client_socket, "chat_responses_total{code=\"%d\"} %llu\n",
+                         status, (unsigned long long)total.responses[status - MIN_STATUS]);
+        }
+    }
+
+    write_format(client_socket, "# HELP chat_written_bytes_total Bytes written to clients, headers and events included.\n"
+                                "# TYPE chat_written_bytes_total counter\nchat_written_bytes_total %llu\n",
+                 (unsigned long long)total.bytes_written);
+
+    //the buckets are 2^k microseconds, cumulative like Prometheus wants them
+    write_format(client_socket, "# HELP chat_request_duration_seconds Time spent handling requests, by route.\n"
+                                "# TYPE chat_request_duration_seconds histogram\n");
+    for(int route = 0; route < NUM_ROUTES; route++){
+        uint64_t count = 0;
+        for(int b = 0; b < LATENCY_BUCKETS; b++){
+            count += total.latency[route][b];
+            if(b < LATENCY_BUCKETS - 1){
+                write_format(client_socket, "chat_request_duration_seconds_bucket{route=\"%s\",le=\"%.6f\"} %llu\n",
+                             route_names[route], (double)(1ULL << b) / 1e6, (unsigned long long)count);
+            }
+            else{
+                write_format(client_socket, "chat_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+                             route_names[route], (unsigned long long)count);
+            }
+        }
+        write_format(client_socket, "chat_request_duration_seconds_sum{route=\"%s\"} %.9f\n",
+                     route_names[route], (double)total.latency_sum[route] / 1e9);
+        write_format(client_socket, "chat_request_duration_seconds_count{route=\"%s\"} %llu\n",
+                     route_names[route], (unsigned long long)count);
+    }
+
+    uint64_t rooms, chats, reactions;
+    chat_totals(&rooms, &chats, &reactions);
+    write_format(client_socket, "# HELP chat_rooms Rooms created.\n# TYPE chat_rooms gauge\nchat_rooms %llu\n",
+                 (unsigned long long)rooms);
+    write_format(client_socket, "# HELP chat_chats Chats in all rooms.\n# TYPE chat_chats gauge\nchat_chats %llu\n",
+                 (unsigned long long)chats);
+    write_format(client_socket, "# HELP chat_reactions Reactions in all rooms.\n# TYPE chat_reactions gauge\nchat_reactions %llu\n",
+                 (unsigned long long)reactions);
+
+    //heap in use by malloc, and what the process has resident, snapshots included
+    struct mallinfo2 heap = mallinfo2();
+    write_format(client_socket, "# HELP chat_heap_bytes Heap memory in use.\n# TYPE chat_heap_bytes gauge\nchat_heap_bytes %zu\n",
+                 heap.uordblks + heap.hblkhd);
+
+    unsigned long long pages, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if(statm != NULL){
+        if(fscanf(statm, "%llu %llu", &pages, &resident) != 2){
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    write_format(client_socket, "# HELP process_resident_memory_bytes Resident memory size in bytes.\n"
+                                "# TYPE process_resident_memory_bytes gauge\nprocess_resident_memory_bytes %llu\n",
+                 resident * (unsigned long long)sysconf(_SC_PAGESIZE));
+}
+
+
+/**
+ * Picks the route by the length of the path and then a letter that tells
+ * the routes of that length apart, so at most one memcmp confirms it
+ *
+ * /chat is still taken for /chats, like it always was.
+ */
+int find_route(Slice path){
+    const char *p = path.data;
+    switch(path.len){
+        case 1:
+            return ROUTE_ROOT;
+        case 5:
+            if(memcmp(p, "/post", 5) == 0){
+                return ROUTE_POST;
+            }
+            if(memcmp(p, "/chat", 5) == 0){
+                return ROUTE_CHATS;
+            }
+            break;
+        case 6:
+            switch(p[3]){
+                case 'a':
+                    if(memcmp(p, "/chats", 6) == 0){
+                        return ROUTE_CHATS;
+                    }
+                    if(memcmp(p, "/react", 6) == 0){
+                        return ROUTE_REACT;
+                    }
+                    break;
+                case 's':
+                    if(memcmp(p, "/reset", 6) == 0){
+                        return ROUTE_RESET;
+                    }
+                    break;
+            }
+            break;
+        case 8:
+            if(memcmp(p, "/metrics", 8) == 0){
+                return ROUTE_METRICS;
+            }
+            break;
+        case 10:
+            if(memcmp(p, "/subscribe", 10) == 0){
+                return ROUTE_SUBSCRIBE;
+            }
+            break;
+    }
+    return ROUTE_NOT_FOUND;
 }
 
 /**
@@ -693,27 +1024,21 @@ void url_decode(char *src, char *dest){
  * /post --> posts the chat and prints out all chats
  * /react --> adds a new reaction in the given chat id
  * /reset --> removes everything and frees the memory
+ * /metrics --> counters, latencies and memory for Prometheus
  * 
+ * The server already split the request up, see parse_request() in
+ * http-server.c. /post and /react take their fields from the query string
+ * or from a form body sent with POST.
  */
-void handle_response(char *request, int client_socket){
-    char path[300];
-    char path_decoded[300];
+void handle_response(HttpRequest *request, int client_socket){
+    printf("\nSERVER LOG: Got request: \%.*s\"\n", (int)request->raw.len, request->raw.data);
 
-    printf("\nSERVER LOG: Got request: \%s\"\n", request);
-
-    //parse the path out of the request line (limit buffer size, sscanf null-terminater)
-    if(sscanf(request, "GET %s", path) != 1){
+    if(!slice_equals(request->method, "GET") && !slice_equals(request->method, "POST")){
         printf("Invalid request line\n");
         return;
     }
 
-
-    url_decode(path, path_decoded);
-
     /**
-     * "/" show current number
-     * "/increment" increment the current number and then show
-     * 
      * Format for each request type:
      * 
      * /chats
@@ -722,44 +1047,157 @@ void handle_response(char *request, int client_socket){
      * /reset
      * 
      */
-    if(strcmp(path_decoded, "/") == 0){
-        handle_root(client_socket, path_decoded);
-        return;
-    }
-    else if(strncmp(path_decoded, "/chats", 5) == 0){
-        printf("All chats and reactions printed\n");
-        handle_chat(client_socket, path_decoded);
-        return;
-    }
-    else if(strncmp(path_decoded, "/post", 5) == 0){
-        printf("/post request: Will handle post request here\n");
-        handle_post(client_socket, path_decoded);
-        return;
-    }
-    else if(strncmp(path_decoded, "/react", 6) == 0){
-        printf("/react request: will add reaction to given id\n");
-        handle_react(client_socket, path_decoded);
-        return;
-    }
-    else if(strncmp(path_decoded, "/reset", 6) == 0){
-        printf("/reset request: will reset the whole server\n");
-        handle_reset(client_socket, path_decoded);
-        return;
-    }
-    else{
-        handle_404(client_socket, path_decoded);
+    uint64_t start = metrics_now();
+    int route = find_route(request->path);
+    switch(route){
+        case ROUTE_ROOT:
+            handle_root(client_socket, request);
+            break;
+        case ROUTE_CHATS:
+            printf("All chats and reactions printed\n");
+            handle_chat(client_socket, request);
+            break;
+        case ROUTE_POST:
+            printf("/post request: Will handle post request here\n");
+            handle_post(client_socket, request);
+            break;
+        case ROUTE_REACT:
+            printf("/react request: will add reaction to given id\n");
+            handle_react(client_socket, request);
+            break;
+        case ROUTE_SUBSCRIBE:
+            printf("/subscribe request: will stream new chats and reactions\n");
+            handle_subscribe(client_socket, request);
+            break;
+        case ROUTE_RESET:
+            printf("/reset request: will reset the room\n");
+            handle_reset(client_socket, request);
+            break;
+        case ROUTE_METRICS:
+            handle_metrics(client_socket, request);
+            break;
+        default:
+            handle_404(client_socket, request);
     }
+    metrics_request(route, metrics_now() - start);
 }
 
 
 /**
  * The main function
+ *
+ * Usage: ./chat-server [-l log] [-d sync|batch|async] [-s seconds] [-H head_bytes] [-B body_bytes] [-k chats] [-a seconds] [-m bytes] [-r rate] [-b burst] [-c connections] [-q backlog] [port] [threads]
+ * threads defaults to 1, 0 starts one worker thread per core
+ * log is the write-ahead log, replayed on startup. Without it nothing is kept
+ * across restarts. -d picks when changes are synced to it, sync by default
+ * -s is how often the chats are snapshotted next to the log so it can be
+ * trimmed, every 60 seconds by default, 0 never snapshots
+ * -H and -B are the largest request head and body that are accepted,
+ * 8 KiB and 1 MiB by default
+ * -k, -a and -m are how many chats, how many seconds of them and how many
+ * message bytes a room keeps in memory, 100,000 chats and no age or byte
+ * limit by default. Older chats go to an archive next to the log, without
+ * -l they are dropped
+ * -r is how many requests a second one client address may make, in bursts
+ * of up to -b, no limit by default. Clients over it get 429
+ * -c is how many connections can be open at once, more get 503, no limit
+ * by default. -q is the listen backlog, SOMAXCONN by default
  */
 int main(int argc, char* argv[]){
+    char *log_path = NULL;
+    int durability = DURABILITY_SYNC;
+    int snapshot_interval = SNAPSHOT_INTERVAL;
+    size_t max_head = MAX_HEAD_SIZE;
+    size_t max_body = MAX_BODY_SIZE;
+    int rate = 0;
+    int burst = 0;
+    int max_open = 0;
+    int backlog = LISTEN_BACKLOG;
+
+    int option;
+    while((option = getopt(argc, argv, "l:d:s:H:B:k:a:m:r:b:c:q:")) != -1){
+        switch(option){
+            case 'l':
+                log_path = optarg;
+                break;
+            case 's':
+                snapshot_interval = atoi(optarg);
+                break;
+            case 'H':
+                max_head = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                max_body = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                retain_chats = atoi(optarg);
+                if(retain_chats < 1 || retain_chats > MAX_CHATS){
+                    retain_chats = MAX_CHATS;
+                }
+                break;
+            case 'a':
+                retain_age = atoi(optarg);
+                break;
+            case 'm':
+                retain_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                break;
+            case 'b':
+                burst = atoi(optarg);
+                break;
+            case 'c':
+                max_open = atoi(optarg);
+                break;
+            case 'q':
+                backlog = atoi(optarg);
+                break;
+            case 'd':
+                durability = parse_durability(optarg);
+                if(durability >= 0){
+                    break;
+                }
+                //fall through
+            default:
+                fprintf(stderr, "Usage: %s [-l log] [-d sync|batch|async] [-s seconds] [-H head_bytes] [-B body_bytes] [-k chats] [-a seconds] [-m bytes] [-r rate] [-b burst] [-c connections] [-q backlog] [port] [threads]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
     int port = 0;
-    if(argc >= 2){
-        port = atoi(argv[1]);
+    if(optind < argc){
+        port = atoi(argv[optind]);
+    }
+
+    int num_threads = 1;
+    if(optind + 1 < argc){
+        num_threads = atoi(argv[optind + 1]);
+        if(num_threads <= 0){
+            num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+    }
+
+    //every worker reads chats, two slots are left for the snapshot and log threads
+    if(num_threads > MAX_READERS - 2){
+        fprintf(stderr, "At most %d worker threads can read chats, using that many\n", MAX_READERS - 2);
+        num_threads = MAX_READERS - 2;
+    }
+
+    init_reaction_pool();
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    etag_start = (uint64_t)start.tv_sec * 1000000 + (uint64_t)start.tv_nsec / 1000;
+
+    //replay before anything new is logged
+    if(log_path != NULL){
+        archive_init(log_path);
+        log_open(log_path);
+        log_start(durability);
+        snapshot_start(log_path, snapshot_interval);
     }
 
-    start_server(&handle_response, port);
+    http_set_limits(max_head, max_body);
+    http_set_admission(rate, burst > 0 ? burst : rate, max_open, backlog);
+    start_server(&handle_response, port, num_threads);
 }
\ No newline at end of file
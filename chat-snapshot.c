@@ -0,0 +1,981 @@
+#include "chat-snapshot.h"
+#include "chat-log.h"
+#include "chat-archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/**
+ * Snapshots
+ *
+ * Every interval seconds, if anything was logged since the last one, the
+ * snapshot thread copies the chats of every room into <log>.snapshot and
+ * deletes the log segments it covers (see chat-log.c).
+ *
+ * Only the cut takes the rooms' locks, all of them exclusively, with
+ * room_lock held so no room is created meanwhile. It rotates the log and
+ * takes the number of chats and names of every room and pins its chunks,
+ * so eviction doesn't free them in the meantime, nothing that grows with
+ * the history. Everything up to the cut never moves or changes
+ * afterwards, so the file is written from the live chats without the
+ * rooms' locks. Groups only grow at the end, but adding to one can move
+ * its arrays, so how many there are and how many users they have is
+ * copied a block at a time under the block's lock, and so are the groups
+ * when they are written. /reset waits for, or cancels, a snapshot that is
+ * being taken, see pause_snapshots.
+ *
+ * Each room is laid out column by column like the chats in memory.
+ * Loading maps the file and copies the small per-chat columns, the names
+ * and the reaction groups. Messages are used straight from the mapping,
+ * and transcript blocks are rendered on first use, so pages are faulted in
+ * as chats get read.
+ *
+ * Only the chats in memory are written, from the room's first on. The
+ * ones before it are in the room's archive, which is synced before the
+ * snapshot replaces the last one.
+ *
+ * Layout, integers in native byte order, every section 8-byte aligned:
+ *      SnapshotHeader
+ *      for each room that has chats:
+ *          RoomHeader
+ *          int64    time[num_chats]
+ *          uint32   user[num_chats]
+ *          uint32   num_groups[num_chats]
+ *          uint64   message_offset[num_chats]      into messages
+ *          uint16   message_len[num_chats]
+ *          uint64   user_offset[num_users]         into user_names
+ *          uint8    user_len[num_users]
+ *          char     user_names[]                   NUL-terminated
+ *          uint64   token_offset[num_tokens]       into token_names
+ *          uint8    token_len[num_tokens]
+ *          char     token_names[]                  NUL-terminated
+ *          uint32   block_crc[num_blocks]          per TRANSCRIPT_BLOCK chats, of their messages
+ *          SnapshotGroup groups[num_groups]        in chat order
+ *          uint32   reaction_users[num_reactions]  every group's users, in group order
+ *          char     messages[]                     NUL-terminated
+ *
+ * columns_crc covers time through token_names and reactions_crc the groups
+ * and their users, both are checked on load. blocks_crc covers block_crc.
+ * A block's messages are only checked against its block_crc the first time
+ * the block is rendered.
+ */
+#define SNAPSHOT_MAGIC "CHATSNAP"
+#define SNAPSHOT_VERSION 4
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;        //of the header with header_crc set to 0
+    uint64_t segment;           //first log segment that is not in the snapshot
+    uint64_t num_rooms;
+};
+typedef struct SnapshotHeader SnapshotHeader;
+
+struct RoomHeader {
+    char name[ROOM_NAME];
+    uint64_t first;             //id of the first chat, the ones before were evicted
+    uint64_t num_chats;
+    uint64_t num_users;
+    uint64_t num_tokens;
+    uint64_t num_groups;
+    uint64_t num_reactions;
+    uint64_t user_names_len;
+    uint64_t token_names_len;
+    uint64_t messages_len;
+    uint32_t columns_crc;
+    uint32_t blocks_crc;
+    uint32_t reactions_crc;
+    uint32_t header_crc;        //of the room header with header_crc set to 0
+};
+typedef struct RoomHeader RoomHeader;
+
+struct SnapshotGroup {
+    uint32_t token;             //index into the token names
+    uint32_t count;             //users of the group in reaction_users
+};
+typedef struct SnapshotGroup SnapshotGroup;
+
+enum Section {
+    SECTION_TIME,
+    SECTION_USER,
+    SECTION_GROUP_COUNT,
+    SECTION_MESSAGE_OFFSET,
+    SECTION_MESSAGE_LEN,
+    SECTION_USER_OFFSET,
+    SECTION_USER_LEN,
+    SECTION_USER_NAMES,
+    SECTION_TOKEN_OFFSET,
+    SECTION_TOKEN_LEN,
+    SECTION_TOKEN_NAMES,
+    SECTION_BLOCK_CRC,
+    SECTION_GROUPS,
+    SECTION_REACTION_USERS,
+    SECTION_MESSAGES,
+    NUM_SECTIONS
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+/**
+ * Fills offset with where each section of a room starts, from the start of
+ * its RoomHeader, offset[NUM_SECTIONS] is the length of the room
+ */
+static void layout(const RoomHeader *header, uint64_t offset[NUM_SECTIONS + 1]){
+    uint64_t chats = header->num_chats;
+    uint64_t blocks = (chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK;
+    uint64_t size[NUM_SECTIONS] = {
+        chats * sizeof(int64_t),
+        chats * sizeof(uint32_t),
+        chats * sizeof(uint32_t),
+        chats * sizeof(uint64_t),
+        chats * sizeof(uint16_t),
+        header->num_users * sizeof(uint64_t),
+        header->num_users,
+        header->user_names_len,
+        header->num_tokens * sizeof(uint64_t),
+        header->num_tokens,
+        header->token_names_len,
+        blocks * sizeof(uint32_t),
+        header->num_groups * sizeof(SnapshotGroup),
+        header->num_reactions * sizeof(uint32_t),
+        header->messages_len
+    };
+
+    uint64_t at = ALIGN8(sizeof(RoomHeader));
+    for(int i = 0; i < NUM_SECTIONS; i++){
+        offset[i] = at;
+        at = ALIGN8(at + size[i]);
+    }
+    offset[NUM_SECTIONS] = at;
+}
+
+static char *snapshot_path = NULL;
+static int snapshot_interval = SNAPSHOT_INTERVAL;
+
+//held while a snapshot is taken, /reset sets snapshot_abort and waits for it
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int snapshot_abort = 0;
+
+//log position of the last snapshot, nothing to do while it doesn't move
+static uint64_t snapshot_lsn = 0;
+
+
+/**
+ * Writing
+ */
+
+/**
+ * The names of a UserTable at the cut, the table only grows past them
+ */
+struct NamesCapture {
+    UserTable *table;
+    uint32_t count;
+};
+typedef struct NamesCapture NamesCapture;
+
+/**
+ * What the snapshot copies of a room, the sizes at the cut and the rest after it
+ */
+struct RoomCapture {
+    const char *name;
+    ChatList *list;
+    int first;
+    int num_chats;              //from first on, the chunks and blocks too
+    int num_chunks;             //pinned
+    ChatChunk *chunks[MAX_CHUNKS];
+    TranscriptBlock **blocks;
+    uint32_t *num_groups;       //per chat
+    uint64_t total_groups;
+    uint32_t *group_count;      //users of each group, in chat order
+    NamesCapture users;
+    NamesCapture tokens;
+    Archive *archive;
+};
+typedef struct RoomCapture RoomCapture;
+
+struct Capture {
+    uint64_t segment;
+    int num_rooms;
+    int num_chats;
+    RoomCapture *rooms;
+};
+typedef struct Capture Capture;
+
+//the chunk of the id'th captured chat
+#define CHUNK_OF(capture, id) ((capture)->chunks[(id) >> CHUNK_SHIFT])
+
+static void free_capture(Capture *capture){
+    for(int i = 0; i < capture->num_rooms; i++){
+        RoomCapture *room = &capture->rooms[i];
+        for(int j = 0; j < room->num_chunks; j++){
+            atomic_fetch_sub(&room->chunks[j]->pins, 1);
+        }
+        free(room->blocks);
+        free(room->num_groups);
+        free(room->group_count);
+    }
+    free(capture->rooms);
+}
+
+/**
+ * Takes the sizes of the room and pins its chunks, the rest is copied
+ * once the locks are released, see capture_groups
+ *
+ * Called with the room's lock held exclusively.
+ */
+static void capture_room(Room *room, RoomCapture *capture){
+    ChatList *list = room->list;
+    capture->name = room->name;
+    capture->list = list;
+    capture->archive = list->archive;
+    capture->first = list->first;
+    capture->num_chats = list->size - list->first;
+    capture->users = (NamesCapture){&list->users, list->users.count};
+    capture->tokens = (NamesCapture){&list->tokens, list->tokens.count};
+
+    for(int i = 0; i * CHUNK_CHATS < capture->num_chats; i++){
+        capture->chunks[i] = CHAT_CHUNK(list, capture->first + i * CHUNK_CHATS);
+        atomic_fetch_add(&capture->chunks[i]->pins, 1);
+        capture->num_chunks++;
+    }
+}
+
+/**
+ * Called with every room's lock held exclusively, rooms that have no chats are left out
+ *
+ * @return 0 on success, -1 if allocation failed
+ */
+static int capture_chats(Capture *capture, int count){
+    capture->rooms = calloc(count > 0 ? count : 1, sizeof(RoomCapture));
+    if(capture->rooms == NULL){
+        return -1;
+    }
+
+    for(int i = 0; i < count; i++){
+        if(rooms[i]->list == NULL || rooms[i]->list->size == 0){
+            continue;
+        }
+        RoomCapture *room = &capture->rooms[capture->num_rooms++];
+        capture_room(rooms[i], room);
+        capture->num_chats += room->num_chats;
+    }
+    return 0;
+}
+
+//users at the front of the group that the captured names have
+static uint32_t known_users(const ReactionGroup *group, uint32_t num_users){
+    uint32_t count = 0;
+    while(count < group->count && group->users[count] < num_users){
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Copies the room's blocks, how many groups every chat has and how many
+ * users every group has, a block at a time under the block's lock
+ *
+ * Reactions added since the cut can be in there already. Replaying them
+ * from the log finds them repeated, so they only must not refer to names
+ * newer than the captured ones: a chat's groups and a group's users are
+ * taken up to the first one that does, everything from the cut comes
+ * before it. Blocks restored from the last snapshot and not used since
+ * are checked here, see verify_snapshot_block.
+ *
+ * @return 0 on success, -1 if allocation failed or /reset cancelled it
+ */
+static int capture_groups(RoomCapture *capture){
+    int num_chats = capture->num_chats;
+    int num_blocks = (num_chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK;
+    capture->blocks = malloc(sizeof(TranscriptBlock*) * num_blocks);
+    capture->num_groups = malloc(sizeof(uint32_t) * num_chats);
+    if(capture->blocks == NULL || capture->num_groups == NULL){
+        return -1;
+    }
+
+    uint64_t at = 0, capacity = 0;
+    for(int b = 0; b < num_blocks && !atomic_load(&snapshot_abort); b++){
+        ChatChunk *chunk = CHUNK_OF(capture, b * TRANSCRIPT_BLOCK);
+        TranscriptBlock *block = chunk->blocks[(capture->first / TRANSCRIPT_BLOCK + b) % CHUNK_BLOCKS];
+        int last = (b + 1) * TRANSCRIPT_BLOCK < num_chats ? (b + 1) * TRANSCRIPT_BLOCK : num_chats;
+        capture->blocks[b] = block;
+
+        pthread_mutex_lock(&block->lock);
+
+        //messages from the last snapshot get a new block_crc, they're checked against the old one first
+        if(block->unrendered > 0){
+            verify_snapshot_block(capture->list, chunk, capture->first / TRANSCRIPT_BLOCK + b);
+        }
+
+        for(int id = b * TRANSCRIPT_BLOCK; id < last; id++){
+            ReactionGroup *groups = chunk->groups[CHAT_INDEX(id)];
+            uint32_t num_groups = chunk->num_groups[CHAT_INDEX(id)];
+            if(at + num_groups > capacity){
+                uint64_t grown = capacity > 0 ? capacity : 1024;
+                while(grown < at + num_groups){
+                    grown *= 2;
+                }
+                uint32_t *group_count = realloc(capture->group_count, sizeof(uint32_t) * grown);
+                if(group_count == NULL){
+                    pthread_mutex_unlock(&block->lock);
+                    return -1;
+                }
+                capture->group_count = group_count;
+                capacity = grown;
+            }
+
+            uint32_t g = 0;
+            while(g < num_groups && groups[g].token < capture->tokens.count &&
+                  known_users(&groups[g], capture->users.count) > 0){
+                capture->group_count[at++] = known_users(&groups[g], capture->users.count);
+                g++;
+            }
+            capture->num_groups[id] = g;
+        }
+        pthread_mutex_unlock(&block->lock);
+    }
+
+    capture->total_groups = at;
+    return atomic_load(&snapshot_abort) ? -1 : 0;
+}
+
+/**
+ * Buffered output that keeps a running crc and its position in the file
+ */
+struct Writer {
+    FILE *file;
+    uint64_t at;
+    uint32_t crc;
+    int failed;
+};
+typedef struct Writer Writer;
+
+static void put(Writer *writer, const void *data, size_t len){
+    if(len > 0 && fwrite(data, 1, len, writer->file) != len){
+        writer->failed = 1;
+    }
+    writer->crc = crc32_update(writer->crc, data, len);
+    writer->at += len;
+}
+
+static void pad(Writer *writer){
+    static const char zeros[8];
+    put(writer, zeros, ALIGN8(writer->at) - writer->at);
+}
+
+/**
+ * Writes the offset, length and name sections of a name table
+ */
+static void put_names(Writer *writer, const NamesCapture *names){
+    UserTable *table = names->table;
+    uint64_t name_offset = 0;
+    for(uint32_t i = 0; i < names->count; i++){
+        put(writer, &name_offset, sizeof(name_offset));
+        name_offset += USER_LEN(table, i) + 1;
+    }
+    pad(writer);
+    for(uint32_t i = 0; i < names->count; i += USER_CHUNK){
+        uint32_t count = names->count - i < USER_CHUNK ? names->count - i : USER_CHUNK;
+        put(writer, table->chunks[i / USER_CHUNK]->len, count);
+    }
+    pad(writer);
+    for(uint32_t i = 0; i < names->count; i++){
+        put(writer, USER_NAME(table, i), USER_LEN(table, i) + 1);
+    }
+    pad(writer);
+}
+
+/**
+ * Writes either the groups or the users of the captured groups, under
+ * each block's lock because adding a reaction can move the arrays
+ */
+static void put_groups(Writer *writer, RoomCapture *capture, int users){
+    int num_blocks = (capture->num_chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK;
+    uint64_t at = 0;
+
+    for(int b = 0; b < num_blocks && !atomic_load(&snapshot_abort); b++){
+        TranscriptBlock *block = capture->blocks[b];
+        int last = (b + 1) * TRANSCRIPT_BLOCK < capture->num_chats ? (b + 1) * TRANSCRIPT_BLOCK : capture->num_chats;
+
+        pthread_mutex_lock(&block->lock);
+        for(int id = b * TRANSCRIPT_BLOCK; id < last; id++){
+            ReactionGroup *groups = CHUNK_OF(capture, id)->groups[CHAT_INDEX(id)];
+            for(uint32_t g = 0; g < capture->num_groups[id]; g++, at++){
+                //groups only grow at the end, the first count users are the ones at the cut
+                if(users){
+                    put(writer, groups[g].users, sizeof(uint32_t) * capture->group_count[at]);
+                }
+                else{
+                    SnapshotGroup group = {groups[g].token, capture->group_count[at]};
+                    put(writer, &group, sizeof(group));
+                }
+            }
+        }
+        pthread_mutex_unlock(&block->lock);
+    }
+    pad(writer);
+}
+
+/**
+ * Writes one captured room at the end of the file
+ *
+ * @return 0 on success, -1 if writing failed or /reset cancelled it
+ */
+static int write_room(Writer *writer, RoomCapture *capture){
+    int num_chats = capture->num_chats;
+    int num_blocks = (num_chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK;
+    uint64_t start = writer->at;
+
+    RoomHeader header;
+    memset(&header, 0, sizeof(header));
+    snprintf(header.name, sizeof(header.name), "%s", capture->name);
+    header.first = capture->first;
+    header.num_chats = num_chats;
+    header.num_users = capture->users.count;
+    header.num_tokens = capture->tokens.count;
+    header.num_groups = capture->total_groups;
+    for(int id = 0; id < num_chats; id++){
+        header.messages_len += CHUNK_OF(capture, id)->message_len[CHAT_INDEX(id)] + 1;
+    }
+    for(uint64_t g = 0; g < capture->total_groups; g++){
+        header.num_reactions += capture->group_count[g];
+    }
+    for(uint32_t i = 0; i < capture->users.count; i++){
+        header.user_names_len += USER_LEN(capture->users.table, i) + 1;
+    }
+    for(uint32_t i = 0; i < capture->tokens.count; i++){
+        header.token_names_len += USER_LEN(capture->tokens.table, i) + 1;
+    }
+
+    uint64_t offset[NUM_SECTIONS + 1];
+    layout(&header, offset);
+
+    uint32_t *block_crc = calloc(num_blocks, sizeof(uint32_t));
+    if(block_crc == NULL){
+        return -1;
+    }
+
+    //the room header goes in last, once the crcs are known
+    put(writer, &header, sizeof(header));
+    pad(writer);
+    writer->crc = 0;
+
+    //columns, from the chunks as they are
+    for(int i = 0; i * CHUNK_CHATS < num_chats; i++){
+        int count = num_chats - i * CHUNK_CHATS < CHUNK_CHATS ? num_chats - i * CHUNK_CHATS : CHUNK_CHATS;
+        put(writer, capture->chunks[i]->time, sizeof(int64_t) * count);
+    }
+    pad(writer);
+    for(int i = 0; i * CHUNK_CHATS < num_chats; i++){
+        int count = num_chats - i * CHUNK_CHATS < CHUNK_CHATS ? num_chats - i * CHUNK_CHATS : CHUNK_CHATS;
+        put(writer, capture->chunks[i]->user, sizeof(uint32_t) * count);
+    }
+    pad(writer);
+    put(writer, capture->num_groups, sizeof(uint32_t) * num_chats);
+    pad(writer);
+
+    uint64_t message_offset = 0;
+    for(int id = 0; id < num_chats; id++){
+        put(writer, &message_offset, sizeof(message_offset));
+        message_offset += CHUNK_OF(capture, id)->message_len[CHAT_INDEX(id)] + 1;
+    }
+    pad(writer);
+    for(int i = 0; i * CHUNK_CHATS < num_chats; i++){
+        int count = num_chats - i * CHUNK_CHATS < CHUNK_CHATS ? num_chats - i * CHUNK_CHATS : CHUNK_CHATS;
+        put(writer, capture->chunks[i]->message_len, sizeof(uint16_t) * count);
+    }
+    pad(writer);
+
+    put_names(writer, &capture->users);
+    put_names(writer, &capture->tokens);
+    header.columns_crc = writer->crc;
+
+    //block crcs are patched in after the data
+    put(writer, block_crc, sizeof(uint32_t) * num_blocks);
+    pad(writer);
+
+    writer->crc = 0;
+    put_groups(writer, capture, 0);
+    put_groups(writer, capture, 1);
+    header.reactions_crc = writer->crc;
+
+    //messages never move once added
+    for(int id = 0; id < num_chats && !atomic_load(&snapshot_abort); id++){
+        ChatChunk *chunk = CHUNK_OF(capture, id);
+        size_t len = chunk->message_len[CHAT_INDEX(id)] + 1;
+        put(writer, chunk->message[CHAT_INDEX(id)], len);
+        block_crc[id / TRANSCRIPT_BLOCK] = crc32_update(block_crc[id / TRANSCRIPT_BLOCK], chunk->message[CHAT_INDEX(id)], len);
+    }
+    pad(writer);
+
+    int ok = !writer->failed && !atomic_load(&snapshot_abort) && writer->at == start + offset[NUM_SECTIONS];
+
+    header.blocks_crc = crc32_update(0, block_crc, sizeof(uint32_t) * num_blocks);
+    header.header_crc = crc32_update(0, &header, sizeof(header));
+    ok = ok && fseek(writer->file, (long)(start + offset[SECTION_BLOCK_CRC]), SEEK_SET) == 0 &&
+         fwrite(block_crc, sizeof(uint32_t), num_blocks, writer->file) == (size_t)num_blocks &&
+         fseek(writer->file, (long)start, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, writer->file) == 1 &&
+         fseek(writer->file, 0, SEEK_END) == 0;
+
+    free(block_crc);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Writes the captured rooms to path
+ *
+ * @return 0 on success, -1 if writing failed or /reset cancelled it
+ */
+static int write_snapshot(Capture *capture, const char *path){
+    FILE *file = fopen(path, "wb");
+    if(file == NULL){
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.version = SNAPSHOT_VERSION;
+    header.segment = capture->segment;
+    header.num_rooms = capture->num_rooms;
+    header.header_crc = crc32_update(0, &header, sizeof(header));
+
+    Writer writer = {file, 0, 0, 0};
+    put(&writer, &header, sizeof(header));
+    pad(&writer);
+
+    int ok = !writer.failed;
+    for(int i = 0; ok && i < capture->num_rooms; i++){
+        ok = write_room(&writer, &capture->rooms[i]) == 0;
+    }
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+
+    fclose(file);
+    if(!ok){
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Takes a snapshot if anything changed since the last one
+ */
+static void take_snapshot(){
+    pthread_mutex_lock(&snapshot_lock);
+
+    Capture capture;
+    memset(&capture, 0, sizeof(capture));
+
+    //the cut, no room is created or changed while the log is rotated and the rooms are copied
+    pthread_mutex_lock(&room_lock);
+    int count = num_rooms;
+    for(int i = 0; i < count; i++){
+        pthread_rwlock_wrlock(&rooms[i]->lock);
+    }
+
+    uint64_t lsn = log_position();
+    int captured = -1;
+    if(lsn != snapshot_lsn && (capture.segment = log_rotate()) != 0){
+        captured = capture_chats(&capture, count);
+    }
+
+    for(int i = count - 1; i >= 0; i--){
+        pthread_rwlock_unlock(&rooms[i]->lock);
+    }
+    pthread_mutex_unlock(&room_lock);
+
+    if(capture.segment == 0){
+        pthread_mutex_unlock(&snapshot_lock);
+        return;
+    }
+
+    //the groups are copied without the rooms' locks, /reset waits for it like for the writing
+    for(int i = 0; captured == 0 && i < capture.num_rooms; i++){
+        captured = capture_groups(&capture.rooms[i]);
+    }
+
+    //the chats before the snapshot's have to be on disk before the log that has them goes
+    for(int i = 0; captured == 0 && i < capture.num_rooms; i++){
+        archive_sync(capture.rooms[i].archive);
+    }
+
+    //the rotated segments stay until a snapshot gets written
+    char temp_path[4096];
+    char path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.snapshot.tmp", snapshot_path);
+    snprintf(path, sizeof(path), "%s.snapshot", snapshot_path);
+
+    if(captured == 0 && write_snapshot(&capture, temp_path) == 0 && rename(temp_path, path) == 0){
+        sync_directory(path);
+        log_remove_segments(capture.segment);
+        snapshot_lsn = lsn;
+        printf("SERVER LOG: wrote snapshot of %d chats in %d rooms, log segments before %llu removed\n",
+               capture.num_chats, capture.num_rooms, (unsigned long long)capture.segment);
+    }
+    else if(!atomic_load(&snapshot_abort)){
+        perror("snapshot failed");
+    }
+
+    free_capture(&capture);
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+static void *run_snapshots(void *arg){
+    while(1){
+        sleep(snapshot_interval);
+        take_snapshot();
+    }
+    return NULL;
+}
+
+/**
+ * Starts taking a snapshot every interval seconds, 0 never takes one
+ */
+void snapshot_start(const char *path, int interval){
+    if(interval <= 0){
+        return;
+    }
+
+    snapshot_path = strdup(path);
+    snapshot_interval = interval;
+    if(snapshot_path == NULL){
+        perror("strdup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, run_snapshots, NULL) != 0){
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Cancels the snapshot being written, if any, and keeps new ones from
+ * starting until resume_snapshots
+ *
+ * Called by /reset before it frees a room's chats.
+ */
+void pause_snapshots(){
+    atomic_store(&snapshot_abort, 1);
+    pthread_mutex_lock(&snapshot_lock);
+    atomic_store(&snapshot_abort, 0);
+}
+
+void resume_snapshots(){
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+
+/**
+ * Loading
+ */
+static void corrupt(const char *path, const char *what){
+    fprintf(stderr, "%s is corrupt: %s\n", path, what);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Builds the room's list on top of its part of the mapped snapshot
+ */
+static void restore_room(const char *path, Room *room, Mapping *mapping, char *base,
+                         const RoomHeader *header, const uint64_t offset[NUM_SECTIONS + 1]){
+    const int64_t *time = (const int64_t*)(base + offset[SECTION_TIME]);
+    const uint32_t *user = (const uint32_t*)(base + offset[SECTION_USER]);
+    const uint32_t *num_groups = (const uint32_t*)(base + offset[SECTION_GROUP_COUNT]);
+    const uint64_t *message_offset = (const uint64_t*)(base + offset[SECTION_MESSAGE_OFFSET]);
+    const uint16_t *message_len = (const uint16_t*)(base + offset[SECTION_MESSAGE_LEN]);
+    const uint64_t *user_offset = (const uint64_t*)(base + offset[SECTION_USER_OFFSET]);
+    const uint8_t *user_len = (const uint8_t*)(base + offset[SECTION_USER_LEN]);
+    const char *user_names = base + offset[SECTION_USER_NAMES];
+    const uint64_t *token_offset = (const uint64_t*)(base + offset[SECTION_TOKEN_OFFSET]);
+    const uint8_t *token_len = (const uint8_t*)(base + offset[SECTION_TOKEN_LEN]);
+    const char *token_names = base + offset[SECTION_TOKEN_NAMES];
+    const uint32_t *block_crc = (const uint32_t*)(base + offset[SECTION_BLOCK_CRC]);
+    const SnapshotGroup *groups = (const SnapshotGroup*)(base + offset[SECTION_GROUPS]);
+    const uint32_t *reaction_users = (const uint32_t*)(base + offset[SECTION_REACTION_USERS]);
+    char *messages = base + offset[SECTION_MESSAGES];
+
+    ChatList *list = new_list();
+    if(list == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    //the chats before first are in the archive, the chunks and blocks in memory start at first
+    int first = (int)header->first;
+    list->first = first;
+    list->num_chunks = first >> CHUNK_SHIFT;
+    list->num_blocks = first / TRANSCRIPT_BLOCK;
+
+    //names are small, they are interned again
+    for(uint64_t i = 0; i < header->num_users; i++){
+        if(user_offset[i] + user_len[i] >= header->user_names_len || user_names[user_offset[i] + user_len[i]] != '\0' ||
+           intern_user(&list->users, &list->arena, user_names + user_offset[i]) != (int64_t)i){
+            corrupt(path, "bad username");
+        }
+    }
+    for(uint64_t i = 0; i < header->num_tokens; i++){
+        if(token_offset[i] + token_len[i] >= header->token_names_len || token_names[token_offset[i] + token_len[i]] != '\0' ||
+           intern_user(&list->tokens, &list->arena, token_names + token_offset[i]) != (int64_t)i){
+            corrupt(path, "bad reaction");
+        }
+    }
+
+    //the columns and the groups are copied, messages stay in the mapping
+    uint64_t group = 0, reaction = 0;
+    for(uint64_t i = 0; i < header->num_chats; i++){
+        int id = first + (int)i;
+        if(CHAT_INDEX(id) == 0 && reserve_chat(list, id) < 0){
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        if(user[i] >= header->num_users || message_offset[i] + message_len[i] >= header->messages_len ||
+           group + num_groups[i] > header->num_groups){
+            corrupt(path, "bad chat");
+        }
+
+        ChatChunk *chunk = CHAT_CHUNK(list, id);
+        int index = CHAT_INDEX(id);
+        chunk->time[index] = time[i];
+        chunk->user[index] = user[i];
+        chunk->message[index] = messages + message_offset[i];
+        chunk->message_len[index] = message_len[i];
+        chunk->bytes += message_len[i] + 1;
+        list->bytes += message_len[i] + 1;
+
+        //only the users that posted are padded to
+        if(user_len[user[i]] > list->width){
+            list->width = user_len[user[i]];
+        }
+
+        for(uint32_t g = 0; g < num_groups[i]; g++, group++){
+            if(groups[group].token >= header->num_tokens || groups[group].count == 0 ||
+               groups[group].count > header->num_reactions - reaction){
+                corrupt(path, "bad reaction group");
+            }
+            if(grow_groups(chunk, index) < 0){
+                perror("malloc failed");
+                exit(EXIT_FAILURE);
+            }
+
+            ReactionGroup *restored = &chunk->groups[index][g];
+            memset(restored, 0, sizeof(ReactionGroup));
+            restored->token = groups[group].token;
+            for(uint32_t j = 0; j < groups[group].count; j++, reaction++){
+                if(reaction_users[reaction] >= header->num_users){
+                    corrupt(path, "bad reaction user");
+                }
+                if(add_group_user(restored, reaction_users[reaction]) < 0){
+                    perror("malloc failed");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            chunk->num_groups[index]++;
+        }
+    }
+    if(group != header->num_groups || reaction != header->num_reactions){
+        corrupt(path, "bad reaction count");
+    }
+
+    //blocks are rendered the first time they're used
+    int num_blocks = (int)((header->num_chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK);
+    for(int b = 0; b < num_blocks; b++){
+        TranscriptBlock *block = new_block();
+        if(block == NULL){
+            perror("calloc failed");
+            exit(EXIT_FAILURE);
+        }
+        uint64_t left = header->num_chats - (uint64_t)b * TRANSCRIPT_BLOCK;
+        block->unrendered = left < TRANSCRIPT_BLOCK ? (int)left : TRANSCRIPT_BLOCK;
+        block->snapshot_crc = block_crc[b];
+        CHAT_BLOCK(list, list->num_blocks) = block;
+        list->num_blocks++;
+    }
+
+    list->size = first + (int)header->num_chats;
+    list->num_reactions = header->num_reactions;
+    list->mapping = mapping;
+    list->archive = archive_open(room->name);
+    room->list = list;
+    room->chat_id = list->size;
+}
+
+/**
+ * Maps <path>.snapshot and makes it the chats to start from
+ *
+ * Exits if the snapshot is there but can't be read or doesn't check out.
+ *
+ * @return the first log segment after the snapshot, 1 if there is no snapshot
+ */
+uint64_t snapshot_load(const char *path){
+    char file_path[4096];
+    snprintf(file_path, sizeof(file_path), "%s.snapshot", path);
+
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0){
+        if(errno == ENOENT){
+            return 1;
+        }
+        perror("open of snapshot failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) < 0){
+        perror("fstat of snapshot failed");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = (size_t)info.st_size;
+    if(len < ALIGN8(sizeof(SnapshotHeader))){
+        corrupt(file_path, "too short");
+    }
+
+    char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        perror("mmap of snapshot failed");
+        exit(EXIT_FAILURE);
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    uint32_t header_crc = header.header_crc;
+    header.header_crc = 0;
+    if(memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0){
+        corrupt(file_path, "not a chat snapshot");
+    }
+    if(header.version != SNAPSHOT_VERSION){
+        fprintf(stderr, "%s is a version %u snapshot, this server reads version %d\n",
+                file_path, header.version, SNAPSHOT_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    if(crc32_update(0, &header, sizeof(header)) != header_crc || header.num_rooms > MAX_ROOMS){
+        corrupt(file_path, "bad header");
+    }
+
+    //every room loaded holds a reference to the mapping
+    Mapping *mapping = calloc(1, sizeof(Mapping));
+    if(mapping == NULL){
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    mapping->data = data;
+    mapping->len = len;
+    atomic_store(&mapping->refs, (int)header.num_rooms);
+
+    uint64_t chats = 0;
+    uint64_t at = ALIGN8(sizeof(SnapshotHeader));
+    for(uint64_t i = 0; i < header.num_rooms; i++){
+        if(at + sizeof(RoomHeader) > len){
+            corrupt(file_path, "too short");
+        }
+
+        RoomHeader room_header;
+        memcpy(&room_header, data + at, sizeof(room_header));
+        uint32_t room_crc = room_header.header_crc;
+        room_header.header_crc = 0;
+        if(crc32_update(0, &room_header, sizeof(room_header)) != room_crc ||
+           room_header.name[ROOM_NAME - 1] != '\0' || room_header.num_chats == 0){
+            corrupt(file_path, "bad room header");
+        }
+
+        //the counts are bounded before the layout multiplies them
+        if(room_header.num_chats > (uint64_t)MAX_CHUNKS * CHUNK_CHATS || room_header.first % CHUNK_CHATS != 0 ||
+           room_header.first > (uint64_t)INT_MAX - room_header.num_chats || room_header.num_users > MAX_USERS || room_header.num_tokens > MAX_USERS ||
+           room_header.num_groups > len || room_header.num_reactions > len || room_header.user_names_len > len ||
+           room_header.token_names_len > len || room_header.messages_len > len){
+            corrupt(file_path, "bad counts");
+        }
+        uint64_t offset[NUM_SECTIONS + 1];
+        layout(&room_header, offset);
+        if(at + offset[NUM_SECTIONS] > len){
+            corrupt(file_path, "bad length");
+        }
+
+        char *base = data + at;
+        uint32_t columns_crc = crc32_update(0, base + offset[SECTION_TIME],
+                                            offset[SECTION_BLOCK_CRC] - offset[SECTION_TIME]);
+        uint32_t blocks_crc = crc32_update(0, base + offset[SECTION_BLOCK_CRC],
+                                           sizeof(uint32_t) * ((room_header.num_chats + TRANSCRIPT_BLOCK - 1) / TRANSCRIPT_BLOCK));
+        uint32_t reactions_crc = crc32_update(0, base + offset[SECTION_GROUPS],
+                                              offset[SECTION_MESSAGES] - offset[SECTION_GROUPS]);
+        if(columns_crc != room_header.columns_crc || blocks_crc != room_header.blocks_crc ||
+           reactions_crc != room_header.reactions_crc){
+            corrupt(file_path, "checksum mismatch");
+        }
+
+        Room *room = get_room(room_header.name, 1);
+        if(room == NULL || room->list != NULL){
+            corrupt(file_path, "bad room");
+        }
+        restore_room(file_path, room, mapping, base, &room_header, offset);
+
+        chats += room_header.num_chats;
+        at += offset[NUM_SECTIONS];
+    }
+    if(at != len){
+        corrupt(file_path, "bad length");
+    }
+
+    if(header.num_rooms == 0){
+        munmap(data, len);
+        free(mapping);
+    }
+
+    printf("SERVER LOG: mapped snapshot of %llu chats in %llu rooms from %s\n",
+           (unsigned long long)chats, (unsigned long long)header.num_rooms, file_path);
+    return header.segment;
+}
+
+/**
+ * Checks a block loaded from the snapshot against its block_crc the first
+ * time it is rendered, archived or written to the next snapshot
+ *
+ * This happens while requests are served, so a block that doesn't match
+ * doesn't stop the server. Its messages are dropped, the chats keep their
+ * time and user, which were checked at load, with an empty message.
+ *
+ * Called with the block's lock held, while every chat of the block still
+ * has its message in the mapping.
+ *
+ * @return 0 if the block matched, -1 if its messages were dropped
+ */
+int verify_snapshot_block(ChatList *list, ChatChunk *chunk, int i){
+    TranscriptBlock *block = chunk->blocks[i % CHUNK_BLOCKS];
+    if(block->snapshot_checked){
+        return 0;
+    }
+    block->snapshot_checked = 1;
+
+    int first = i * TRANSCRIPT_BLOCK;
+    int last = first + block->unrendered - 1;
+
+    //a block never spans two chunks
+    const char *messages = chunk->message[CHAT_INDEX(first)];
+    const char *messages_end = chunk->message[CHAT_INDEX(last)] + chunk->message_len[CHAT_INDEX(last)] + 1;
+
+    uint32_t crc = crc32_update(0, messages, messages_end - messages);
+    if(crc == block->snapshot_crc){
+        return 0;
+    }
+
+    fprintf(stderr, "snapshot block %d (chats #%d to #%d) is corrupt, its messages are dropped\n", i, first + 1, last + 1);
+    for(int id = first; id <= last; id++){
+        chunk->message[CHAT_INDEX(id)] = "";
+        chunk->message_len[CHAT_INDEX(id)] = 0;
+    }
+    return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef CHAT_SNAPSHOT_H
+#define CHAT_SNAPSHOT_H
+
+#include "chat-store.h"
+
+#include <stdint.h>
+
+/**
+ * Snapshots of the chats, see chat-snapshot.c
+ */
+#define SNAPSHOT_INTERVAL 60    //seconds between snapshots by default
+
+uint64_t snapshot_load(const char *path);
+void snapshot_start(const char *path, int interval);
+int verify_snapshot_block(ChatList *list, ChatChunk *chunk, int i);
+
+void pause_snapshots();
+void resume_snapshots();
+
+#endif
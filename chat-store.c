@@ -0,0 +1,1791 @@
+#include "chat-store.h"
+#include "chat-log.h"
+#include "chat-snapshot.h"
+#include "chat-archive.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+
+/**
+ * GENERAL STRUCTURE OF THE FILE ->
+ *
+ * Arena -- append-only storage for message bytes and names
+ *
+ * User table -- interned usernames
+ *
+ * Constructors for ChatList and TranscriptBlock
+ *
+ * Reaction pool -- slab allocator for the reaction group arrays of chats
+ *
+ * Reaction groups -- the users of a group and the check for repeats
+ *
+ * format_time() -- formats a chat's time, cached per thread for the current second
+ *
+ * Transcript cache -- the rendered /chats output, kept up to date by add_chat and add_reaction
+ *
+ * Reader epochs -- lets /reset free a room's chats once no reader is still in them
+ *
+ * Rooms -- the room table, looked up without a lock
+ *
+ * Retention -- evicts the oldest chunks of a room to its archive
+ *
+ * Chat store methods:
+ *      int add_chat(Room* room, char* username, char* message)
+ *      int add_chat_at(Room* room, char* username, char* message, int64_t time)
+ *      uint8_t add_reaction(Room* room, char* username, char* message, int id)
+ *      int chat_count(Room* room)
+ *      uint64_t chats_version(Room* room, ChatList* list, int first, int last)
+ *      void chat_totals(uint64_t* total_rooms, uint64_t* total_chats, uint64_t* total_reactions)
+ *      void write_chats(ChatList* list, int client_socket, int first, int last, int format, int reactions)
+ *      void write_chats_json(ChatList* list, JsonWriter* json, int first, int last, int format, int reactions, int lines)
+ *      void reset_chats(Room* room)
+ */
+
+
+/**
+ * Arena
+ *
+ * Strings are copied to the end of the first block, a new block is pushed
+ * in front when it is full. Nothing already stored ever moves.
+ */
+
+/**
+ * Copies len bytes of s into the arena and NUL-terminates them
+ *
+ * @return the copy, NULL if malloc failed
+ */
+const char *arena_copy(Arena *arena, const char *s, size_t len){
+    size_t block_size = arena->block_size ? arena->block_size : ARENA_BLOCK;
+    ArenaBlock *block = arena->blocks;
+    if(block == NULL || block->used + len + 1 > block_size - sizeof(ArenaBlock)){
+        block = malloc(block_size);
+        if(block == NULL){
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    char *copy = block->data + block->used;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+    return copy;
+}
+
+void free_arena(Arena *arena){
+    while(arena->blocks != NULL){
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+
+/**
+ * User table
+ *
+ * Usernames are hashed with FNV-1a into an open addressing table with
+ * linear probing, kept at most half full.
+ */
+uint32_t hash_name(const char *name, size_t len){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Adds a name chunk and doubles the slot table as needed for one more name
+ *
+ * @return 0 on success, -1 if allocation failed or the table is full
+ */
+int grow_users(UserTable *users){
+    if(users->count % USER_CHUNK == 0){
+        if(users->count / USER_CHUNK >= MAX_USER_CHUNKS){
+            return -1;
+        }
+        UserChunk *chunk = malloc(sizeof(UserChunk));
+        if(chunk == NULL){
+            return -1;
+        }
+        users->chunks[users->count / USER_CHUNK] = chunk;
+    }
+
+    if((users->count + 1) * 2 <= users->num_slots){
+        return 0;
+    }
+
+    uint32_t num_slots = users->num_slots ? users->num_slots * 2 : 128;
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if(slots == NULL){
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < users->count; i++){
+        uint32_t slot = hash_name(USER_NAME(users, i), USER_LEN(users, i)) & (num_slots - 1);
+        while(slots[slot] != 0){
+            slot = (slot + 1) & (num_slots - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    free(users->slots);
+    users->slots = slots;
+    users->num_slots = num_slots;
+    return 0;
+}
+
+/**
+ * @return index of the username, added if it is new, -1 if allocation failed
+ */
+int64_t intern_user(UserTable *users, Arena *arena, const char *name){
+    size_t len = strlen(name);
+
+    if(users->num_slots > 0){
+        uint32_t slot = hash_name(name, len) & (users->num_slots - 1);
+        while(users->slots[slot] != 0){
+            uint32_t index = users->slots[slot] - 1;
+            if(USER_LEN(users, index) == len && memcmp(USER_NAME(users, index), name, len) == 0){
+                return index;
+            }
+            slot = (slot + 1) & (users->num_slots - 1);
+        }
+    }
+
+    if(grow_users(users) < 0){
+        return -1;
+    }
+
+    const char *copy = arena_copy(arena, name, len);
+    if(copy == NULL){
+        return -1;
+    }
+
+    uint32_t index = users->count++;
+    USER_NAME(users, index) = copy;
+    USER_LEN(users, index) = (uint8_t)len;
+
+    uint32_t slot = hash_name(name, len) & (users->num_slots - 1);
+    while(users->slots[slot] != 0){
+        slot = (slot + 1) & (users->num_slots - 1);
+    }
+    users->slots[slot] = index + 1;
+    return index;
+}
+
+void free_users(UserTable *users){
+    for(uint32_t i = 0; i * USER_CHUNK < users->count; i++){
+        free(users->chunks[i]);
+    }
+    free(users->slots);
+    memset(users, 0, sizeof(UserTable));
+}
+
+
+/**
+ * Object constructors for:
+ *
+ * ChatList
+ * TranscriptBlock
+ */
+ChatList* new_list(){
+    //calloc leaves every array empty and the arena and name tables unallocated
+    ChatList* list = (ChatList*)calloc(1, sizeof(ChatList));
+
+    //checking if calloc failed
+    if(list == NULL){
+        return NULL;
+    }
+
+    pthread_mutex_init(&list->names_lock, NULL);
+    return list;
+}
+
+TranscriptBlock *new_block(){
+    TranscriptBlock *block = (TranscriptBlock*)calloc(1, sizeof(TranscriptBlock));
+
+    //checking if calloc failed
+    if(block == NULL){
+        return NULL;
+    }
+
+    pthread_mutex_init(&block->lock, NULL);
+    return block;
+}
+
+
+/**
+ * Reaction pool
+ *
+ * The group arrays of chats start empty and double when they fill up.
+ * Arrays of up to 1 << (REACTION_CLASSES - 1) groups are slots of a slab
+ * class, one class per power of two, carved out of SLAB_SIZE slabs. Freed
+ * slots go on their class's free list for the next array of that size.
+ * Larger arrays come from malloc, and so do the user arrays of groups.
+ *
+ * Slabs are shared by every room and never returned, a /reset puts the
+ * room's arrays back on the free lists for the other rooms to reuse.
+ */
+#define REACTION_CLASSES 4      //arrays of 1, 2, 4 and 8 groups
+#define SLAB_SIZE (64 * 1024)
+
+struct Slab {
+    struct Slab *next;
+    size_t used;
+    char slots[];
+};
+typedef struct Slab Slab;
+
+struct SlabClass {
+    pthread_mutex_t lock;
+    size_t slot_size;
+    void *free_slots;           //freed slots, linked through their first bytes
+    Slab *slabs;                //the first one is being carved
+};
+typedef struct SlabClass SlabClass;
+
+SlabClass reaction_pool[REACTION_CLASSES];
+
+void init_reaction_pool(){
+    for(int i = 0; i < REACTION_CLASSES; i++){
+        pthread_mutex_init(&reaction_pool[i].lock, NULL);
+        reaction_pool[i].slot_size = sizeof(ReactionGroup) << i;
+        reaction_pool[i].free_slots = NULL;
+        reaction_pool[i].slabs = NULL;
+    }
+}
+
+/**
+ * @return the slab class for arrays of capacity groups, -1 for malloc
+ */
+int reaction_class(uint32_t capacity){
+    for(int i = 0; i < REACTION_CLASSES; i++){
+        if(capacity == (1u << i)){
+            return i;
+        }
+    }
+    return -1;
+}
+
+ReactionGroup *alloc_groups(uint32_t capacity){
+    int index = reaction_class(capacity);
+    if(index < 0){
+        return malloc(sizeof(ReactionGroup) * capacity);
+    }
+
+    SlabClass *class = &reaction_pool[index];
+    pthread_mutex_lock(&class->lock);
+
+    void *slot = class->free_slots;
+    if(slot != NULL){
+        class->free_slots = *(void**)slot;
+    }
+    else{
+        //carve the next slot, start a new slab when the current one is used up
+        Slab *slab = class->slabs;
+        if(slab == NULL || slab->used + class->slot_size > SLAB_SIZE - sizeof(Slab)){
+            slab = malloc(SLAB_SIZE);
+            if(slab != NULL){
+                slab->next = class->slabs;
+                slab->used = 0;
+                class->slabs = slab;
+            }
+        }
+        if(slab != NULL){
+            slot = slab->slots + slab->used;
+            slab->used += class->slot_size;
+        }
+    }
+
+    pthread_mutex_unlock(&class->lock);
+    return slot;
+}
+
+void free_groups(ReactionGroup *groups, uint32_t capacity){
+    if(groups == NULL){
+        return;
+    }
+
+    int index = reaction_class(capacity);
+    if(index < 0){
+        free(groups);
+        return;
+    }
+
+    SlabClass *class = &reaction_pool[index];
+    pthread_mutex_lock(&class->lock);
+    *(void**)groups = class->free_slots;
+    class->free_slots = groups;
+    pthread_mutex_unlock(&class->lock);
+}
+
+/**
+ * Makes room for one more group on the index-th chat of the chunk
+ *
+ * @return 0 on success, -1 if allocation failed
+ */
+int grow_groups(ChatChunk *chunk, int index){
+    uint32_t num_groups = chunk->num_groups[index];
+    uint32_t old_capacity = chunk->group_capacity[index];
+    if(num_groups < old_capacity){
+        return 0;
+    }
+
+    uint32_t capacity = old_capacity ? old_capacity * 2 : 1;
+    ReactionGroup *groups = alloc_groups(capacity);
+    if(groups == NULL){
+        return -1;
+    }
+
+    if(num_groups > 0){
+        memcpy(groups, chunk->groups[index], sizeof(ReactionGroup) * num_groups);
+    }
+    free_groups(chunk->groups[index], old_capacity);
+
+    chunk->groups[index] = groups;
+    chunk->group_capacity[index] = capacity;
+    return 0;
+}
+
+
+/**
+ * Reaction groups
+ *
+ * The set of a group is an open addressing table with linear probing,
+ * kept at most half full. User indexes are spread with a multiplicative
+ * hash, they're mostly small and consecutive.
+ */
+static uint32_t user_slot(uint32_t user, uint32_t num_slots){
+    return (user * 2654435761u) & (num_slots - 1);
+}
+
+static void set_insert(uint32_t *slots, uint32_t num_slots, uint32_t user){
+    uint32_t slot = user_slot(user, num_slots);
+    while(slots[slot] != 0){
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    slots[slot] = user + 1;
+}
+
+/**
+ * @return 1 if the user is already counted in the group, 0 otherwise
+ */
+int group_has_user(ReactionGroup *group, uint32_t user){
+    if(group->num_slots == 0){
+        for(uint32_t i = 0; i < group->count; i++){
+            if(group->users[i] == user){
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    for(uint32_t slot = user_slot(user, group->num_slots); group->slots[slot] != 0;
+        slot = (slot + 1) & (group->num_slots - 1)){
+        if(group->slots[slot] == user + 1){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Counts the user in the group, which must not have it yet
+ *
+ * @return 0 on success, -1 if allocation failed
+ */
+int add_group_user(ReactionGroup *group, uint32_t user){
+    if(group->count == group->capacity){
+        uint32_t capacity = group->capacity ? group->capacity * 2 : 4;
+        uint32_t *users = realloc(group->users, sizeof(uint32_t) * capacity);
+        if(users == NULL){
+            return -1;
+        }
+        group->users = users;
+        group->capacity = capacity;
+    }
+
+    //the set starts once the group is too big to scan and doubles as it fills
+    if(group->count + 1 > REACTION_SET_MIN && (group->count + 1) * 2 > group->num_slots){
+        uint32_t num_slots = group->num_slots ? group->num_slots * 2 : 4 * REACTION_SET_MIN;
+        uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+        if(slots == NULL){
+            return -1;
+        }
+        for(uint32_t i = 0; i < group->count; i++){
+            set_insert(slots, num_slots, group->users[i]);
+        }
+        free(group->slots);
+        group->slots = slots;
+        group->num_slots = num_slots;
+    }
+
+    if(group->num_slots > 0){
+        set_insert(group->slots, group->num_slots, user);
+    }
+    group->users[group->count++] = user;
+    return 0;
+}
+
+/**
+ * Frees the groups of the index-th chat of the chunk
+ */
+void free_chat_groups(ChatChunk *chunk, int index){
+    for(uint32_t i = 0; i < chunk->num_groups[index]; i++){
+        free(chunk->groups[index][i].users);
+        free(chunk->groups[index][i].slots);
+    }
+    free_groups(chunk->groups[index], chunk->group_capacity[index]);
+}
+
+
+/**
+ * Time of a chat, microseconds since the epoch
+ */
+int64_t now_micros(){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Formats a chat's time
+ *
+ * TIME_LOCAL: "YYYY-MM-DD HH:MM:SS" in local time. Chats come in bursts
+ * within the same second, so each thread keeps the string of the last
+ * second it formatted and only calls localtime_r when the second changes.
+ * TIME_EPOCH: "<seconds>.<microseconds>"
+ *
+ * @return length of the string
+ */
+_Thread_local int64_t cached_second = -1;
+_Thread_local char cached_time[64];
+
+int format_time(int64_t micros, int format, char *time_str, size_t size){
+    int64_t seconds = micros / 1000000;
+
+    if(format == TIME_EPOCH){
+        return snprintf(time_str, size, "%lld.%06lld", (long long)seconds, (long long)(micros % 1000000));
+    }
+
+    if(seconds != cached_second){
+        time_t t = (time_t)seconds;
+
+        //converts to local time
+        struct tm tm;
+        localtime_r(&t, &tm);
+
+        snprintf(cached_time, sizeof(cached_time), "%04d-%02d-%02d %02d:%02d:%02d",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+            tm.tm_hour, tm.tm_min, tm.tm_sec);
+        cached_second = seconds;
+    }
+
+    return snprintf(time_str, size, "%s", cached_time);
+}
+
+
+/**
+ * Transcript cache
+ *
+ * The /chats output is kept rendered in blocks of TRANSCRIPT_BLOCK chats.
+ * add_chat appends to the last block and add_reaction splices the reaction
+ * line into its chat's block, so nothing is ever rendered twice. When a
+ * longer username raises the width, blocks are only re-padded when they are
+ * read next, by inserting spaces, without formatting anything again.
+ *
+ * A chat's reaction lines follow its line group by group, and every line of
+ * a group has the same length, REACTION_LINE_LEN of its token. So where a
+ * group's lines end is known from the counts alone, without looking at the
+ * text, and so is where the chat's own line ends.
+ */
+
+//19 spaces + 1 null terminator
+char const reaction_user_space[20] = "                   ";
+
+/**
+ * Makes room for len more bytes of text
+ *
+ * @return 0 on success, -1 if realloc failed
+ */
+int reserve_text(TranscriptBlock *block, size_t len){
+    if(block->len + len <= block->capacity){
+        return 0;
+    }
+
+    size_t capacity = block->capacity ? block->capacity : BUFFER_SIZE;
+    while(capacity < block->len + len){
+        capacity *= 2;
+    }
+
+    char *text = realloc(block->text, capacity);
+    if(text == NULL){
+        return -1;
+    }
+    block->text = text;
+    block->capacity = capacity;
+    return 0;
+}
+
+//usernames are at most 15 bytes, so the spaces in front always make up for them
+#define REACTION_LINE_LEN(token_len) (31 + (token_len))
+
+/**
+ * Formats the line of a user's reaction with the group's token
+ *
+ * @return length of the line
+ */
+int render_reaction(ChatList *list, ReactionGroup *group, uint32_t user, char *line, size_t size){
+    //calculating the number of spaces needed from the left
+    int username_len = USER_LEN(&list->users, user);
+    int total_spaces = 17 - username_len;
+
+    //copying the total number of spaces into the line
+    memcpy(line, reaction_user_space, total_spaces);
+
+    //adding the username inside () and the emohji
+    int len = total_spaces + snprintf(line + total_spaces, size - total_spaces, "          (%s) %s\n",
+                                      USER_NAME(&list->users, user), USER_NAME(&list->tokens, group->token));
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * @return length of the reaction lines of group g on through the last group of the chat
+ */
+size_t reaction_text_len(ChatList *list, ChatChunk *chunk, int index, uint32_t g){
+    size_t len = 0;
+    for(; g < chunk->num_groups[index]; g++){
+        ReactionGroup *group = &chunk->groups[index][g];
+        len += (size_t)group->count * REACTION_LINE_LEN(USER_LEN(&list->tokens, group->token));
+    }
+    return len;
+}
+
+/**
+ * Writes the reactions of a chat as one line of counts,
+ * "          (👍 x42) (🎉 x3)", nothing if it has none
+ */
+void write_summary(ChatList *list, ChatChunk *chunk, int index, int client_socket){
+    if(chunk->num_groups[index] == 0){
+        return;
+    }
+
+    http_write(client_socket, "         ", 9);
+    for(uint32_t g = 0; g < chunk->num_groups[index]; g++){
+        ReactionGroup *group = &chunk->groups[index][g];
+        char count[64];
+        int len = snprintf(count, sizeof(count), " (%s x%u)", USER_NAME(&list->tokens, group->token), group->count);
+        http_write(client_socket, count, len);
+    }
+    http_write(client_socket, "\n", 1);
+}
+
+/**
+ * Formats chat id of the chunk as "[#N timestamp] <username>: <message>\n"
+ * with the username padded to width
+ *
+ * @return length of the line, prefix_len is set to the length of "[#N timestamp] "
+ */
+int render_chat_line(ChatList *list, ChatChunk *chunk, int id, int width, int format, char *line, size_t size, int *prefix_len){
+    int index = CHAT_INDEX(id);
+    uint32_t user = chunk->user[index];
+
+    char timestamp[64];
+    format_time(chunk->time[index], format, timestamp, sizeof(timestamp));
+    *prefix_len = snprintf(line, size, "[#%d %s] ", id + 1, timestamp);
+
+    //finding the required padding, then the padded username
+    int padding_amount = width - USER_LEN(&list->users, user);
+    memcpy(line + *prefix_len, reaction_user_space, padding_amount);
+
+    int len = *prefix_len + padding_amount;
+    len += snprintf(line + len, size - len, "%s: %s\n", USER_NAME(&list->users, user), chunk->message[index]);
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * Appends chat id of the chunk's line to the end of the block, padded to the block's width
+ */
+void render_chat(TranscriptBlock *block, ChatList *list, ChatChunk *chunk, int id){
+    char line[BUFFER_SIZE];
+    int prefix_len;
+    int len = render_chat_line(list, chunk, id, block->width, TIME_LOCAL, line, sizeof(line), &prefix_len);
+
+    if(reserve_text(block, len) < 0){
+        return;
+    }
+    block->offset[block->num_chats] = block->len;
+    block->prefix_len[block->num_chats] = prefix_len;
+    block->num_chats++;
+
+    memcpy(block->text + block->len, line, len);
+    block->len += len;
+}
+
+/**
+ * Inserts len bytes of line at position at, inside the index-th chat of the block
+ */
+void splice_text(TranscriptBlock *block, int index, size_t at, const char *line, int len){
+    if(reserve_text(block, len) < 0){
+        return;
+    }
+
+    //the lines of the chats after this one move back by len
+    memmove(block->text + at + len, block->text + at, block->len - at);
+    memcpy(block->text + at, line, len);
+    block->len += len;
+
+    for(int i = index + 1; i < block->num_chats; i++){
+        block->offset[i] += len;
+    }
+}
+
+/**
+ * Inserts the line of the newest user of group g of chat id after the
+ * group's other lines
+ */
+void render_reaction_into(TranscriptBlock *block, ChatList *list, int id, uint32_t g){
+    ChatChunk *chunk = CHAT_CHUNK(list, id);
+    int index = CHAT_INDEX(id);
+    ReactionGroup *group = &chunk->groups[index][g];
+
+    char line[BUFFER_SIZE];
+    int len = render_reaction(list, group, group->users[group->count - 1], line, sizeof(line));
+
+    //the groups after this one end the chat
+    int i = id % TRANSCRIPT_BLOCK;
+    size_t end = i + 1 < block->num_chats ? block->offset[i + 1] : block->len;
+    splice_text(block, i, end - reaction_text_len(list, chunk, index, g + 1), line, len);
+}
+
+/**
+ * Re-pads every chat line of the block to the given width
+ *
+ * The width only ever grows, so this inserts (width - block->width) spaces
+ * in front of each username and moves everything else as is.
+ */
+void repad_block(TranscriptBlock *block, int width){
+    int delta = width - block->width;
+    if(delta <= 0){
+        return;
+    }
+
+    size_t len = block->len + (size_t)delta * block->num_chats;
+    char *text = malloc(len > 0 ? len : 1);
+    if(text == NULL){
+        return;
+    }
+
+    size_t at = 0;
+    for(int i = 0; i < block->num_chats; i++){
+        size_t start = block->offset[i];
+        size_t end = i + 1 < block->num_chats ? block->offset[i + 1] : block->len;
+        size_t prefix = block->prefix_len[i];
+
+        block->offset[i] = at;
+        memcpy(text + at, block->text + start, prefix);
+        at += prefix;
+        memset(text + at, ' ', delta);
+        at += delta;
+        memcpy(text + at, block->text + start + prefix, end - start - prefix);
+        at += end - start - prefix;
+    }
+
+    free(block->text);
+    block->text = text;
+    block->len = len;
+    block->capacity = len > 0 ? len : 1;
+    block->width = width;
+}
+
+/**
+ * Renders the chats block i of the chunk got from a snapshot, the first time the block is used
+ *
+ * Called with the block's lock held.
+ */
+void render_block(ChatList *list, ChatChunk *chunk, int i){
+    TranscriptBlock *block = chunk->blocks[i % CHUNK_BLOCKS];
+    if(block->unrendered == 0){
+        return;
+    }
+    verify_snapshot_block(list, chunk, i);
+
+    block->width = list->width;
+    int base = i * TRANSCRIPT_BLOCK;
+    for(int id = base; id < base + block->unrendered; id++){
+        render_chat(block, list, chunk, id);
+
+        int index = CHAT_INDEX(id);
+        for(uint32_t g = 0; g < chunk->num_groups[index]; g++){
+            ReactionGroup *group = &chunk->groups[index][g];
+            for(uint32_t j = 0; j < group->count; j++){
+                char line[BUFFER_SIZE];
+                int len = render_reaction(list, group, group->users[j], line, sizeof(line));
+                splice_text(block, id - base, block->len, line, len);
+            }
+        }
+    }
+    block->unrendered = 0;
+}
+
+/**
+ * Frees a block of a chunk that is being freed, NULL if it never got one
+ */
+void free_block(TranscriptBlock *block){
+    if(block == NULL){
+        return;
+    }
+    pthread_mutex_destroy(&block->lock);
+    free(block->text);
+    free(block->deflated.data);
+    free(block);
+}
+
+/**
+ * Renders the newest chat of the list into the transcript
+ *
+ * Called with the room's lock held exclusively, before the chat is
+ * published. Readers may be in any block, so the last one is locked.
+ */
+void transcript_add_chat(ChatList *list, int id){
+    ChatChunk *chunk = CHAT_CHUNK(list, id);
+    int username_len = USER_LEN(&list->users, chunk->user[CHAT_INDEX(id)]);
+    if(username_len > list->width){
+        list->width = username_len;
+    }
+
+    //the first chat of a block starts it, the block before may be evicted already
+    TranscriptBlock *block = id % TRANSCRIPT_BLOCK > 0 ? CHAT_BLOCK(list, list->num_blocks - 1) : NULL;
+    if(block != NULL){
+        //a block loaded from a snapshot has to be rendered before it can be appended to
+        pthread_mutex_lock(&block->lock);
+        render_block(list, chunk, list->num_blocks - 1);
+        if(block->num_chats == TRANSCRIPT_BLOCK){
+            pthread_mutex_unlock(&block->lock);
+            block = NULL;
+        }
+    }
+
+    //start a new block when the last one is full, readers don't look at it before the chat is published
+    if(block == NULL){
+        block = new_block();
+        if(block == NULL){
+            return;
+        }
+        block->width = list->width;
+        CHAT_BLOCK(list, list->num_blocks) = block;
+        list->num_blocks++;
+        pthread_mutex_lock(&block->lock);
+    }
+
+    //only the block that is appended to gets re-padded right away
+    repad_block(block, list->width);
+    render_chat(block, list, chunk, id);
+    pthread_mutex_unlock(&block->lock);
+}
+
+
+/**
+ * Reader epochs
+ *
+ * A reader announces the global epoch in its thread's slot for as long as
+ * it reads, 0 when it's not reading. To free a list, /reset first takes it
+ * out of the room, then moves the epoch on, and the list is freed once no
+ * slot holds an older epoch. A reader that announced before the list was
+ * taken out may still be in it, one that announced after can't find the
+ * list anymore. Nothing waits for that, the list is freed by the next
+ * reader or writer that finds its readers gone, see free_reset_lists().
+ *
+ * Readers only write their own cache line, so they don't contend with
+ * each other or with writers.
+ */
+struct ReaderSlot {
+    _Atomic uint64_t epoch;
+    char padding[64 - sizeof(uint64_t)];
+};
+typedef struct ReaderSlot ReaderSlot;
+
+_Atomic uint64_t reader_epoch = 1;
+ReaderSlot reader_slots[MAX_READERS];
+_Atomic int num_reader_slots = 0;
+_Thread_local int reader_slot = -1;
+
+//lists /reset took out of their rooms that readers may still be in
+pthread_mutex_t reset_lock = PTHREAD_MUTEX_INITIALIZER;
+ChatList *reset_lists = NULL;
+_Atomic int num_reset_lists = 0;
+
+static void free_reset_lists();
+
+/**
+ * Starts reading, the chats of any room found from here on stay allocated until reader_exit
+ */
+void reader_enter(){
+    if(reader_slot < 0){
+        reader_slot = atomic_fetch_add(&num_reader_slots, 1);
+        if(reader_slot >= MAX_READERS){
+            fprintf(stderr, "more than %d threads read chats\n", MAX_READERS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_store(&reader_slots[reader_slot].epoch, atomic_load(&reader_epoch));
+}
+
+void reader_exit(){
+    atomic_store_explicit(&reader_slots[reader_slot].epoch, 0, memory_order_release);
+    free_reset_lists();
+}
+
+/**
+ * Moves the epoch on, after something was taken out of a room
+ *
+ * @return the new epoch, for readers_done
+ */
+uint64_t next_reader_epoch(){
+    return atomic_fetch_add(&reader_epoch, 1) + 1;
+}
+
+/**
+ * Whether every reader from before the epoch is done, without waiting for them
+ */
+int readers_done(uint64_t epoch){
+    int count = atomic_load(&num_reader_slots);
+    for(int i = 0; i < count && i < MAX_READERS; i++){
+        uint64_t announced = atomic_load(&reader_slots[i].epoch);
+        if(announced != 0 && announced < epoch){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Rooms
+ *
+ * Room names are hashed with FNV-1a into room_slots, an open addressing
+ * table with linear probing that is never more than half full. Rooms are
+ * only ever added, with the slot published last, so lookups don't take a
+ * lock. Creating a room takes room_lock, which also keeps rooms and
+ * num_rooms, the rooms in the order they were created, from changing.
+ *
+ * Locking inside a room
+ *
+ * Changes are logged (see chat-log.c) and published while their lock is
+ * still held, so the log and the events have them in the order they were made.
+ *
+ * room->lock is only taken by writers. It guards the writing end of the
+ * room's list, its arena, its name tables and chat_id. Posts and /reset
+ * take it exclusively, reactions take it shared. The reactions of a chat
+ * and the rendered text around them are guarded by the lock of the chat's
+ * transcript block, so reactions to chats in different blocks don't
+ * contend and never need the exclusive lock. Reactions intern the user and
+ * the token under the list's names_lock, posts don't need it.
+ *
+ * Readers never take room->lock, so a long /chats never holds up a post.
+ * Nothing a reader can reach is moved or freed while chats are added (see
+ * ChatList), they only lock one transcript block at a time while copying
+ * its text. /reset unpublishes the list and waits for the readers that
+ * might still be in it before freeing it, see the reader epochs. Evicted
+ * chunks are freed the same way, see the retention.
+ */
+#define ROOM_SLOTS (2 * MAX_ROOMS)
+
+Room *_Atomic room_slots[ROOM_SLOTS];
+Room *rooms[MAX_ROOMS];
+int num_rooms = 0;
+pthread_mutex_t room_lock = PTHREAD_MUTEX_INITIALIZER;
+
+Room *new_room(const char *name){
+    Room *room = (Room*)calloc(1, sizeof(Room));
+
+    //checking if calloc failed
+    if(room == NULL){
+        return NULL;
+    }
+
+    room->events = http_channel_create(EVENT_HISTORY);
+    if(room->events == NULL){
+        free(room);
+        return NULL;
+    }
+
+    snprintf(room->name, sizeof(room->name), "%s", name);
+    pthread_rwlock_init(&room->lock, NULL);
+    return room;
+}
+
+/**
+ * Finds the room with the given name, creating it if create is set
+ *
+ * @return the room, NULL if it doesn't exist or can't be created
+ */
+Room *get_room(const char *name, int create){
+    uint32_t hash = hash_name(name, strlen(name));
+
+    for(uint32_t slot = hash & (ROOM_SLOTS - 1); ; slot = (slot + 1) & (ROOM_SLOTS - 1)){
+        Room *room = atomic_load_explicit(&room_slots[slot], memory_order_acquire);
+        if(room == NULL){
+            break;
+        }
+        if(strcmp(room->name, name) == 0){
+            return room;
+        }
+    }
+
+    if(!create){
+        return NULL;
+    }
+
+    //probe again under the lock, another thread may have just created it
+    pthread_mutex_lock(&room_lock);
+
+    uint32_t slot = hash & (ROOM_SLOTS - 1);
+    Room *room = NULL;
+    while((room = atomic_load_explicit(&room_slots[slot], memory_order_relaxed)) != NULL){
+        if(strcmp(room->name, name) == 0){
+            pthread_mutex_unlock(&room_lock);
+            return room;
+        }
+        slot = (slot + 1) & (ROOM_SLOTS - 1);
+    }
+
+    if(num_rooms < MAX_ROOMS){
+        room = new_room(name);
+    }
+    if(room != NULL){
+        rooms[num_rooms++] = room;
+        atomic_store_explicit(&room_slots[slot], room, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&room_lock);
+    return room;
+}
+
+
+/**
+ * Retention
+ *
+ * Before a post, the room's oldest chunk is evicted for as long as one of
+ * the limits says so: more than retain_chats chats would be left without
+ * it, its newest chat is older than retain_age, or the messages in memory
+ * are over retain_bytes. Chunks are evicted whole and never the one the
+ * new chat goes into, so a room keeps up to CHUNK_CHATS - 1 chats more
+ * than the limits. The oldest chunk is also evicted when the ring has no
+ * slot left for the new chat's chunk. An evicted chunk gets its segment
+ * in the room's archive reserved, if it has one, and the post that evicted
+ * it writes the segment once it released the room's lock. The chunk stays
+ * pinned until then.
+ *
+ * Eviction raises first, readers that check it afterwards read the chunk
+ * from the archive. Readers that found the chunk before may still be in
+ * it, and a snapshot being written pins it, so it goes on the list's
+ * retired list with the reader epoch it was evicted at. Posts take the
+ * retired chunks no reader from before that epoch is in and no snapshot
+ * pins off the list, and free them after the room's lock is released.
+ * Nothing waits for readers.
+ *
+ * A new chunk can take over the ring slot of an evicted one right away.
+ * Readers find chunks with reader_chunk(), which checks first after the
+ * slot, so they never mistake the new chunk for the one they wanted.
+ *
+ * Age is measured against the time of the new chat, so replaying the log
+ * evicts the same chunks again.
+ */
+#define CHUNK_ARENA_BLOCK (32 * 1024)
+
+int retain_chats = MAX_CHATS;
+int retain_age = 0;
+uint64_t retain_bytes = 0;
+
+void free_chunk(ChatChunk *chunk){
+    for(int i = 0; i < CHUNK_CHATS; i++){
+        free_chat_groups(chunk, i);
+    }
+    for(int i = 0; i < CHUNK_BLOCKS; i++){
+        free_block(chunk->blocks[i]);
+    }
+    free_arena(&chunk->messages);
+    free(chunk);
+}
+
+/**
+ * Takes the retired chunks that no reader and no snapshot is in anymore
+ * off the list, all of them if force is set
+ *
+ * Called with the room's lock held exclusively, or once nothing else has
+ * the list.
+ *
+ * @return the chunks, linked through retired, for free_chunks
+ */
+ChatChunk *reclaim_retired(ChatList *list, int force){
+    ChatChunk *reclaimed = NULL;
+    ChatChunk **link = &list->retired;
+    while(*link != NULL){
+        ChatChunk *chunk = *link;
+        if(force || (atomic_load(&chunk->pins) == 0 && readers_done(chunk->retired_epoch))){
+            *link = chunk->retired;
+            chunk->retired = reclaimed;
+            reclaimed = chunk;
+        }
+        else{
+            link = &chunk->retired;
+        }
+    }
+    return reclaimed;
+}
+
+void free_chunks(ChatChunk *chunk){
+    while(chunk != NULL){
+        ChatChunk *next = chunk->retired;
+        free_chunk(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * Chunk of chat id for a reader, NULL if it was evicted
+ *
+ * The slot is read before first, so a chunk found there while first says
+ * the chat is still in memory is the chat's own and not a newer one that
+ * took the slot over. It stays allocated until the reader is done, even
+ * if it is evicted right after.
+ */
+ChatChunk *reader_chunk(ChatList *list, int id){
+    ChatChunk *chunk = CHAT_CHUNK(list, id);
+    atomic_thread_fence(memory_order_acquire);
+    if(atomic_load(&list->first) > id){
+        return NULL;
+    }
+    return chunk;
+}
+
+/**
+ * Retires the oldest chunk of the list, reserving its segment in the
+ * archive for unlock_chats to write
+ *
+ * Called with the room's lock held exclusively.
+ *
+ * @return 0 on success, -1 if allocation failed
+ */
+int evict_chunk(ChatList *list){
+    int first = list->first;
+    ChatChunk *chunk = CHAT_CHUNK(list, first);
+
+    //messages from a snapshot are checked before they are archived, like before they are rendered
+    for(int i = 0; i < CHUNK_BLOCKS; i++){
+        TranscriptBlock *block = chunk->blocks[i];
+        if(block != NULL && block->unrendered > 0){
+            pthread_mutex_lock(&block->lock);
+            verify_snapshot_block(list, chunk, first / TRANSCRIPT_BLOCK + i);
+            pthread_mutex_unlock(&block->lock);
+        }
+    }
+    int reserved = list->archive == NULL ? 0 : archive_reserve(list->archive, chunk->number);
+    if(reserved < 0){
+        return -1;
+    }
+    if(reserved){
+        atomic_fetch_add(&chunk->pins, 1);
+        chunk->spill = list->spills;
+        list->spills = chunk;
+    }
+
+    list->bytes -= chunk->bytes;
+    chunk->retired = list->retired;
+    list->retired = chunk;
+    atomic_store(&list->first, first + CHUNK_CHATS);
+
+    //readers that announce this epoch or a later one see the new first
+    chunk->retired_epoch = next_reader_epoch();
+    return 0;
+}
+
+/**
+ * Evicts the chunks the retention doesn't keep once chat id is added at time
+ *
+ * Called with the room's lock held exclusively.
+ *
+ * @return 0 on success, -1 if the ring is full and its oldest chunk can't be evicted
+ */
+int evict_chats(ChatList *list, int id, int64_t time){
+    while((list->first >> CHUNK_SHIFT) < (id >> CHUNK_SHIFT)){
+        int first = list->first;
+        ChatChunk *chunk = CHAT_CHUNK(list, first);
+
+        int ring_full = (id >> CHUNK_SHIFT) - (first >> CHUNK_SHIFT) >= MAX_CHUNKS;
+        int evict = ring_full || id + 1 - (first + CHUNK_CHATS) >= retain_chats ||
+                    (retain_age > 0 && chunk->time[CHUNK_CHATS - 1] < time - (int64_t)retain_age * 1000000) ||
+                    (retain_bytes > 0 && list->bytes > retain_bytes);
+        if(!evict){
+            break;
+        }
+        if(evict_chunk(list) < 0){
+            return ring_full ? -1 : 0;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Chat store methods:
+ *
+ * int add_chat(Room* room, char* username, char* message)
+ * uint8_t add_reaction(Room* room, char* username, char* message, int id)
+ */
+
+/**
+ * Moves the room to its next version once a change is visible, the block
+ * the change was in, if any, gets the same version
+ */
+void bump_version(Room *room, TranscriptBlock *block){
+    uint64_t version = atomic_fetch_add_explicit(&room->version, 1, memory_order_acq_rel) + 1;
+    if(block != NULL){
+        atomic_store_explicit(&block->version, version, memory_order_release);
+    }
+}
+
+/**
+ * Makes sure the chunk for chat id exists
+ *
+ * @return 0 on success, -1 if allocation failed
+ */
+int reserve_chat(ChatList *list, int id){
+    int chunk = id >> CHUNK_SHIFT;
+    if(chunk < list->num_chunks){
+        return 0;
+    }
+
+    //calloc leaves every chat of the chunk without reactions
+    ChatChunk *new_chunk = calloc(1, sizeof(ChatChunk));
+    if(new_chunk == NULL){
+        return -1;
+    }
+    new_chunk->messages.block_size = CHUNK_ARENA_BLOCK;
+    new_chunk->number = (uint64_t)chunk;
+
+    //the slot may still hold an evicted chunk, readers have to see it evicted before they can find this one
+    atomic_thread_fence(memory_order_release);
+    list->chunks[chunk % MAX_CHUNKS] = new_chunk;
+    list->num_chunks = chunk + 1;
+    return 0;
+}
+
+/**
+ * @return id of the new chat, -1 if the chat limit was reached
+ */
+int add_chat(Room* room, char* username, char* message){
+    return add_chat_at(room, username, message, now_micros());
+}
+
+/**
+ * Releases the room's lock after a post, then archives the chunks the post
+ * evicted and frees the retired ones nothing is in anymore
+ *
+ * The post stays a reader while it archives, so a /reset in between
+ * doesn't free the list and its archive under it.
+ */
+static void unlock_chats(Room *room, ChatList *list){
+    ChatChunk *spills = list->spills;
+    list->spills = NULL;
+    ChatChunk *reclaimed = list->retired != NULL ? reclaim_retired(list, 0) : NULL;
+    if(spills != NULL){
+        reader_enter();
+    }
+    pthread_rwlock_unlock(&room->lock);
+    free_chunks(reclaimed);
+
+    if(spills == NULL){
+        free_reset_lists();
+        return;
+    }
+    while(spills != NULL){
+        ChatChunk *next = spills->spill;
+        archive_spill(list->archive, spills, spills->number);
+        atomic_fetch_sub(&spills->pins, 1);
+        spills = next;
+    }
+    reader_exit();
+}
+
+/**
+ * add_chat for a chat made at the given time, log replay keeps the original times
+ */
+int add_chat_at(Room* room, char* username, char* message, int64_t time){
+    pthread_rwlock_wrlock(&room->lock);
+
+    if(room->list == NULL){
+        room->list = new_list();
+        if(room->list != NULL){
+            room->list->archive = archive_open(room->name);
+            room->list->created = atomic_load(&room->version);
+        }
+    }
+    ChatList *chatList = room->list;
+    if(chatList == NULL){
+        pthread_rwlock_unlock(&room->lock);
+        return -1;
+    }
+
+    //ids only ever count up, a room that used them all takes no more chats
+    int id = room->chat_id;
+    if(id == INT_MAX || evict_chats(chatList, id, time) < 0 || reserve_chat(chatList, id) < 0){
+        unlock_chats(room, chatList);
+        return -1;
+    }
+
+    ChatChunk *chunk = CHAT_CHUNK(chatList, id);
+    int index = CHAT_INDEX(id);
+    size_t message_len = strnlen(message, 255);
+    int64_t user = intern_user(&chatList->users, &chatList->arena, username);
+    const char *copy = user < 0 ? NULL : arena_copy(&chunk->messages, message, message_len);
+    if(copy == NULL){
+        unlock_chats(room, chatList);
+        return -1;
+    }
+
+    chunk->time[index] = time;
+    chunk->user[index] = (uint32_t)user;
+    chunk->message[index] = copy;
+    chunk->message_len[index] = (uint16_t)message_len;
+    chunk->bytes += message_len + 1;
+    chatList->bytes += message_len + 1;
+    transcript_add_chat(chatList, id);
+
+    //readers can see the chat from here on, and the new version once they can
+    atomic_store_explicit(&chatList->size, id + 1, memory_order_release);
+    bump_version(room, CHAT_BLOCK(chatList, id / TRANSCRIPT_BLOCK));
+    log_chat(room->name, time, USER_NAME(&chatList->users, (uint32_t)user), copy);
+
+    //published under the lock so subscribers see chats in id order
+    //the event is the unpadded line without its newline
+    char event[BUFFER_SIZE];
+    int prefix_len;
+    int event_len = render_chat_line(chatList, chunk, id, USER_LEN(&chatList->users, chunk->user[index]), TIME_LOCAL,
+                                     event, sizeof(event), &prefix_len);
+    http_publish(room->events, "chat", event, event_len - 1);
+
+    //update current chat_id so the next function call has a new chat_id
+    room->chat_id++;
+
+    //evicted chunks are archived and freed outside the lock
+    unlock_chats(room, chatList);
+
+    return id;
+}
+
+/**
+ * Counts the user's reaction in the chat's group for it, a new group if the
+ * chat has no reaction like it yet
+ *
+ * @return REACTION_ADDED, REACTION_NO_CHAT if the id does not exist (anymore),
+ *         REACTION_REPEATED if the user already reacted to it like that or
+ *         REACTION_ARCHIVED if the chat was evicted
+ */
+uint8_t add_reaction(Room* room, char* username, char* message, int id){
+    pthread_rwlock_rdlock(&room->lock);
+    ChatList *chatList = room->list;
+
+    if(chatList == NULL || id < 0 || id >= chatList->size){
+        pthread_rwlock_unlock(&room->lock);
+        return REACTION_NO_CHAT;
+    }
+    if(id < chatList->first){
+        pthread_rwlock_unlock(&room->lock);
+        return REACTION_ARCHIVED;
+    }
+
+    //other reactions may be interning at the same time
+    pthread_mutex_lock(&chatList->names_lock);
+    int64_t user = intern_user(&chatList->users, &chatList->arena, username);
+    int64_t token = user < 0 ? -1 : intern_user(&chatList->tokens, &chatList->arena, message);
+    pthread_mutex_unlock(&chatList->names_lock);
+    if(token < 0){
+        pthread_rwlock_unlock(&room->lock);
+        return REACTION_NO_CHAT;
+    }
+
+    TranscriptBlock *block = CHAT_BLOCK(chatList, id / TRANSCRIPT_BLOCK);
+    ChatChunk *chunk = CHAT_CHUNK(chatList, id);
+    int index = CHAT_INDEX(id);
+    pthread_mutex_lock(&block->lock);
+    render_block(chatList, chunk, id / TRANSCRIPT_BLOCK);
+
+    uint32_t g = 0;
+    while(g < chunk->num_groups[index] && chunk->groups[index][g].token != (uint32_t)token){
+        g++;
+    }
+
+    uint8_t result = REACTION_ADDED;
+    if(g < chunk->num_groups[index] && group_has_user(&chunk->groups[index][g], (uint32_t)user)){
+        result = REACTION_REPEATED;
+    }
+    else if(g == chunk->num_groups[index] && grow_groups(chunk, index) < 0){
+        result = REACTION_NO_CHAT;
+    }
+    else{
+        //a new group only counts once it has its first user
+        ReactionGroup *group = &chunk->groups[index][g];
+        if(g == chunk->num_groups[index]){
+            memset(group, 0, sizeof(ReactionGroup));
+            group->token = (uint32_t)token;
+        }
+        if(add_group_user(group, (uint32_t)user) < 0){
+            result = REACTION_NO_CHAT;
+        }
+        else if(g == chunk->num_groups[index]){
+            chunk->num_groups[index]++;
+        }
+    }
+    if(result != REACTION_ADDED){
+        pthread_mutex_unlock(&block->lock);
+        pthread_rwlock_unlock(&room->lock);
+        return result;
+    }
+    atomic_fetch_add_explicit(&chatList->num_reactions, 1, memory_order_relaxed);
+    bump_version(room, block);
+
+    const char *ruser = USER_NAME(&chatList->users, (uint32_t)user);
+    const char *rmessage = USER_NAME(&chatList->tokens, (uint32_t)token);
+    render_reaction_into(block, chatList, id, g);
+    log_reaction(room->name, id, ruser, rmessage);
+
+    char event[BUFFER_SIZE];
+    int event_len = snprintf(event, sizeof(event), "#%d (%s) %s", id + 1, ruser, rmessage);
+    http_publish(room->events, "reaction", event, event_len < (int)sizeof(event) ? event_len : (int)sizeof(event) - 1);
+
+    pthread_mutex_unlock(&block->lock);
+    pthread_rwlock_unlock(&room->lock);
+
+    // returning one is successful for assert testing purposes
+    return REACTION_ADDED;
+}
+
+/**
+ * Validator of the chats [first, last) of the list, for conditional GETs
+ *
+ * Called between reader_enter and reader_exit. Chats are only ever added
+ * at the end, so the version of a range that is all there already is the
+ * newest of its blocks. Evicted chats no longer change, and the list's own
+ * version is newer than anything from before the room's last reset. A
+ * range that can still grow, or a room without chats, goes by the room's
+ * version.
+ *
+ * A chat and its version are published in that order, so the chats read
+ * after the version was taken are at least that new.
+ */
+uint64_t chats_version(Room *room, ChatList *list, int first, int last){
+    if(room == NULL){
+        return 0;
+    }
+    uint64_t version = atomic_load_explicit(&room->version, memory_order_acquire);
+    if(list == NULL || last >= atomic_load_explicit(&list->size, memory_order_acquire)){
+        return version;
+    }
+
+    version = list->created;
+    int memory = atomic_load_explicit(&list->first, memory_order_acquire);
+    for(int i = (first > memory ? first : memory) / TRANSCRIPT_BLOCK; i * TRANSCRIPT_BLOCK < last; i++){
+        ChatChunk *chunk = reader_chunk(list, i * TRANSCRIPT_BLOCK);
+        if(chunk == NULL){
+            continue;
+        }
+        uint64_t block_version = atomic_load_explicit(&chunk->blocks[i % CHUNK_BLOCKS]->version, memory_order_acquire);
+        if(block_version > version){
+            version = block_version;
+        }
+    }
+    return version;
+}
+
+/**
+ * @return current number of chats, -1 before the first chat
+ */
+int chat_count(Room* room){
+    reader_enter();
+    ChatList *list = room->list;
+    int size = list == NULL ? -1 : atomic_load_explicit(&list->size, memory_order_acquire);
+    reader_exit();
+    return size;
+}
+
+/**
+ * Counts the rooms and the chats and reactions in all of them, for /metrics
+ */
+void chat_totals(uint64_t *total_rooms, uint64_t *total_chats, uint64_t *total_reactions){
+    pthread_mutex_lock(&room_lock);
+    int count = num_rooms;
+    pthread_mutex_unlock(&room_lock);
+
+    *total_rooms = (uint64_t)count;
+    *total_chats = *total_reactions = 0;
+
+    reader_enter();
+    for(int i = 0; i < count; i++){
+        ChatList *list = rooms[i]->list;
+        if(list != NULL){
+            *total_chats += (uint64_t)atomic_load_explicit(&list->size, memory_order_acquire);
+            *total_reactions += atomic_load_explicit(&list->num_reactions, memory_order_relaxed);
+        }
+    }
+    reader_exit();
+}
+
+/**
+ * Writes the lines of the chats [first, last) of the chunk, rendered as they are written
+ */
+void write_chunk_chats(ChatList *chatList, ChatChunk *chunk, int client_socket, int first, int last, int format, int reactions){
+    char line[BUFFER_SIZE];
+    int prefix_len;
+    for(int id = first; id < last; id++){
+        int len = render_chat_line(chatList, chunk, id, chatList->width, format, line, sizeof(line), &prefix_len);
+        http_write(client_socket, line, len);
+
+        int index = CHAT_INDEX(id);
+        if(reactions == REACTIONS_SUMMARY){
+            write_summary(chatList, chunk, index, client_socket);
+            continue;
+        }
+        for(uint32_t g = 0; g < chunk->num_groups[index]; g++){
+            ReactionGroup *group = &chunk->groups[index][g];
+            for(uint32_t j = 0; j < group->count; j++){
+                len = render_reaction(chatList, group, group->users[j], line, sizeof(line));
+                http_write(client_socket, line, len);
+            }
+        }
+    }
+}
+
+/**
+ * Compresses the text of a full block for compressed /chats responses,
+ * unless the copy from an earlier one is still current. Only reactions
+ * and a wider padding change a full block, so most requests for it reuse
+ * the same compressed bytes. Called with the block locked.
+ *
+ * @return 0 if block->deflated holds the text, -1 if it couldn't be compressed
+ */
+static int deflate_block(TranscriptBlock *block){
+    uint64_t version = atomic_load(&block->version);
+    if(block->deflated.data != NULL && block->deflated_version == version && block->deflated_width == block->width){
+        return 0;
+    }
+
+    Deflated deflated;
+    if(http_deflate(block->text, block->len, &deflated) < 0){
+        return -1;
+    }
+    free(block->deflated.data);
+    block->deflated = deflated;
+    block->deflated_version = version;
+    block->deflated_width = block->width;
+    return 0;
+}
+
+/**
+ * write_chats for the chats [first, last) of a chunk in memory
+ */
+void write_memory_chats(ChatList *chatList, ChatChunk *chunk, int client_socket, int first, int last, int format, int reactions){
+    for(int i = first / TRANSCRIPT_BLOCK; first < last; i++){
+        TranscriptBlock *block = chunk->blocks[i % CHUNK_BLOCKS];
+        int base = i * TRANSCRIPT_BLOCK;
+
+        pthread_mutex_lock(&block->lock);
+        render_block(chatList, chunk, i);
+        int end = last - base < block->num_chats ? last - base : block->num_chats;
+
+        if(format == TIME_LOCAL && reactions == REACTIONS_ALL){
+            repad_block(block, chatList->width);
+
+            if(first == base && end == TRANSCRIPT_BLOCK && http_encoding(client_socket) != ENCODING_IDENTITY &&
+               deflate_block(block) == 0){
+                http_write_deflated(client_socket, &block->deflated);
+            }
+            else{
+                size_t from = block->offset[first - base];
+                size_t to = end < block->num_chats ? block->offset[end] : block->len;
+                http_write(client_socket, block->text + from, to - from);
+            }
+        }
+        else if(format == TIME_LOCAL){
+            //only the chat lines of the transcript, they end where the reaction lines start
+            repad_block(block, chatList->width);
+
+            for(int id = first; id < base + end; id++){
+                int index = CHAT_INDEX(id);
+                size_t from = block->offset[id - base];
+                size_t to = id - base + 1 < block->num_chats ? block->offset[id - base + 1] : block->len;
+                http_write(client_socket, block->text + from, to - from - reaction_text_len(chatList, chunk, index, 0));
+                write_summary(chatList, chunk, index, client_socket);
+            }
+        }
+        else{
+            write_chunk_chats(chatList, chunk, client_socket, first, base + end, format, reactions);
+        }
+
+        pthread_mutex_unlock(&block->lock);
+        first = base + end;
+    }
+}
+
+/**
+ * Writes the lines of the chats [first, last) of the list
+ *
+ * Called between reader_enter and reader_exit, with last at most the size
+ * the list had. Chats evicted before or while they are written are read
+ * back from the archive a chunk at a time, the ones it doesn't have are
+ * left out. TIME_LOCAL lines come from
+ * the transcript, blocks that fell behind on the width are re-padded first,
+ * full ones go out precompressed when the response is compressed.
+ * Other formats are rendered from the chats as they are written. With
+ * REACTIONS_SUMMARY each chat's line is followed by the counts of its
+ * reactions instead of their lines.
+ */
+void write_chats(ChatList *chatList, int client_socket, int first, int last, int format, int reactions){
+    int memory = atomic_load_explicit(&chatList->first, memory_order_acquire);
+    if(chatList->archive == NULL && first < memory){
+        first = memory;
+    }
+    while(first < last){
+        int stop = (first & ~(CHUNK_CHATS - 1)) + CHUNK_CHATS;
+        stop = stop < last ? stop : last;
+
+        ChatChunk *chunk = reader_chunk(chatList, first);
+        if(chunk != NULL){
+            write_memory_chats(chatList, chunk, client_socket, first, stop, format, reactions);
+        }
+        else{
+            //evicted before or while the page is written
+            chunk = chatList->archive == NULL ? NULL : archive_load(chatList->archive, chatList, first >> CHUNK_SHIFT);
+            if(chunk != NULL){
+                write_chunk_chats(chatList, chunk, client_socket, first, stop, format, reactions);
+                archive_free_chunk(chunk);
+            }
+        }
+        first = stop;
+    }
+}
+
+
+/**
+ * Writes chat id of the chunk as a JSON object, see write_chats_json
+ */
+void write_chat_json(ChatList *chatList, ChatChunk *chunk, JsonWriter *json, int id, int format, int reactions, int lines){
+    int index = CHAT_INDEX(id);
+    uint32_t user = chunk->user[index];
+
+    json_raw(json, "{\"id\":", 6);
+    json_int(json, id + 1);
+
+    char timestamp[64];
+    int time_len = format_time(chunk->time[index], format, timestamp, sizeof(timestamp));
+    json_raw(json, ",\"time\":", 8);
+    if(format == TIME_EPOCH){
+        json_raw(json, timestamp, time_len);
+    }
+    else{
+        json_string(json, timestamp, time_len);
+    }
+
+    json_raw(json, ",\"user\":", 8);
+    json_string(json, USER_NAME(&chatList->users, user), USER_LEN(&chatList->users, user));
+    json_raw(json, ",\"message\":", 11);
+    json_string(json, chunk->message[index], chunk->message_len[index]);
+
+    json_raw(json, ",\"reactions\":[", 14);
+    int written = 0;
+    for(uint32_t g = 0; g < chunk->num_groups[index]; g++){
+        ReactionGroup *group = &chunk->groups[index][g];
+        const char *token = USER_NAME(&chatList->tokens, group->token);
+        int token_len = USER_LEN(&chatList->tokens, group->token);
+
+        if(reactions == REACTIONS_SUMMARY){
+            json_raw(json, written == 0 ? "{\"message\":" : ",{\"message\":", written == 0 ? 11 : 12);
+            written++;
+            json_string(json, token, token_len);
+            json_raw(json, ",\"count\":", 9);
+            json_int(json, group->count);
+            json_raw(json, "}", 1);
+            continue;
+        }
+        for(uint32_t j = 0; j < group->count; j++){
+            uint32_t ruser = group->users[j];
+            json_raw(json, written == 0 ? "{\"user\":" : ",{\"user\":", written == 0 ? 8 : 9);
+            written++;
+            json_string(json, USER_NAME(&chatList->users, ruser), USER_LEN(&chatList->users, ruser));
+            json_raw(json, ",\"message\":", 11);
+            json_string(json, token, token_len);
+            json_raw(json, "}", 1);
+        }
+    }
+    json_raw(json, lines ? "]}\n" : "]}", lines ? 3 : 2);
+}
+/**
+ * write_chats for JSON output, each chat as
+ *
+ * {"id":N,"time":...,"user":"...","message":"...","reactions":[{"user":"...","message":"..."},...]}
+ *
+ * or with REACTIONS_SUMMARY as
+ *
+ * {"id":N,...,"reactions":[{"message":"...","count":N},...]}
+ *
+ * time is a string for TIME_LOCAL and a number for TIME_EPOCH. The chats
+ * are separated by commas, or each ends its own line if lines is set
+ * (NDJSON). The caller writes whatever goes around them.
+ */
+void write_chats_json(ChatList *chatList, JsonWriter *json, int first, int last, int format, int reactions, int lines){
+    int written = 0;
+
+    int memory = atomic_load_explicit(&chatList->first, memory_order_acquire);
+    if(chatList->archive == NULL && first < memory){
+        first = memory;
+    }
+    while(first < last){
+        int stop = (first & ~(CHUNK_CHATS - 1)) + CHUNK_CHATS;
+        stop = stop < last ? stop : last;
+
+        //evicted before or while the page is written
+        ChatChunk *chunk = reader_chunk(chatList, first);
+        if(chunk == NULL){
+            chunk = chatList->archive == NULL ? NULL : archive_load(chatList->archive, chatList, first >> CHUNK_SHIFT);
+            for(int id = first; chunk != NULL && id < stop; id++){
+                if(written++ > 0 && !lines){
+                    json_raw(json, ",", 1);
+                }
+                write_chat_json(chatList, chunk, json, id, format, reactions, lines);
+            }
+            if(chunk != NULL){
+                archive_free_chunk(chunk);
+            }
+            first = stop;
+            continue;
+        }
+
+        for(int i = first / TRANSCRIPT_BLOCK; first < stop; i++){
+            TranscriptBlock *block = chunk->blocks[i % CHUNK_BLOCKS];
+            int base = i * TRANSCRIPT_BLOCK;
+
+            //the block's lock guards the reactions, rendering checks a snapshot block before it is used
+            pthread_mutex_lock(&block->lock);
+            render_block(chatList, chunk, i);
+            int end = stop - base < block->num_chats ? stop - base : block->num_chats;
+
+            for(int id = first; id < base + end; id++){
+                if(written++ > 0 && !lines){
+                    json_raw(json, ",", 1);
+                }
+                write_chat_json(chatList, chunk, json, id, format, reactions, lines);
+            }
+
+            pthread_mutex_unlock(&block->lock);
+            first = base + end;
+        }
+        first = stop;
+    }
+}
+
+/**
+ * Frees a list and everything in it
+ */
+void free_list(ChatList *chatList){
+    // Free the chunks in memory and the evicted ones, each with its reactions, messages and transcript
+    for (int i = chatList->first >> CHUNK_SHIFT; i < chatList->num_chunks; i++) {
+        free_chunk(chatList->chunks[i % MAX_CHUNKS]);
+    }
+    free_chunks(reclaim_retired(chatList, 1));
+
+    // Free the usernames and the reaction tokens
+    free_arena(&chatList->arena);
+    free_users(&chatList->users);
+    free_users(&chatList->tokens);
+    pthread_mutex_destroy(&chatList->names_lock);
+    archive_close(chatList->archive);
+
+    // Unmap the snapshot the chats were loaded from once no room points into it anymore
+    if (chatList->mapping != NULL && atomic_fetch_sub(&chatList->mapping->refs, 1) == 1) {
+        munmap(chatList->mapping->data, chatList->mapping->len);
+        free(chatList->mapping);
+    }
+
+    // Free the chatList structure itself
+    free(chatList);
+}
+
+/**
+ * Frees the lists /reset took out that no reader is in anymore
+ *
+ * Cheap when there are none, and a thread that finds another one at it
+ * leaves the lists to it rather than waiting.
+ */
+static void free_reset_lists(){
+    if(atomic_load_explicit(&num_reset_lists, memory_order_relaxed) == 0 || pthread_mutex_trylock(&reset_lock) != 0){
+        return;
+    }
+
+    ChatList *done = NULL;
+    ChatList **link = &reset_lists;
+    while(*link != NULL){
+        ChatList *list = *link;
+        if(readers_done(list->reset_epoch)){
+            *link = list->next_reset;
+            list->next_reset = done;
+            done = list;
+            atomic_fetch_sub(&num_reset_lists, 1);
+        }
+        else{
+            link = &list->next_reset;
+        }
+    }
+    pthread_mutex_unlock(&reset_lock);
+
+    while(done != NULL){
+        ChatList *next = done->next_reset;
+        free_list(done);
+        done = next;
+    }
+}
+
+/**
+ * Removes every chat of the room, their memory is freed once the readers
+ * that may still be in them are done
+ */
+void reset_chats(Room* room){
+    //a snapshot being written reads the chats without the room's lock
+    pause_snapshots();
+    pthread_rwlock_wrlock(&room->lock);
+
+    // Take the list out of the room, new posts start a new one with a new archive
+    ChatList *chatList = atomic_exchange(&room->list, NULL);
+    room->chat_id = 0;
+    if (chatList != NULL) {
+        archive_remove(chatList->archive);
+    }
+    bump_version(room, NULL);
+
+    log_reset(room->name);
+    http_publish(room->events, "reset", "", 0);
+
+    pthread_rwlock_unlock(&room->lock);
+    resume_snapshots();
+
+    // Readers from before the new epoch may still be in it, it's freed once they left
+    if (chatList != NULL) {
+        chatList->reset_epoch = next_reader_epoch();
+        pthread_mutex_lock(&reset_lock);
+        chatList->next_reset = reset_lists;
+        reset_lists = chatList;
+        atomic_fetch_add(&num_reset_lists, 1);
+        pthread_mutex_unlock(&reset_lock);
+    }
+    free_reset_lists();
+}
@@ -0,0 +1,302 @@
+#ifndef CHAT_STORE_H
+#define CHAT_STORE_H
+
+#include "http-server.h"
+#include "json-writer.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * Objects:
+ *
+ * ReactionGroup   -- the users that reacted to a chat with the same reaction
+ * Arena           -- append-only storage for message and username bytes
+ * ChatChunk       -- the fields of CHUNK_CHATS consecutive chats, column by column
+ * UserTable       -- interned usernames
+ * TranscriptBlock -- rendered /chats output
+ * Mapping         -- a mapped snapshot the chats were loaded from
+ * ChatList
+ * Room            -- a ChatList with its own ids, lock and events
+ */
+/**
+ * A chat's reactions are grouped by what they say. Reaction texts are
+ * interned like usernames, and a group keeps how many users reacted with
+ * it and which, in the order they did, as indexes into the UserTable. A
+ * user is only counted once per group. Groups with more than
+ * REACTION_SET_MIN users also keep a hash set of them, slots of index + 1
+ * and 0 for an empty one, so checking for a repeat doesn't scan them all.
+ */
+#define REACTION_SET_MIN 16
+
+struct ReactionGroup {
+    uint32_t token;             //index into the list's reaction tokens
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t num_slots;         //0 while there is no set
+    uint32_t *users;
+    uint32_t *slots;
+};
+typedef struct ReactionGroup ReactionGroup;
+
+/**
+ * Append-only byte storage, a list of blocks that are only freed all at
+ * once. Strings copied in keep their address for good. Blocks are
+ * block_size bytes, ARENA_BLOCK while it is 0.
+ */
+#define ARENA_BLOCK (256 * 1024)
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    char data[];
+};
+typedef struct ArenaBlock ArenaBlock;
+
+struct Arena {
+    ArenaBlock *blocks;         //the first one is being filled
+    size_t block_size;
+};
+typedef struct Arena Arena;
+
+/**
+ * Chats are stored column-wise, CHUNK_CHATS to a chunk. The fields read for
+ * every chat sit in their own packed arrays, and the bytes of the messages
+ * live in the chunk's own arena. Chunks are never moved once allocated, so
+ * /chats can read them while chats are being added.
+ *
+ * A room keeps at most MAX_CHUNKS chunks in memory, in a ring indexed by
+ * chunk number. Older chunks are evicted whole, see the retention policy in
+ * chat-store.c, and their chats can still be read from the room's archive.
+ *
+ * Chat #N has id N-1, ids keep counting up across evictions and the id is
+ * not stored.
+ */
+#define MAX_CHATS 100000        //per room in memory, the most retain_chats can be
+
+#define CHUNK_SHIFT 10
+#define CHUNK_CHATS (1 << CHUNK_SHIFT)
+#define MAX_CHUNKS ((MAX_CHATS + CHUNK_CHATS - 1) / CHUNK_CHATS + 1)
+
+#define TRANSCRIPT_BLOCK 128    //chats to a TranscriptBlock
+#define CHUNK_BLOCKS (CHUNK_CHATS / TRANSCRIPT_BLOCK)
+
+struct ChatChunk {
+    //read for every chat
+    int64_t time[CHUNK_CHATS];              //microseconds since the epoch
+    uint32_t user[CHUNK_CHATS];             //index into the UserTable
+    uint32_t num_groups[CHUNK_CHATS];
+    const char *message[CHUNK_CHATS];       //NUL-terminated, in messages or a snapshot
+    uint16_t message_len[CHUNK_CHATS];
+
+    //guarded by the lock of the chat's transcript block
+    uint32_t group_capacity[CHUNK_CHATS];
+    ReactionGroup *groups[CHUNK_CHATS];
+
+    //the chunk's share of the transcript and the message bytes, freed with it
+    struct TranscriptBlock *blocks[CHUNK_BLOCKS];
+    Arena messages;
+    uint64_t bytes;                         //message bytes of its chats, for retention
+
+    _Atomic int pins;                       //snapshots and archive_spill writing the chunk, it isn't freed while they do
+    struct ChatChunk *retired;              //next evicted chunk that is waiting to be freed
+    uint64_t retired_epoch;                 //reader epoch it was evicted at, see readers_done()
+    struct ChatChunk *spill;                //next evicted chunk that is waiting to be archived
+    uint64_t number;                        //its first chat has id number * CHUNK_CHATS
+};
+typedef struct ChatChunk ChatChunk;
+
+/**
+ * Every distinct username is stored once, chats refer to it by index.
+ * Names are kept USER_CHUNK to a chunk that never moves, like the chats.
+ * slots is an open addressing table of index + 1, 0 for an empty slot,
+ * only used by the writer. Reaction texts are kept in a table of their own.
+ */
+#define MAX_USERS (4 * MAX_CHATS)      //per room, users that posted or reacted
+#define USER_CHUNK 1024
+#define MAX_USER_CHUNKS ((MAX_USERS + USER_CHUNK - 1) / USER_CHUNK)
+
+struct UserChunk {
+    const char *name[USER_CHUNK];   //NUL-terminated, in the arena
+    uint8_t len[USER_CHUNK];
+};
+typedef struct UserChunk UserChunk;
+
+struct UserTable {
+    uint32_t count;
+    UserChunk *chunks[MAX_USER_CHUNKS];
+
+    uint32_t num_slots;         //a power of two, at least twice count
+    uint32_t *slots;
+};
+typedef struct UserTable UserTable;
+
+//name and length of user i
+#define USER_NAME(users, i) ((users)->chunks[(i) / USER_CHUNK]->name[(i) % USER_CHUNK])
+#define USER_LEN(users, i) ((users)->chunks[(i) / USER_CHUNK]->len[(i) % USER_CHUNK])
+
+/**
+ * Rendered text of TRANSCRIPT_BLOCK consecutive chats and their reactions
+ *
+ * Chat lines are padded to the longest username. width is the width the
+ * text was padded to, a block behind the list's width gets re-padded the
+ * next time it is read. Blocks belong to the chunk of their chats.
+ */
+struct TranscriptBlock {
+    pthread_mutex_t lock;       //guards the text and the reactions of the block's chats
+    _Atomic uint64_t version;   //room version of the last chat or reaction added to it
+    int width;
+    int num_chats;
+    int unrendered;             //chats loaded from a snapshot, rendered when the block is first used
+    uint32_t snapshot_crc;      //of the unrendered chats' messages in the snapshot
+    int snapshot_checked;       //the messages were checked against snapshot_crc, see verify_snapshot_block
+    uint32_t offset[TRANSCRIPT_BLOCK];      //start of each chat's lines in text
+    uint16_t prefix_len[TRANSCRIPT_BLOCK];  //length of "[#N timestamp] ", the padding goes after it
+    char *text;
+    size_t len;
+    size_t capacity;
+
+    //text of a full block compressed, kept while version and width still match
+    Deflated deflated;
+    uint64_t deflated_version;
+    int deflated_width;
+};
+typedef struct TranscriptBlock TranscriptBlock;
+
+/**
+ * A snapshot mapped at startup, shared by every room loaded from it and
+ * unmapped when the last of them is reset
+ */
+struct Mapping {
+    void *data;
+    size_t len;
+    _Atomic int refs;
+};
+typedef struct Mapping Mapping;
+
+/**
+ * Chats up to size are complete and never change, except for their
+ * reactions, so readers only need size to know what they can read. The
+ * writer fills in a chat, then publishes it by raising size. Chats before
+ * first were evicted, readers find them in the archive.
+ */
+struct ChatList{
+    _Atomic int size;
+    _Atomic int first;          //oldest chat in memory, a multiple of CHUNK_CHATS
+    int num_chunks;             //chunks ever added, the newest ones are in the ring
+    ChatChunk *chunks[MAX_CHUNKS];
+    ChatChunk *retired;         //evicted chunks that readers or a snapshot may still be in
+    ChatChunk *spills;          //evicted chunks the post that evicted them archives, see unlock_chats()
+    uint64_t bytes;             //message bytes of the chats in memory
+
+    Arena arena;                //usernames and reaction tokens
+    UserTable users;
+    UserTable tokens;           //what reactions say
+    pthread_mutex_t names_lock; //interning by reactions, which only hold the room's lock shared
+
+    //snapshot the chats were loaded from, messages point into it
+    Mapping *mapping;
+
+    //where evicted chunks go, NULL if they are dropped, see chat-archive.c
+    struct Archive *archive;
+
+    _Atomic uint64_t num_reactions;     //users counted in every group, for /metrics
+    uint64_t created;                   //room version the list was started at
+
+    _Atomic int width;          //longest username so far
+    int num_blocks;             //transcript blocks ever added
+
+    //once /reset took it out of its room, see free_reset_lists()
+    struct ChatList *next_reset;
+    uint64_t reset_epoch;       //reader epoch it was taken out at
+};
+typedef struct ChatList ChatList;
+
+//the chunk and the index in it of chat id, and transcript block i
+#define CHAT_CHUNK(list, id) ((list)->chunks[((id) >> CHUNK_SHIFT) % MAX_CHUNKS])
+#define CHAT_INDEX(id) ((id) & (CHUNK_CHATS - 1))
+#define CHAT_BLOCK(list, i) (CHAT_CHUNK(list, (i) * TRANSCRIPT_BLOCK)->blocks[(i) % CHUNK_BLOCKS])
+
+
+/**
+ * Every room has its own chats, chat ids, lock and event channel, so
+ * traffic in one room never waits on another. Rooms are created by their
+ * first post or subscription and live as long as the server, /reset only
+ * empties one. See chat-store.c for the locking.
+ */
+#define ROOM_NAME 32            //longest room name + 1
+#define MAX_ROOMS 1024
+#define DEFAULT_ROOM "main"     //the room of requests without room=
+
+struct Room {
+    char name[ROOM_NAME];
+    pthread_rwlock_t lock;      //taken by writers only, see chat-store.c
+    ChatList *_Atomic list;     //NULL until the first chat
+    int chat_id;                //same number as the list's size but keeps the concepts separate
+    Channel *events;            //new chats, reactions and resets are pushed to /subscribe connections through it
+    _Atomic uint64_t version;   //bumped after every chat, reaction and reset, see chats_version()
+};
+typedef struct Room Room;
+
+/**
+ * Shared chat state
+ */
+extern Room *rooms[MAX_ROOMS];
+extern int num_rooms;
+extern pthread_mutex_t room_lock;
+
+#define EVENT_HISTORY 4096
+
+/**
+ * Retention, how many chats a room keeps in memory, set with -k, -a and -m.
+ * 0 turns the age and the bytes limit off.
+ */
+extern int retain_chats;            //at most MAX_CHATS
+extern int retain_age;              //seconds
+extern uint64_t retain_bytes;       //message bytes
+
+//how chat times are written, see format_time()
+#define TIME_LOCAL 0    //"YYYY-MM-DD HH:MM:SS"
+#define TIME_EPOCH 1    //"<seconds>.<microseconds>"
+
+//how reactions are written, picked with reactions=
+#define REACTIONS_ALL 0         //a line or object for every user that reacted
+#define REACTIONS_SUMMARY 1     //a count for every reaction, "(👍 x42)"
+
+//results of add_reaction
+#define REACTION_NO_CHAT 0
+#define REACTION_ADDED 1
+#define REACTION_REPEATED 2     //the user already reacted to the chat with it
+#define REACTION_ARCHIVED 3     //the chat was evicted, archived chats don't change
+
+void init_reaction_pool();
+
+//threads that can read chats, a reader_slot each, see reader_enter()
+#define MAX_READERS 256
+
+void reader_enter();
+void reader_exit();
+
+//used by chat-snapshot.c to rebuild the list
+ChatList *new_list();
+TranscriptBlock *new_block();
+int reserve_chat(ChatList *list, int id);
+int64_t intern_user(UserTable *users, Arena *arena, const char *name);
+int grow_groups(ChatChunk *chunk, int index);
+int add_group_user(ReactionGroup *group, uint32_t user);
+void free_arena(Arena *arena);
+
+Room *get_room(const char *name, int create);
+
+int add_chat(Room *room, char *username, char *message);
+int add_chat_at(Room *room, char *username, char *message, int64_t time);
+uint8_t add_reaction(Room *room, char *username, char *message, int id);
+int chat_count(Room *room);
+uint64_t chats_version(Room *room, ChatList *list, int first, int last);
+void chat_totals(uint64_t *total_rooms, uint64_t *total_chats, uint64_t *total_reactions);
+void write_chats(ChatList *list, int client_socket, int first, int last, int format, int reactions);
+void write_chats_json(ChatList *list, JsonWriter *json, int first, int last, int format, int reactions, int lines);
+void reset_chats(Room *room);
+
+#endif
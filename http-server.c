@@ -1,66 +1,1950 @@
-
 #include "http-server.h"
+#include "metrics.h"
+#include "url-decode.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+
+/**
+ * Connection state machine
+ *
+ * CONN_READING -- waiting for the next request to arrive
+ * CONN_WRITING -- waiting for the socket to take the queued output, requests
+ *                 that are already buffered are answered once it drained
+ * CONN_STREAMING -- subscribed to a channel, events are pushed as they are
+ *                   published until the client goes away
+ * CONN_HOLDING -- the response is ready but held back until http_release
+ *                 passes its ticket, nothing else is read or sent meanwhile
+ *
+ * Every socket is non-blocking, so a slow client only ever parks its own
+ * connection and never the event loop. Connections are persistent: a request
+ * is answered with a Content-Length framed body and the connection goes back
+ * to reading, unless the client asked for Connection: close or speaks HTTP/1.0.
+ */
+enum ConnState {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_STREAMING,
+    CONN_HOLDING
+};
+
+/**
+ * One worker per thread, each with its own SO_REUSEPORT listener and epoll
+ * instance. The kernel spreads new connections across the listeners and a
+ * connection stays on the worker that accepted it.
+ */
+struct Worker {
+    int server_sock;
+    int epoll_fd;
+    int event_fd;                       //other threads poke it when a channel got new events
+                                        //or held responses were released
+    void (*handler)(HttpRequest*, int);
+    pthread_t thread;
+
+    struct Connection *subscribers;     //streaming connections of this worker
+    atomic_int num_subscribers;
+
+    struct Connection *held;            //holding connections of this worker
+    atomic_int num_held;
+
+    char *free_inputs;                  //pooled request buffers, linked through their first bytes
+    int num_free_inputs;
+
+    z_stream deflate;                   //compresses the response being built, see http_set_encoding
+    int deflate_ready;
+    int deflate_pending;                //input went in since the stream was last started over
+};
+typedef struct Worker Worker;
+
+/**
+ * Server-sent event, formatted once and shared by every subscriber
+ */
+struct Event {
+    atomic_int refs;
+    size_t len;
+    char data[];
+};
+typedef struct Event Event;
+
+/**
+ * Broadcast channel for text/event-stream subscribers
+ *
+ * Keeps the last capacity events in a ring, so subscribers that fall a bit
+ * behind, or reconnect with Last-Event-ID, catch up from it. Events are
+ * numbered from 1, event seq lives at ring[seq % capacity].
+ */
+struct Channel {
+    pthread_mutex_t lock;
+    uint64_t next_seq;
+    size_t capacity;
+    Event **ring;
+};
+
+/**
+ * Growable byte buffer, kept across requests so a connection stops
+ * allocating once it has seen its largest response
+ */
+struct Buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+typedef struct Buffer Buffer;
+
+struct Connection {
+    int fd;
+    uint32_t addr;          //client's IPv4 address, for its token bucket
+    Worker *worker;
+    enum ConnState state;
+    uint32_t watching;      //epoll events the connection is registered for
+    int broken;             //set when the peer went away or memory ran out
+    int peer_closed;        //the client won't send anything else
+    int close_after;        //close once the queued output is sent
+    HttpRequest *request;   //the one being handled, NULL between requests
+
+    Buffer in;              //received bytes, may hold several pipelined requests
+    size_t in_scanned;      //bytes of in already searched for the end of the head
+    size_t head_len;        //head of the first request in in once it's charged and parsed, 0 before
+    size_t request_len;     //that head and its body
+
+    //response that is being built, sent in one go when the handler returns
+    int response_started;
+    Buffer head;
+    Buffer body;
+    int encoding;           //ENCODING_ the body is written in
+    uint32_t check;         //crc32 for gzip, adler32 for deflate, of the bytes before compression
+    size_t raw_len;
+
+    Buffer out;             //output the kernel did not accept yet
+    size_t out_sent;
+
+    //subscription, for CONN_STREAMING
+    Channel *channel;
+    uint64_t next_seq;      //next event this subscriber gets
+    struct Connection *prev_subscriber;
+    struct Connection *next_subscriber;
+
+    //held response, for CONN_HOLDING
+    uint64_t hold;          //ticket the response waits for, 0 if it isn't held
+    struct Connection *prev_held;
+    struct Connection *next_held;
+};
+typedef struct Connection Connection;
+
+#define MAX_EVENTS 256
+#define EVENT_BATCH 64
+#define BUFFER_RETAIN_LIMIT (64 * 1024)
+#define INPUT_BUFFER_SIZE 4096
+#define MAX_POOLED_INPUTS 256
+
+char const HTTP_400_BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
+char const HTTP_413_TOO_LARGE[] = "HTTP/1.1 413 Content Too Large\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
+char const HTTP_431_TOO_LARGE[] = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
+char const HTTP_429_TOO_MANY[] = "HTTP/1.1 429 Too Many Requests\r\nContent-Type: text/plain\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+char const HTTP_503_UNAVAILABLE[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/plain\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+
+//indexed by file descriptor, a slot is only touched by the worker owning the connection
+static Connection **connections = NULL;
+static int max_fds = 0;
+
+static Worker *workers = NULL;
+static int num_workers = 0;
+
+//responses held for a ticket up to this one can be sent
+static _Atomic uint64_t released = 0;
+
+//largest request head and body that are accepted, see http_set_limits
+static size_t max_head_size = MAX_HEAD_SIZE;
+static size_t max_body_size = MAX_BODY_SIZE;
+
+//admission control, see http_set_admission
+static uint64_t rate_interval = 0;      //nanoseconds a client's bucket takes to refill a token, 0 for no limit
+static uint64_t rate_burst = 0;         //tokens a bucket holds
+static int max_connections = 0;         //0 for no limit
+static int listen_backlog = LISTEN_BACKLOG;
+static _Atomic int num_connections = 0;
+
+
+static int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0){
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void unsubscribe(Connection *conn);
+static void unhold(Connection *conn);
+static void release_input(Connection *conn);
+
+static void close_connection(Connection *conn){
+    unsubscribe(conn);
+    unhold(conn);
+    connections[conn->fd] = NULL;
+    close(conn->fd);
+    atomic_fetch_sub(&num_connections, 1);
+    conn->in.len = 0;
+    release_input(conn);
+    free(conn->head.data);
+    free(conn->body.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+static void watch_connection(Connection *conn, uint32_t events){
+    if(conn->watching == events){
+        return;
+    }
+
+    struct epoll_event ev = {.events = events, .data.fd = conn->fd};
+    epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->watching = events;
+}
+
+static Connection *find_connection(int client_socket){
+    if(client_socket < 0 || client_socket >= max_fds){
+        return NULL;
+    }
+    return connections[client_socket];
+}
+
+
+/**
+ * Writes as much of the buffers as the socket takes right now
+ *
+ * The iovecs are advanced past whatever went out, so afterwards they
+ * describe exactly the bytes that are left.
+ *
+ * @return number of bytes written, -1 if the connection is gone
+ */
+static ssize_t write_some(int fd, struct iovec *iov, int iov_count){
+    size_t sent = 0;
+    int first = 0;
+
+    while(1){
+        while(first < iov_count && iov[first].iov_len == 0){
+            first++;
+        }
+        if(first == iov_count){
+            break;
+        }
+
+        struct msghdr msg = {.msg_iov = iov + first, .msg_iovlen = iov_count - first};
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            break;
+        }
+        if(n <= 0){
+            return -1;
+        }
+        sent += n;
+        metrics_bytes((size_t)n);
+
+        for(int i = first; i < iov_count && n > 0; i++){
+            size_t skip = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+            iov[i].iov_base = (char*)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            n -= skip;
+        }
+    }
+    return sent;
+}
+
+/**
+ * Makes room for len more bytes, growing the buffer by doubling
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static int buffer_reserve(Buffer *buffer, size_t len){
+    if(buffer->len + len > buffer->capacity){
+        size_t capacity = buffer->capacity ? buffer->capacity : BUFFER_SIZE;
+        while(capacity < buffer->len + len){
+            capacity *= 2;
+        }
+
+        char *grown = realloc(buffer->data, capacity);
+        if(grown == NULL){
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    return 0;
+}
+
+/**
+ * Appends to the buffer
+ *
+ * @return 0 on success, -1 if memory ran out
+ */
+static int buffer_append(Buffer *buffer, const void *data, size_t len){
+    if(buffer_reserve(buffer, len) < 0){
+        return -1;
+    }
+
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+/**
+ * Drops the storage of an empty buffer that grew past BUFFER_RETAIN_LIMIT,
+ * so idle connections don't pin the memory of their largest response
+ */
+static void buffer_trim(Buffer *buffer){
+    if(buffer->len == 0 && buffer->capacity > BUFFER_RETAIN_LIMIT){
+        free(buffer->data);
+        buffer->data = NULL;
+        buffer->capacity = 0;
+    }
+}
+
+static int output_pending(Connection *conn){
+    return conn->out_sent != conn->out.len;
+}
+
+/**
+ * Sends the buffers in order: straight to the socket while nothing is
+ * queued, whatever the socket can't take right now is queued behind it
+ * and flushed on EPOLLOUT. A held response is queued as a whole.
+ */
+static void send_output(Connection *conn, struct iovec *iov, int iov_count){
+    if(conn->broken){
+        return;
+    }
+
+    if(!output_pending(conn) && conn->hold == 0){
+        conn->out.len = conn->out_sent = 0;
+
+        if(write_some(conn->fd, iov, iov_count) < 0){
+            conn->broken = 1;
+            return;
+        }
+    }
+
+    for(int i = 0; i < iov_count; i++){
+        if(iov[i].iov_len > 0 && buffer_append(&conn->out, iov[i].iov_base, iov[i].iov_len) < 0){
+            conn->broken = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * Request buffers
+ *
+ * A connection only has an input buffer while part of a request is waiting
+ * in it, idle keep-alive connections hold none. Buffers start at
+ * INPUT_BUFFER_SIZE and come from a free list of the worker, so most
+ * requests are read without touching malloc. One that grew for a large
+ * request is freed instead of pooled.
+ */
+
+static int acquire_input(Connection *conn){
+    if(conn->in.data != NULL){
+        return 0;
+    }
+
+    Worker *worker = conn->worker;
+    if(worker->free_inputs != NULL){
+        conn->in.data = worker->free_inputs;
+        memcpy(&worker->free_inputs, conn->in.data, sizeof(char*));
+        worker->num_free_inputs--;
+    }
+    else if((conn->in.data = malloc(INPUT_BUFFER_SIZE)) == NULL){
+        return -1;
+    }
+    conn->in.capacity = INPUT_BUFFER_SIZE;
+    return 0;
+}
+
+/**
+ * Gives an empty input buffer back to the worker
+ */
+static void release_input(Connection *conn){
+    if(conn->in.data == NULL || conn->in.len > 0){
+        return;
+    }
+
+    Worker *worker = conn->worker;
+    if(conn->in.capacity == INPUT_BUFFER_SIZE && worker->num_free_inputs < MAX_POOLED_INPUTS){
+        memcpy(conn->in.data, &worker->free_inputs, sizeof(char*));
+        worker->free_inputs = conn->in.data;
+        worker->num_free_inputs++;
+    }
+    else{
+        free(conn->in.data);
+    }
+    conn->in.data = NULL;
+    conn->in.capacity = 0;
+    conn->in_scanned = 0;
+}
+
+/**
+ * Makes room for more input, doubling the buffer up to what the largest
+ * request can take, one byte is kept for the NUL after the received bytes
+ *
+ * @return bytes that can be received, 0 if the buffer is as full as it
+ *         gets, -1 if it has to grow and memory ran out
+ */
+static ssize_t input_room(Connection *conn){
+    size_t limit = max_head_size + max_body_size + 1;
+    if(conn->in.len + 1 >= conn->in.capacity && conn->in.capacity < limit){
+        size_t capacity = conn->in.capacity * 2 < limit ? conn->in.capacity * 2 : limit;
+        char *grown = realloc(conn->in.data, capacity);
+        if(grown == NULL){
+            return -1;
+        }
+        conn->in.data = grown;
+        conn->in.capacity = capacity;
+    }
+    return (ssize_t)(conn->in.capacity - 1 - conn->in.len);
+}
+
+/**
+ * Sets the largest request head and body the server accepts, larger ones
+ * are answered with 431 and 413. Call it before start_server.
+ */
+void http_set_limits(size_t max_head, size_t max_body){
+    max_head_size = max_head;
+    max_body_size = max_body;
+}
+
+
+/**
+ * Counts a response by the status code in its status line
+ */
+static void count_status(const char *status){
+    if(strncmp(status, "HTTP/1.", 7) == 0 && strlen(status) >= 12){
+        metrics_response(atoi(status + 9));
+    }
+}
+
+static void send_string(Connection *conn, const char *str){
+    count_status(str);
+    struct iovec iov = {.iov_base = (void*)str, .iov_len = strlen(str)};
+    send_output(conn, &iov, 1);
+}
+
+
+/**
+ * Admission control
+ *
+ * Every client address has a token bucket that holds rate_burst tokens
+ * and refills one every rate_interval. A request takes a token before its
+ * head is even parsed, a client that has none left gets a 429 and its
+ * connection is closed. A new connection from such a client is answered
+ * the same way as soon as it is accepted, without being read from.
+ *
+ * A bucket only stores when it will be full again, the tokens follow from
+ * how far away that is, so it refills lazily whenever it is looked at and
+ * no timer is needed. The buckets sit in a fixed table, an address hashes
+ * to a group of RATE_WAYS buckets, two cache lines, and is only looked for
+ * there. An address without a bucket takes the group's fullest one, which
+ * is most likely full anyway, so a busy table can forget a client early
+ * but never charges it for someone else's requests.
+ *
+ * Past max_connections open connections new ones get a 503 right away.
+ */
+#define RATE_GROUPS 4096
+#define RATE_WAYS 8
+#define RATE_LOCKS 64
+
+struct RateBucket {
+    uint32_t addr;          //0 for a bucket nobody has
+    uint64_t full_at;       //when the bucket has rate_burst tokens again, in metrics_now() time
+};
+typedef struct RateBucket RateBucket;
+
+static _Alignas(64) RateBucket rate_buckets[RATE_GROUPS][RATE_WAYS];
+static pthread_mutex_t rate_locks[RATE_LOCKS];
+
+/**
+ * Sets the token buckets clients get, rate requests a second with bursts
+ * of up to burst, 0 turns them off. Past max_open connections new ones are
+ * refused, 0 for no limit. backlog is how many connections the kernel
+ * queues until they're accepted. Call it before start_server.
+ */
+void http_set_admission(int rate, int burst, int max_open, int backlog){
+    rate_interval = rate > 0 ? 1000000000ULL / (uint64_t)rate : 0;
+    rate_burst = burst > 0 ? (uint64_t)burst : 1;
+    max_connections = max_open > 0 ? max_open : 0;
+    listen_backlog = backlog > 0 ? backlog : LISTEN_BACKLOG;
+}
+
+/**
+ * Takes a token from the client's bucket, or only checks there is one
+ *
+ * @return 1 if the client has a token, 0 if it is over its rate
+ */
+static int take_token(uint32_t addr, int take){
+    if(rate_interval == 0){
+        return 1;
+    }
+
+    uint32_t group = (addr * 2654435761u) % RATE_GROUPS;
+    RateBucket *buckets = rate_buckets[group];
+    uint64_t now = metrics_now();
+
+    pthread_mutex_lock(&rate_locks[group % RATE_LOCKS]);
+    RateBucket *bucket = &buckets[0];
+    for(int i = 0; i < RATE_WAYS; i++){
+        if(buckets[i].addr == addr){
+            bucket = &buckets[i];
+            break;
+        }
+        if(buckets[i].full_at < bucket->full_at){
+            bucket = &buckets[i];
+        }
+    }
+    if(bucket->addr != addr){
+        bucket->addr = addr;
+        bucket->full_at = 0;
+    }
+
+    //taking a token pushes full_at one interval further, it can't get more than a burst away
+    uint64_t full_at = bucket->full_at > now ? bucket->full_at : now;
+    int allowed = full_at + rate_interval - now <= rate_burst * rate_interval;
+    if(allowed && take){
+        bucket->full_at = full_at + rate_interval;
+    }
+    pthread_mutex_unlock(&rate_locks[group % RATE_LOCKS]);
+    return allowed;
+}
+
+/**
+ * Answers a connection that isn't let in and closes it, the response is
+ * small enough for a fresh socket to take at once
+ */
+static void refuse_connection(int fd, const char *status){
+    count_status(status);
+    struct iovec iov = {.iov_base = (void*)status, .iov_len = strlen(status)};
+    write_some(fd, &iov, 1);
+    close(fd);
+}
+
+
+/**
+ * Starts the response to the request that is being handled
+ *
+ * status holds the status line and header lines, each ending in "\r\n",
+ * without the blank line. The server adds the framing headers itself.
+ */
+void http_begin_response(int client_socket, const char *status){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || !conn->response_started){
+        count_status(status);
+    }
+
+    //not one of ours, close-delimited like before
+    if(conn == NULL){
+        struct iovec iov[2] = {{(void*)status, strlen(status)}, {"\r\n", 2}};
+        write_some(client_socket, iov, 2);
+        return;
+    }
+    if(conn->response_started){
+        return;
+    }
+    conn->response_started = 1;
+
+    conn->head.len = 0;
+    if(buffer_append(&conn->head, status, strlen(status)) < 0){
+        conn->broken = 1;
+    }
+}
+
+
+/**
+ * Adds a header line, given without the trailing "\r\n", to the response
+ * that was started with http_begin_response
+ */
+void http_add_header(int client_socket, const char *header){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || !conn->response_started){
+        return;
+    }
+
+    if(buffer_append(&conn->head, header, strlen(header)) < 0 || buffer_append(&conn->head, "\r\n", 2) < 0){
+        conn->broken = 1;
+    }
+}
+
+
+static void deflate_body(Connection *conn, const void *data, size_t len, int flush);
+
+/**
+ * Adds bytes to the body of the response
+ *
+ * Handlers call this instead of write(), after http_begin_response. Nothing
+ * reaches the socket until the handler returned, then the whole response
+ * goes out with a single writev.
+ */
+void http_write(int client_socket, const void *data, size_t len){
+    Connection *conn = find_connection(client_socket);
+
+    //not one of ours, fall back to a plain write
+    if(conn == NULL){
+        struct iovec iov = {(void*)data, len};
+        write_some(client_socket, &iov, 1);
+        return;
+    }
+
+    if(conn->encoding != ENCODING_IDENTITY){
+        deflate_body(conn, data, len, Z_NO_FLUSH);
+    }
+    else if(buffer_append(&conn->body, data, len) < 0){
+        conn->broken = 1;
+    }
+}
+
+
+/**
+ * Compressed responses
+ *
+ * After http_set_encoding, whatever the handler writes is compressed on
+ * its way into the body by the worker's raw deflate stream, the gzip or
+ * zlib header went in first. A response is built start to end inside
+ * its handler, so one stream per worker is enough.
+ *
+ * Pieces compressed ahead of time by http_deflate are spliced in as they
+ * are. The stream is flushed to a byte boundary before one, and started
+ * over after it so nothing later refers back into it. Their checksums
+ * are combined into the response's, which goes into the trailer that
+ * finish_response adds when it ends the stream.
+ */
+#define DEFLATE_LEVEL 6
+#define DEFLATE_CHUNK 16384
+
+static const char GZIP_HEADER[10] = {0x1f, (char)0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+static const char ZLIB_HEADER[2] = {0x78, (char)0x9c};    //32K window, level 6
+
+/**
+ * Runs the worker's stream over data into the body, flushing as flush says
+ */
+static void deflate_body(Connection *conn, const void *data, size_t len, int flush){
+    z_stream *stream = &conn->worker->deflate;
+    conn->worker->deflate_pending = 1;
+    if(len > 0){
+        //a NULL buffer would give back the initial value instead
+        conn->check = conn->encoding == ENCODING_GZIP ? crc32(conn->check, data, len) : adler32(conn->check, data, len);
+        conn->raw_len += len;
+    }
+
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = (uInt)len;
+    do{
+        if(buffer_reserve(&conn->body, DEFLATE_CHUNK) < 0){
+            conn->broken = 1;
+            return;
+        }
+        stream->next_out = (Bytef*)conn->body.data + conn->body.len;
+        stream->avail_out = DEFLATE_CHUNK;
+        deflate(stream, flush);
+        conn->body.len += DEFLATE_CHUNK - stream->avail_out;
+    } while(stream->avail_out == 0);
+}
+
+static void restart_deflate(Worker *worker){
+    if(worker->deflate_pending){
+        deflateReset(&worker->deflate);
+        worker->deflate_pending = 0;
+    }
+}
+
+/**
+ * Compresses the request's body with the encoding from here on, adding
+ * its Content-Encoding. ENCODING_IDENTITY or a connection that isn't one
+ * of ours leave it as it is. The Vary is the caller's, a plain answer
+ * needs it just the same.
+ */
+void http_set_encoding(int client_socket, int encoding){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || encoding == ENCODING_IDENTITY || conn->encoding != ENCODING_IDENTITY){
+        return;
+    }
+
+    Worker *worker = conn->worker;
+    if(!worker->deflate_ready){
+        if(deflateInit2(&worker->deflate, DEFLATE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+            return;
+        }
+        worker->deflate_ready = 1;
+    }
+    restart_deflate(worker);
+
+    http_add_header(client_socket, encoding == ENCODING_GZIP ? "Content-Encoding: gzip" : "Content-Encoding: deflate");
+    if(encoding == ENCODING_GZIP){
+        http_write(client_socket, GZIP_HEADER, sizeof(GZIP_HEADER));
+    }
+    else{
+        http_write(client_socket, ZLIB_HEADER, sizeof(ZLIB_HEADER));
+    }
+    conn->encoding = encoding;
+    conn->check = encoding == ENCODING_GZIP ? crc32(0, NULL, 0) : adler32(0, NULL, 0);
+    conn->raw_len = 0;
+}
+
+/**
+ * @return the ENCODING_ the response being built is written in
+ */
+int http_encoding(int client_socket){
+    Connection *conn = find_connection(client_socket);
+    return conn == NULL ? ENCODING_IDENTITY : conn->encoding;
+}
+
+/**
+ * Compresses data on its own into a piece http_write_deflated can splice
+ * into any compressed response
+ *
+ * @return 0 on success, -1 if zlib or memory failed
+ */
+int http_deflate(const void *data, size_t len, Deflated *deflated){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, DEFLATE_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        return -1;
+    }
+
+    //a sync flush ends it on a byte boundary without marking the last block
+    size_t capacity = deflateBound(&stream, len) + 16;
+    char *out = malloc(capacity);
+    if(out == NULL){
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = (uInt)capacity;
+    int result = deflate(&stream, Z_SYNC_FLUSH);
+    size_t out_len = capacity - stream.avail_out;
+    deflateEnd(&stream);
+    if(result != Z_OK || stream.avail_in != 0){
+        free(out);
+        return -1;
+    }
+
+    deflated->data = out;
+    deflated->len = out_len;
+    deflated->raw_len = len;
+    deflated->crc = crc32(crc32(0, NULL, 0), data, len);
+    deflated->adler = adler32(adler32(0, NULL, 0), data, len);
+    return 0;
+}
+
+/**
+ * Adds a piece from http_deflate to the compressed response being built
+ */
+void http_write_deflated(int client_socket, const Deflated *deflated){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || conn->encoding == ENCODING_IDENTITY){
+        return;
+    }
+
+    Worker *worker = conn->worker;
+    if(worker->deflate_pending){
+        deflate_body(conn, NULL, 0, Z_SYNC_FLUSH);
+        restart_deflate(worker);
+    }
+    if(buffer_append(&conn->body, deflated->data, deflated->len) < 0){
+        conn->broken = 1;
+    }
+
+    if(conn->encoding == ENCODING_GZIP){
+        conn->check = crc32_combine(conn->check, deflated->crc, deflated->raw_len);
+    }
+    else{
+        conn->check = adler32_combine(conn->check, deflated->adler, deflated->raw_len);
+    }
+    conn->raw_len += deflated->raw_len;
+}
+
+/**
+ * Ends the compressed body with the last block and the trailer
+ */
+static void finish_encoding(Connection *conn){
+    deflate_body(conn, NULL, 0, Z_FINISH);
+    restart_deflate(conn->worker);
+
+    unsigned char trailer[8];
+    size_t trailer_len;
+    if(conn->encoding == ENCODING_GZIP){
+        //crc32 and the length modulo 2^32, little-endian
+        uint32_t len = (uint32_t)conn->raw_len;
+        for(int i = 0; i < 4; i++){
+            trailer[i] = (unsigned char)(conn->check >> (8 * i));
+            trailer[4 + i] = (unsigned char)(len >> (8 * i));
+        }
+        trailer_len = 8;
+    }
+    else{
+        //adler32, big-endian
+        for(int i = 0; i < 4; i++){
+            trailer[i] = (unsigned char)(conn->check >> (24 - 8 * i));
+        }
+        trailer_len = 4;
+    }
+    if(buffer_append(&conn->body, trailer, trailer_len) < 0){
+        conn->broken = 1;
+    }
+    conn->encoding = ENCODING_IDENTITY;
+}
+
+
+/**
+ * Holds the response back until http_release is called with ticket or a
+ * later one
+ *
+ * For responses that may only go out once something else happened, like a
+ * write reaching the disk. The worker keeps serving other connections, this
+ * one stays parked with its response queued. Tickets only ever go up, 0 or
+ * a ticket that was already released doesn't hold anything.
+ */
+void http_hold_response(int client_socket, uint64_t ticket){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || conn->channel != NULL || ticket <= atomic_load(&released)){
+        return;
+    }
+
+    if(conn->hold == 0){
+        Worker *worker = conn->worker;
+        conn->prev_held = NULL;
+        conn->next_held = worker->held;
+        if(worker->held != NULL){
+            worker->held->prev_held = conn;
+        }
+        worker->held = conn;
+        atomic_fetch_add(&worker->num_held, 1);
+    }
+    if(ticket > conn->hold){
+        conn->hold = ticket;
+    }
+}
+
+static void unhold(Connection *conn){
+    if(conn->hold == 0){
+        return;
+    }
+
+    Worker *worker = conn->worker;
+    if(conn->prev_held != NULL){
+        conn->prev_held->next_held = conn->next_held;
+    } else {
+        worker->held = conn->next_held;
+    }
+    if(conn->next_held != NULL){
+        conn->next_held->prev_held = conn->prev_held;
+    }
+
+    atomic_fetch_sub(&worker->num_held, 1);
+    conn->hold = 0;
+}
+
+/**
+ * Lets every response held for a ticket up to this one go out
+ *
+ * Can be called from any thread, the workers holding responses are woken
+ * through their event_fd.
+ */
+void http_release(uint64_t ticket){
+    uint64_t current = atomic_load(&released);
+    while(current < ticket && !atomic_compare_exchange_weak(&released, &current, ticket)){
+    }
+
+    uint64_t one = 1;
+    for(int i = 0; i < num_workers; i++){
+        if(atomic_load(&workers[i].num_held) > 0){
+            ssize_t n = write(workers[i].event_fd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+}
+
+
+/**
+ * Frames and sends the response the handler built
+ *
+ * Answers with a 400 if the handler did not respond. Output written without
+ * a status is sent as is and can only end with the connection.
+ */
+static void finish_response(Connection *conn){
+    //a subscription already sent its head, events follow on their own
+    if(conn->channel != NULL){
+        conn->response_started = 0;
+        conn->encoding = ENCODING_IDENTITY;
+        return;
+    }
+
+    if(!conn->response_started){
+        conn->close_after = 1;
+        if(conn->body.len == 0){
+            send_string(conn, HTTP_400_BAD_REQUEST);
+        }
+        else{
+            struct iovec iov = {conn->body.data, conn->body.len};
+            send_output(conn, &iov, 1);
+        }
+    }
+    else{
+        if(conn->encoding != ENCODING_IDENTITY){
+            finish_encoding(conn);
+        }
+
+        //a 304 has no body, and no length for one either
+        int not_modified = conn->head.len >= 12 && memcmp(conn->head.data + 9, "304", 3) == 0;
+        char framing[64];
+        int framing_len = 0;
+        if(!not_modified){
+            framing_len = snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", conn->body.len);
+        }
+        framing_len += snprintf(framing + framing_len, sizeof(framing) - framing_len, "%s\r\n",
+                                conn->close_after ? "Connection: close\r\n" : "");
+        if(buffer_append(&conn->head, framing, framing_len) < 0){
+            conn->broken = 1;
+        }
+
+        struct iovec iov[2] = {{conn->head.data, conn->head.len}, {conn->body.data, conn->body.len}};
+        send_output(conn, iov, 2);
+    }
+
+    conn->response_started = 0;
+    conn->head.len = 0;
+    conn->body.len = 0;
+    buffer_trim(&conn->body);
+    if(!output_pending(conn)){
+        conn->out.len = conn->out_sent = 0;
+        buffer_trim(&conn->out);
+    }
+}
+
+
+/**
+ * Broadcast channels
+ *
+ * A handler turns its connection into a subscriber with http_subscribe,
+ * anyone calls http_publish. Publishing formats the event once, stores it
+ * in the channel ring and pokes the workers that have subscribers. Each
+ * worker then hands the shared event buffers to its subscribers' sockets
+ * with writev, a subscriber with a full socket just waits for EPOLLOUT.
+ */
+Channel *http_channel_create(size_t capacity){
+    Channel *channel = calloc(1, sizeof(Channel));
+    if(channel == NULL){
+        return NULL;
+    }
+
+    channel->ring = calloc(capacity, sizeof(Event*));
+    if(channel->ring == NULL){
+        free(channel);
+        return NULL;
+    }
+
+    pthread_mutex_init(&channel->lock, NULL);
+    channel->next_seq = 1;
+    channel->capacity = capacity;
+    return channel;
+}
+
+static void release_event(Event *event){
+    if(event != NULL && atomic_fetch_sub(&event->refs, 1) == 1){
+        free(event);
+    }
+}
+
+/**
+ * Publishes an event to every subscriber of the channel
+ *
+ * Every line of data becomes one "data:" line of the event.
+ */
+void http_publish(Channel *channel, const char *name, const char *data, size_t len){
+    //room for "id: <seq>\nevent: <name>\n", a "data: " per line and the blank line
+    size_t lines = 1;
+    for(size_t i = 0; i < len; i++){
+        lines += data[i] == '\n';
+    }
+    size_t capacity = 64 + strlen(name) + len + lines * 7;
+
+    Event *event = malloc(sizeof(Event) + capacity);
+    if(event == NULL){
+        return;
+    }
+    atomic_init(&event->refs, 1);
+
+    pthread_mutex_lock(&channel->lock);
+
+    uint64_t seq = channel->next_seq++;
+    char *at = event->data;
+    at += sprintf(at, "id: %llu\nevent: %s\n", (unsigned long long)seq, name);
+
+    const char *line = data;
+    const char *end = data + len;
+    while(line < end){
+        const char *line_end = memchr(line, '\n', end - line);
+        if(line_end == NULL){
+            line_end = end;
+        }
+        memcpy(at, "data: ", 6);
+        memcpy(at + 6, line, line_end - line);
+        at += 6 + (line_end - line);
+        *at++ = '\n';
+        line = line_end + 1;
+    }
+    if(len == 0){
+        at += sprintf(at, "data: \n");
+    }
+    *at++ = '\n';
+    event->len = at - event->data;
+
+    //the ring owns one reference, the event it replaces loses it
+    Event **slot = &channel->ring[seq % channel->capacity];
+    Event *dropped = *slot;
+    *slot = event;
 
+    pthread_mutex_unlock(&channel->lock);
+    release_event(dropped);
 
-void start_server(void(*handler)(char*, int), int port) {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    
+    uint64_t one = 1;
+    for(int i = 0; i < num_workers; i++){
+        if(atomic_load(&workers[i].num_subscribers) > 0){
+            ssize_t n = write(workers[i].event_fd, &one, sizeof(one));
+            (void)n;
+        }
+    }
+}
+
+/**
+ * Sends the subscriber every event it hasn't seen, as far as its socket takes them
+ *
+ * A subscriber that fell so far behind that the ring no longer has its
+ * next event is disconnected, it reconnects and catches up from /chats.
+ */
+static void deliver_events(Connection *conn){
+    Channel *channel = conn->channel;
+
+    while(!output_pending(conn) && !conn->broken){
+        Event *batch[EVENT_BATCH];
+        int count = 0;
+
+        pthread_mutex_lock(&channel->lock);
+        uint64_t oldest = channel->next_seq > channel->capacity ? channel->next_seq - channel->capacity : 1;
+        if(conn->next_seq < oldest){
+            pthread_mutex_unlock(&channel->lock);
+            conn->broken = 1;
+            return;
+        }
+        while(count < EVENT_BATCH && conn->next_seq < channel->next_seq){
+            Event *event = channel->ring[conn->next_seq % channel->capacity];
+            atomic_fetch_add(&event->refs, 1);
+            batch[count++] = event;
+            conn->next_seq++;
+        }
+        pthread_mutex_unlock(&channel->lock);
+
+        if(count == 0){
+            return;
+        }
+
+        struct iovec iov[EVENT_BATCH];
+        for(int i = 0; i < count; i++){
+            iov[i].iov_base = batch[i]->data;
+            iov[i].iov_len = batch[i]->len;
+        }
+        send_output(conn, iov, count);
+
+        for(int i = 0; i < count; i++){
+            release_event(batch[i]);
+        }
+    }
+}
+
+static void unsubscribe(Connection *conn){
+    if(conn->channel == NULL){
+        return;
+    }
+
+    Worker *worker = conn->worker;
+    if(conn->prev_subscriber != NULL){
+        conn->prev_subscriber->next_subscriber = conn->next_subscriber;
+    } else {
+        worker->subscribers = conn->next_subscriber;
+    }
+    if(conn->next_subscriber != NULL){
+        conn->next_subscriber->prev_subscriber = conn->prev_subscriber;
+    }
+
+    atomic_fetch_sub(&worker->num_subscribers, 1);
+    conn->channel = NULL;
+}
+
+/**
+ * Turns the connection into a subscriber of the channel
+ *
+ * status holds the status line and headers like for http_begin_response.
+ * The response has no length, it ends when the connection closes. A client
+ * that reconnects with Last-Event-ID first gets the events it missed, as
+ * far as the channel still has them.
+ */
+void http_subscribe(int client_socket, const char *status, Channel *channel){
+    Connection *conn = find_connection(client_socket);
+    if(conn == NULL || conn->response_started || conn->channel != NULL){
+        return;
+    }
+
+    conn->response_started = 1;
+    conn->close_after = 1;
+    count_status(status);
+
+    struct iovec iov[2] = {{(void*)status, strlen(status)}, {"Connection: close\r\n\r\n", 21}};
+    send_output(conn, iov, 2);
+
+    pthread_mutex_lock(&channel->lock);
+    conn->next_seq = channel->next_seq;
+
+    Slice last_id;
+    if(conn->request != NULL && http_header(conn->request, "last-event-id", &last_id) && last_id.len < 24){
+        char digits[24];
+        memcpy(digits, last_id.data, last_id.len);
+        digits[last_id.len] = '\0';
+        uint64_t seq = strtoull(digits, NULL, 10) + 1;
+        if(seq < conn->next_seq){
+            conn->next_seq = seq;
+        }
+    }
+    pthread_mutex_unlock(&channel->lock);
+
+    Worker *worker = conn->worker;
+    conn->channel = channel;
+    conn->prev_subscriber = NULL;
+    conn->next_subscriber = worker->subscribers;
+    if(worker->subscribers != NULL){
+        worker->subscribers->prev_subscriber = conn;
+    }
+    worker->subscribers = conn;
+    atomic_fetch_add(&worker->num_subscribers, 1);
+}
+
+static void update_connection(Connection *conn);
+static void handle_writable(Connection *conn);
+
+/**
+ * Wakes up on the worker's event_fd, sends the responses that were
+ * released and feeds the subscribers
+ */
+static void handle_wakeup(Worker *worker){
+    uint64_t count;
+    ssize_t n = read(worker->event_fd, &count, sizeof(count));
+    (void)n;
+
+    uint64_t through = atomic_load(&released);
+    Connection *conn = worker->held;
+    while(conn != NULL){
+        //sending answers the pipelined requests, which can hold again or close
+        Connection *next = conn->next_held;
+        if(conn->hold <= through){
+            unhold(conn);
+            handle_writable(conn);
+        }
+        conn = next;
+    }
+
+    conn = worker->subscribers;
+    while(conn != NULL){
+        //delivering can close the connection
+        Connection *next = conn->next_subscriber;
+        update_connection(conn);
+        conn = next;
+    }
+}
+
+
+/**
+ * Request parsing
+ *
+ * parse_request() walks the head once, from the request line to the blank
+ * line, and only records where things are. Nothing is copied, parameter
+ * values are then decoded where they are, see url-decode.c.
+ */
+
+int slice_equals(Slice slice, const char *s){
+    size_t len = strlen(s);
+    return slice.len == len && memcmp(slice.data, s, len) == 0;
+}
+
+static int slice_equals_nocase(Slice slice, const char *s){
+    size_t len = strlen(s);
+    return slice.len == len && strncasecmp(slice.data, s, len) == 0;
+}
+
+//whether the comma separated list has the token, like "keep-alive, Upgrade"
+static int slice_has_token(Slice list, const char *token){
+    size_t token_len = strlen(token);
+    const char *p = list.data, *end = list.data + list.len;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')){
+            p++;
+        }
+        const char *start = p;
+        while(p < end && *p != ','){
+            p++;
+        }
+        const char *stop = p;
+        while(stop > start && (stop[-1] == ' ' || stop[-1] == '\t')){
+            stop--;
+        }
+        if((size_t)(stop - start) == token_len && strncasecmp(start, token, token_len) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Adds the name=value pairs of a query string or form body, split on '&'
+ */
+static void add_params(HttpRequest *request, const char *p, const char *end, int form){
+    while(p < end && request->num_params < MAX_PARAMS){
+        const char *pair_end = memchr(p, '&', end - p);
+        if(pair_end == NULL){
+            pair_end = end;
+        }
+        if(pair_end > p){
+            const char *equals = memchr(p, '=', pair_end - p);
+            HttpParam *param = &request->params[request->num_params++];
+            param->name = (Slice){p, (equals != NULL ? equals : pair_end) - p};
+            param->value = equals != NULL ? (Slice){equals + 1, pair_end - equals - 1} : (Slice){pair_end, 0};
+            param->form = form;
+        }
+        p = pair_end + 1;
+    }
+}
+
+/**
+ * Splits up the head of a request, len bytes up to and including the blank line
+ *
+ * @return 0 on success, -1 if the request is malformed or uses chunked
+ *         bodies, which aren't supported
+ */
+static int parse_request(const char *data, size_t len, HttpRequest *request){
+    const char *p = data, *end = data + len;
+    request->num_headers = 0;
+    request->num_params = 0;
+    request->content_length = -1;
+    request->body = (Slice){end, 0};
+    request->raw = (Slice){data, len};
+
+    //request line: method, target and version
+    const char *line_end = memchr(p, '\r', end - p);
+    if(line_end == NULL){
+        line_end = end;
+    }
+    const char *space = memchr(p, ' ', line_end - p);
+    if(space == NULL || space == p){
+        return -1;
+    }
+    request->method = (Slice){p, space - p};
+
+    const char *target = space + 1;
+    const char *target_end = memchr(target, ' ', line_end - target);
+    if(target_end == NULL){
+        target_end = line_end;
+    }
+    if(target_end == target || *target != '/'){
+        return -1;
+    }
+    request->version = target_end < line_end ? (Slice){target_end + 1, line_end - target_end - 1} : (Slice){line_end, 0};
+
+    const char *question = memchr(target, '?', target_end - target);
+    const char *path_end = question != NULL ? question : target_end;
+    request->path = (Slice){target, path_end - target};
+    request->query = question != NULL ? (Slice){question + 1, target_end - question - 1} : (Slice){target_end, 0};
+    add_params(request, request->query.data, target_end, 0);
+
+    //header lines up to the blank one
+    p = line_end;
+    while(p + 2 <= end && p[0] == '\r' && p[1] == '\n'){
+        p += 2;
+        line_end = memchr(p, '\r', end - p);
+        if(line_end == NULL){
+            line_end = end;
+        }
+        if(line_end == p){
+            break;
+        }
+
+        const char *colon = memchr(p, ':', line_end - p);
+        if(colon == NULL){
+            return -1;
+        }
+        Slice name = {p, colon - p};
+        const char *value = colon + 1;
+        const char *value_end = line_end;
+        while(value < value_end && (*value == ' ' || *value == '\t')){
+            value++;
+        }
+        while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')){
+            value_end--;
+        }
+
+        if(slice_equals_nocase(name, "content-length")){
+            char *number_end;
+            request->content_length = strtol(value, &number_end, 10);
+            if(value == value_end || number_end != value_end || request->content_length < 0){
+                return -1;
+            }
+        }
+        else if(slice_equals_nocase(name, "transfer-encoding")){
+            return -1;
+        }
+
+        if(request->num_headers < MAX_HEADERS){
+            request->header_names[request->num_headers] = name;
+            request->header_values[request->num_headers] = (Slice){value, value_end - value};
+            request->num_headers++;
+        }
+        p = line_end;
+    }
+    return 0;
+}
+
+/**
+ * Takes the body that followed the head, its parameters go after those of
+ * the query string unless it says it is something other than a form
+ */
+static void parse_body(HttpRequest *request, const char *body, size_t len){
+    request->body = (Slice){body, len};
+    request->raw.len += len;
+
+    Slice type;
+    if(!http_header(request, "content-type", &type) ||
+       (type.len >= 33 && strncasecmp(type.data, "application/x-www-form-urlencoded", 33) == 0)){
+        add_params(request, body, body + len, 1);
+    }
+}
+
+/**
+ * Decodes the parameter values where they are, the connection's buffer
+ * is only read again after the handler returned
+ *
+ * @return 0 on success, -1 if a value has a bad escape or isn't UTF-8
+ */
+static int decode_params(HttpRequest *request){
+    for(int i = 0; i < request->num_params; i++){
+        HttpParam *param = &request->params[i];
+        ssize_t len = url_decode((char*)param->value.data, param->value.len, param->form);
+        if(len < 0){
+            return -1;
+        }
+        param->value.len = (size_t)len;
+    }
+    return 0;
+}
+
+/**
+ * @return the first parameter with the name, NULL if there is none
+ */
+const HttpParam *http_param(const HttpRequest *request, const char *name){
+    for(int i = 0; i < request->num_params; i++){
+        if(slice_equals(request->params[i].name, name)){
+            return &request->params[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Finds a header by its case-insensitive name
+ *
+ * @return 1 if the request has the header, 0 otherwise
+ */
+int http_header(const HttpRequest *request, const char *name, Slice *value){
+    for(int i = 0; i < request->num_headers; i++){
+        if(slice_equals_nocase(request->header_names[i], name)){
+            *value = request->header_values[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Picks what to compress a response with from Accept-Encoding, gzip over
+ * deflate, either only if it isn't refused with q=0
+ *
+ * @return one of the ENCODING_ values
+ */
+int http_accepted_encoding(const HttpRequest *request){
+    Slice header;
+    if(!http_header(request, "accept-encoding", &header)){
+        return ENCODING_IDENTITY;
+    }
+
+    int gzip = 0, deflate = 0, any = 0;
+    const char *p = header.data, *end = header.data + header.len;
+    while(p < end){
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')){
+            p++;
+        }
+        const char *name = p;
+        while(p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'){
+            p++;
+        }
+        Slice coding = {name, (size_t)(p - name)};
+
+        //only q=0 matters, anything else accepts the coding
+        int accepted = 1;
+        const char *params = p;
+        while(p < end && *p != ','){
+            p++;
+        }
+        Slice rest = {params, (size_t)(p - params)};
+        const char *q = memmem(rest.data, rest.len, "q=", 2);
+        if(q != NULL){
+            accepted = strtod(q + 2, NULL) > 0;
+        }
+
+        if(slice_equals_nocase(coding, "gzip") || slice_equals_nocase(coding, "x-gzip")){
+            gzip = accepted ? 1 : -1;
+        }
+        else if(slice_equals_nocase(coding, "deflate")){
+            deflate = accepted ? 1 : -1;
+        }
+        else if(slice_equals(coding, "*")){
+            any = accepted ? 1 : -1;
+        }
+    }
+
+    if(gzip > 0 || (gzip == 0 && any > 0)){
+        return ENCODING_GZIP;
+    }
+    if(deflate > 0 || (deflate == 0 && any > 0)){
+        return ENCODING_DEFLATE;
+    }
+    return ENCODING_IDENTITY;
+}
+
+/**
+ * Whether the connection stays open after this request:
+ * HTTP/1.1 unless "Connection: close", HTTP/1.0 only with "Connection: keep-alive"
+ */
+static int wants_keep_alive(const HttpRequest *request){
+    Slice connection;
+    int has_connection = http_header(request, "connection", &connection);
+
+    if(slice_equals(request->version, "HTTP/1.1")){
+        return !has_connection || !slice_has_token(connection, "close");
+    }
+    return has_connection && slice_has_token(connection, "keep-alive");
+}
+
+
+/**
+ * Parses the head at the start of the input, NUL-terminated while it's
+ * parsed so a head cut off by a close still ends
+ */
+static int parse_head(Connection *conn, size_t head_len, HttpRequest *request){
+    char *in = conn->in.data;
+    char after_head = in[head_len];
+    in[head_len] = '\0';
+    int parsed = parse_request(in, head_len, request);
+    in[head_len] = after_head;
+    return parsed;
+}
+
+
+/**
+ * Answers the buffered requests in order
+ *
+ * A request is handled once its head and the Content-Length bytes of its
+ * body are in, until then the connection just waits for more. The end of
+ * the head is searched for only in the bytes that arrived since the last
+ * look, and a head is charged and measured once, when it's first found, so
+ * a body arriving in pieces costs neither tokens nor parses. Stops early
+ * while output is still queued, so a client that pipelines faster than it
+ * reads only fills its own socket buffer.
+ */
+static void process_requests(Connection *conn){
+    while(!conn->close_after && conn->in.len > 0 && !output_pending(conn) && !conn->broken){
+        char *in = conn->in.data;
+        HttpRequest request;
+        int parsed = 0;
+
+        if(conn->head_len == 0){
+            size_t from = conn->in_scanned > 3 ? conn->in_scanned - 3 : 0;
+            char *terminator = memmem(in + from, conn->in.len - from, "\r\n\r\n", 4);
+
+            size_t head_len;
+            if(terminator != NULL){
+                head_len = terminator + 4 - in;
+            }
+            else if(conn->peer_closed){
+                //whatever came before the close is the last request
+                head_len = conn->in.len;
+            }
+            else if(conn->in.len > max_head_size){
+                conn->close_after = 1;
+                send_string(conn, HTTP_431_TOO_LARGE);
+                return;
+            }
+            else{
+                conn->in_scanned = conn->in.len;
+                return;
+            }
+
+            if(head_len > max_head_size){
+                conn->close_after = 1;
+                send_string(conn, HTTP_431_TOO_LARGE);
+                return;
+            }
+
+            //a client over its rate is turned away before anything is parsed
+            if(!take_token(conn->addr, 1)){
+                conn->close_after = 1;
+                send_string(conn, HTTP_429_TOO_MANY);
+                return;
+            }
+
+            if(parse_head(conn, head_len, &request) < 0){
+                conn->close_after = 1;
+                send_string(conn, HTTP_400_BAD_REQUEST);
+                return;
+            }
+            parsed = 1;
+
+            //refused as soon as the head says so, before any of the body is read
+            if(request.content_length > 0 && (size_t)request.content_length > max_body_size){
+                conn->close_after = 1;
+                send_string(conn, HTTP_413_TOO_LARGE);
+                return;
+            }
+            conn->head_len = head_len;
+            conn->request_len = head_len + (request.content_length > 0 ? (size_t)request.content_length : 0);
+        }
+
+        if(conn->in.len < conn->request_len){
+            if(conn->peer_closed){
+                conn->close_after = 1;
+                send_string(conn, HTTP_400_BAD_REQUEST);
+            }
+            return;
+        }
+
+        //the input may have moved since the head was parsed, its views are taken again
+        size_t head_len = conn->head_len;
+        size_t request_len = conn->request_len;
+        if(!parsed && parse_head(conn, head_len, &request) < 0){
+            conn->close_after = 1;
+            send_string(conn, HTTP_400_BAD_REQUEST);
+            return;
+        }
+        if(request_len > head_len){
+            parse_body(&request, in + head_len, request_len - head_len);
+        }
+
+        if(decode_params(&request) < 0){
+            conn->close_after = 1;
+            send_string(conn, HTTP_400_BAD_REQUEST);
+            return;
+        }
+
+        conn->close_after = conn->peer_closed || !wants_keep_alive(&request);
+        conn->request = &request;
+        (*conn->worker->handler)(&request, conn->fd);
+        conn->request = NULL;
+        finish_response(conn);
+
+        memmove(in, in + request_len, conn->in.len - request_len);
+        conn->in.len -= request_len;
+        conn->in_scanned = 0;
+        conn->head_len = conn->request_len = 0;
+    }
+}
+
+/**
+ * Closes the connection or waits for the next event, depending on what is left to do
+ */
+static void update_connection(Connection *conn){
+    //subscribers stay open, reading only to notice when the client leaves
+    if(conn->channel != NULL && !conn->broken){
+        deliver_events(conn);
+    }
+
+    if(conn->broken){
+        close_connection(conn);
+        return;
+    }
+    release_input(conn);
+
+    if(conn->channel != NULL){
+        conn->state = CONN_STREAMING;
+        watch_connection(conn, EPOLLIN | EPOLLRDHUP | (output_pending(conn) ? EPOLLOUT : 0));
+        return;
+    }
+
+    //held responses wait without watching anything, only errors and hangups still arrive
+    if(conn->hold != 0){
+        if(conn->hold > atomic_load(&released)){
+            conn->state = CONN_HOLDING;
+            watch_connection(conn, 0);
+            return;
+        }
+        //released before the wakeup came, send it like any queued output
+        unhold(conn);
+    }
+
+    if(output_pending(conn)){
+        if(conn->state != CONN_WRITING){
+            conn->state = CONN_WRITING;
+            watch_connection(conn, EPOLLOUT);
+        }
+        return;
+    }
+
+    if(conn->close_after || conn->peer_closed){
+        close_connection(conn);
+        return;
+    }
+
+    if(conn->state != CONN_READING){
+        conn->state = CONN_READING;
+        watch_connection(conn, EPOLLIN);
+    }
+}
+
+
+/**
+ * Flushes queued output, then answers requests that were pipelined behind it
+ */
+static void handle_writable(Connection *conn){
+    struct iovec iov = {conn->out.data + conn->out_sent, conn->out.len - conn->out_sent};
+    ssize_t n = write_some(conn->fd, &iov, 1);
+    if(n < 0){
+        close_connection(conn);
+        return;
+    }
+
+    conn->out_sent += n;
+    if(!output_pending(conn)){
+        conn->out.len = conn->out_sent = 0;
+        buffer_trim(&conn->out);
+        process_requests(conn);
+    }
+    update_connection(conn);
+}
+
+
+/**
+ * Reads whatever arrived and answers every complete request
+ *
+ * A request that is still incomplete stays buffered until the rest of it
+ * arrives. Reading stops once the buffer holds the largest request there
+ * can be, whatever is left is read after that request was answered. If
+ * the buffer can't grow that far the client gets a 503 and is closed.
+ */
+static void handle_readable(Connection *conn){
+    if(acquire_input(conn) < 0){
+        close_connection(conn);
+        return;
+    }
+
+    ssize_t room;
+    while((room = input_room(conn)) > 0){
+        ssize_t bytes = recv(conn->fd, conn->in.data + conn->in.len, room, 0);
+        if(bytes > 0){
+            conn->in.len += bytes;
+            continue;
+        }
+        if(bytes < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            break;
+        }
+
+        //the read failed, or the client closed its side
+        if(bytes < 0){
+            close_connection(conn);
+            return;
+        }
+        conn->peer_closed = 1;
+        break;
+    }
+
+    //the request can't be read in full, waiting for more would only spin on the same readable socket
+    if(room < 0){
+        conn->close_after = 1;
+        send_string(conn, HTTP_503_UNAVAILABLE);
+        update_connection(conn);
+        return;
+    }
+
+    process_requests(conn);
+    update_connection(conn);
+}
+
+
+/**
+ * Subscribers don't send requests, reading only tells when they went away
+ */
+static void handle_stream_readable(Connection *conn){
+    char scratch[512];
+    while(1){
+        ssize_t bytes = recv(conn->fd, scratch, sizeof(scratch), 0);
+        if(bytes > 0){
+            continue;
+        }
+        if(bytes < 0 && errno == EINTR){
+            continue;
+        }
+        if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        close_connection(conn);
+        return;
+    }
+}
+
+
+/**
+ * Accepts every pending connection on the listening socket
+ *
+ * Connections past max_connections and ones from clients that are out of
+ * tokens are answered and closed right here, see the admission control.
+ */
+static void accept_connections(Worker *worker){
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+
+    while(1){
+        client_len = sizeof(client_addr);
+        int client_sock = accept(worker->server_sock, (struct sockaddr *)&client_addr, &client_len);
+        if(client_sock < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                perror("accept failed");
+            }
+            return;
+        }
+
+        if(client_sock >= max_fds || set_nonblocking(client_sock) < 0){
+            close(client_sock);
+            continue;
+        }
+
+        uint32_t addr = ntohl(client_addr.sin_addr.s_addr);
+        if(max_connections > 0 && atomic_load(&num_connections) >= max_connections){
+            refuse_connection(client_sock, HTTP_503_UNAVAILABLE);
+            continue;
+        }
+        if(!take_token(addr, 0)){
+            refuse_connection(client_sock, HTTP_429_TOO_MANY);
+            continue;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if(conn == NULL){
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->addr = addr;
+        conn->worker = worker;
+        conn->state = CONN_READING;
+        conn->watching = EPOLLIN;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = client_sock};
+        if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0){
+            perror("epoll_ctl failed");
+            close(client_sock);
+            free(conn);
+            continue;
+        }
+        connections[client_sock] = conn;
+        atomic_fetch_add(&num_connections, 1);
+    }
+}
+
+
+/**
+ * Event loop of one worker thread
+ */
+static void *run_worker(void *arg){
+    Worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == worker->server_sock) {
+                accept_connections(worker);
+                continue;
+            }
+            if (fd == worker->event_fd) {
+                handle_wakeup(worker);
+                continue;
+            }
+
+            Connection *conn = connections[fd];
+            if (conn == NULL) continue;
+
+            if (conn->state == CONN_READING && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                handle_readable(conn);
+            }
+            else if (conn->state == CONN_WRITING && (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+                handle_writable(conn);
+            }
+            else if (conn->state == CONN_STREAMING) {
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    handle_stream_readable(conn);
+                    conn = connections[fd];
+                }
+                if (conn != NULL && (events[i].events & EPOLLOUT)) {
+                    handle_writable(conn);
+                }
+            }
+            else if (conn->state == CONN_HOLDING && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                close_connection(conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Creates a non-blocking listening socket on the port
+ *
+ * SO_REUSEPORT lets every worker bind its own socket to the same port.
+ */
+static int open_listener(int port){
+    int server_sock;
+    struct sockaddr_in server_addr;
 
     // Create a socket
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
 
-    int enable = 1; 
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)  
-        perror("setsockopt(SO_REUSEADDR) failed");                                
+    int enable = 1;
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+        perror("setsockopt(SO_REUSEADDR) failed");
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+        perror("setsockopt(SO_REUSEPORT) failed");
 
 
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(port);  
-    socklen_t addr_len = sizeof(server_addr);
-    if (bind(server_sock, (struct sockaddr *)&server_addr, addr_len) < 0) {
+    server_addr.sin_port = htons(port);
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("bind failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
 
     // Listen for incoming connections
-    if (listen(server_sock, 10) < 0) {
+    if (listen(server_sock, listen_backlog) < 0) {
         perror("listen failed");
         close(server_sock);
         exit(EXIT_FAILURE);
     }
-    // get port number
-    if (getsockname(server_sock, (struct sockaddr *)&server_addr, &addr_len) == -1) {
-        perror("getsockname failed");
+
+    if (set_nonblocking(server_sock) < 0) {
+        perror("fcntl failed");
+        close(server_sock);
         exit(EXIT_FAILURE);
     }
 
-    printf("Server started on port %d\n", ntohs(server_addr.sin_port));
-    char buffer[BUFFER_SIZE];
-    // Main server loop
-    while (1) {
-        if ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_len)) < 0) {
-            perror("accept failed");
-            close(server_sock);
+    return server_sock;
+}
+
+
+void start_server(void(*handler)(HttpRequest*, int), int port, int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+
+    // Connection table, one slot per possible file descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        max_fds = (int)limit.rlim_cur;
+    } else {
+        max_fds = 65536;
+    }
+    connections = calloc(max_fds, sizeof(Connection*));
+    workers = calloc(num_threads, sizeof(Worker));
+    if (connections == NULL || workers == NULL) {
+        perror("calloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < RATE_LOCKS; i++) {
+        pthread_mutex_init(&rate_locks[i], NULL);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].server_sock = open_listener(port);
+        workers[i].handler = handler;
+
+        // port 0 picks a free port, the other workers have to share that one
+        if (i == 0) {
+            struct sockaddr_in server_addr;
+            socklen_t addr_len = sizeof(server_addr);
+            if (getsockname(workers[0].server_sock, (struct sockaddr *)&server_addr, &addr_len) == -1) {
+                perror("getsockname failed");
+                exit(EXIT_FAILURE);
+            }
+            port = ntohs(server_addr.sin_port);
+        }
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = workers[i].server_sock};
+        if ((workers[i].epoll_fd = epoll_create1(0)) < 0 ||
+            epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, workers[i].server_sock, &ev) < 0) {
+            perror("epoll setup failed");
             exit(EXIT_FAILURE);
         }
 
-        // Receive the request
-        int bytes = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        if(bytes < 0) {printf("error receiving\n");close(client_sock);continue;}
-        buffer[bytes] = '\0';  
+        // channel events and released responses from other threads arrive through the event_fd
+        if ((workers[i].event_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            perror("eventfd failed");
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event wake = {.events = EPOLLIN, .data.fd = workers[i].event_fd};
+        if (epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, workers[i].event_fd, &wake) < 0) {
+            perror("epoll setup failed");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&workers[i].num_subscribers, 0);
+        atomic_init(&workers[i].num_held, 0);
+    }
+    num_workers = num_threads;
 
-        (*handler)(buffer, client_sock);
+    printf("Server started on port %d with %d worker thread(s)\n", port, num_threads);
 
-        // Close the connection with the client
-        close(client_sock);
+    // the calling thread becomes worker 0
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
     }
-
-    close(server_sock);
-}
\ No newline at end of file
+    run_worker(&workers[0]);
+}
@@ -10,9 +10,93 @@
 #include <time.h>
 #include <ctype.h>
 #include <assert.h>
+#include <stdint.h>
 
-void start_server(void(*handler)(char*, int), int port);
+typedef struct Channel Channel;
+
+/**
+ * Bytes of a request that is being handled, not NUL-terminated
+ */
+struct Slice {
+    const char *data;
+    size_t len;
+};
+typedef struct Slice Slice;
+
+/**
+ * A request split up in a single pass, see parse_request() in http-server.c
+ *
+ * Everything points into the connection's buffer and is only valid while
+ * the handler runs. Parameter values are already decoded and valid UTF-8,
+ * form is set for the ones from a form body.
+ */
+#define MAX_HEADERS 32
+#define MAX_PARAMS 16
+
+struct HttpParam {
+    Slice name;
+    Slice value;
+    int form;
+};
+typedef struct HttpParam HttpParam;
+
+struct HttpRequest {
+    Slice method;
+    Slice path;                 //without the query string
+    Slice query;
+    Slice version;
+    int num_headers;            //the first MAX_HEADERS
+    Slice header_names[MAX_HEADERS];
+    Slice header_values[MAX_HEADERS];
+    int num_params;             //the first MAX_PARAMS of the query string, then of the body
+    HttpParam params[MAX_PARAMS];
+    long content_length;        //-1 without a Content-Length header
+    Slice body;
+    Slice raw;                  //the whole request
+};
+typedef struct HttpRequest HttpRequest;
+
+void start_server(void(*handler)(HttpRequest*, int), int port, int num_threads);
+void http_set_limits(size_t max_head, size_t max_body);
+void http_set_admission(int rate, int burst, int max_open, int backlog);
+int slice_equals(Slice slice, const char *s);
+const HttpParam *http_param(const HttpRequest *request, const char *name);
+int http_header(const HttpRequest *request, const char *name, Slice *value);
+void http_begin_response(int client_socket, const char *status);
+void http_add_header(int client_socket, const char *header);
+void http_write(int client_socket, const void *data, size_t len);
+void http_hold_response(int client_socket, uint64_t ticket);
+
+/**
+ * Compressed bodies, see http-server.c
+ */
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_DEFLATE 2
+
+struct Deflated {
+    char *data;                 //raw deflate, ends on a byte boundary
+    size_t len;
+    size_t raw_len;
+    uint32_t crc;               //crc32 of the raw bytes, for gzip
+    uint32_t adler;             //adler32 of the raw bytes, for deflate
+};
+typedef struct Deflated Deflated;
+
+int http_accepted_encoding(const HttpRequest *request);
+void http_set_encoding(int client_socket, int encoding);
+int http_encoding(int client_socket);
+int http_deflate(const void *data, size_t len, Deflated *deflated);
+void http_write_deflated(int client_socket, const Deflated *deflated);
+void http_release(uint64_t ticket);
+
+Channel *http_channel_create(size_t capacity);
+void http_subscribe(int client_socket, const char *status, Channel *channel);
+void http_publish(Channel *channel, const char *name, const char *data, size_t len);
 
 #define BUFFER_SIZE 2048
+#define MAX_HEAD_SIZE (8 * 1024)        //default limits of a request, see http_set_limits
+#define MAX_BODY_SIZE (1024 * 1024)
+#define LISTEN_BACKLOG SOMAXCONN        //default backlog, see http_set_admission
 
 #endif
\ No newline at end of file
@@ -0,0 +1,176 @@
+#include "json-writer.h"
+#include "http-server.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/**
+ * GENERAL STRUCTURE OF THE FILE ->
+ *
+ * json_escape() -- escapes the bytes of a JSON string, 16 at a time
+ *
+ * JsonWriter -- collects a response's JSON on the stack and hands it to
+ *               http_write in JSON_BUFFER pieces, nothing is allocated
+ */
+
+
+/**
+ * Escaping
+ *
+ * Only '"', '\\' and control characters need escaping, everything else,
+ * UTF-8 included, is copied as it is. Messages are mostly plain text, so
+ * with SSE2 16 bytes are checked and copied at once and only the bytes
+ * that need it go through escape_byte.
+ */
+
+//longest escape of one byte, "\u00XX"
+#define JSON_ESCAPE_MAX 6
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @return length of the escape written to dest
+ */
+static size_t escape_byte(char *dest, unsigned char c){
+    dest[0] = '\\';
+    switch(c){
+        case '"':  dest[1] = '"';  return 2;
+        case '\\': dest[1] = '\\'; return 2;
+        case '\n': dest[1] = 'n';  return 2;
+        case '\r': dest[1] = 'r';  return 2;
+        case '\t': dest[1] = 't';  return 2;
+        case '\b': dest[1] = 'b';  return 2;
+        case '\f': dest[1] = 'f';  return 2;
+    }
+    memcpy(dest + 1, "u00", 3);
+    dest[4] = hex_digits[c >> 4];
+    dest[5] = hex_digits[c & 0xf];
+    return 6;
+}
+
+/**
+ * Escapes len bytes of src for the inside of a JSON string
+ *
+ * dest needs room for JSON_ESCAPE_MAX * len bytes, it is not NUL-terminated.
+ *
+ * @return number of bytes written to dest
+ */
+size_t json_escape(char *dest, const char *src, size_t len){
+    char *out = dest;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while(i + 16 <= len){
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+
+        //unsigned max(c, 0x1f) == 0x1f picks the control characters
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+                                       _mm_cmpeq_epi8(_mm_max_epu8(bytes, control), control));
+        int mask = _mm_movemask_epi8(special);
+
+        //copied whole either way, the part after the first special byte is overwritten
+        _mm_storeu_si128((__m128i*)out, bytes);
+        if(mask == 0){
+            out += 16;
+            i += 16;
+            continue;
+        }
+
+        int clean = __builtin_ctz(mask);
+        out += clean;
+        i += clean;
+        out += escape_byte(out, (unsigned char)src[i]);
+        i++;
+    }
+#endif
+
+    for(; i < len; i++){
+        unsigned char c = (unsigned char)src[i];
+        if(c < 0x20 || c == '"' || c == '\\'){
+            out += escape_byte(out, c);
+        }
+        else{
+            *out++ = (char)c;
+        }
+    }
+    return out - dest;
+}
+
+
+/**
+ * JsonWriter
+ *
+ * Meant to live on the stack of the handler for one response.
+ */
+
+void json_begin(JsonWriter *json, int client_socket){
+    json->client_socket = client_socket;
+    json->len = 0;
+}
+
+/**
+ * Hands what was collected so far to the response
+ */
+void json_flush(JsonWriter *json){
+    if(json->len > 0){
+        http_write(json->client_socket, json->buf, json->len);
+        json->len = 0;
+    }
+}
+
+/**
+ * Adds bytes that are already JSON
+ */
+void json_raw(JsonWriter *json, const char *data, size_t len){
+    if(len > JSON_BUFFER - json->len){
+        json_flush(json);
+        if(len > JSON_BUFFER){
+            http_write(json->client_socket, data, len);
+            return;
+        }
+    }
+    memcpy(json->buf + json->len, data, len);
+    json->len += len;
+}
+
+/**
+ * Adds s as a quoted, escaped JSON string
+ */
+void json_string(JsonWriter *json, const char *s, size_t len){
+    json_raw(json, "\"", 1);
+
+    //long strings are escaped a piece at a time so every piece fits the buffer
+    size_t piece_max = (JSON_BUFFER - 1) / JSON_ESCAPE_MAX;
+    while(len > 0){
+        size_t piece = len < piece_max ? len : piece_max;
+        if(piece * JSON_ESCAPE_MAX > JSON_BUFFER - json->len){
+            json_flush(json);
+        }
+        json->len += json_escape(json->buf + json->len, s, piece);
+        s += piece;
+        len -= piece;
+    }
+
+    json_raw(json, "\"", 1);
+}
+
+void json_int(JsonWriter *json, long long number){
+    char digits[24];
+    int i = sizeof(digits);
+    unsigned long long n = number < 0 ? 0ULL - (unsigned long long)number : (unsigned long long)number;
+    do{
+        digits[--i] = (char)('0' + n % 10);
+        n /= 10;
+    } while(n > 0);
+    if(number < 0){
+        digits[--i] = '-';
+    }
+    json_raw(json, digits + i, sizeof(digits) - i);
+}
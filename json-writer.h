@@ -0,0 +1,26 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+
+/**
+ * Buffered JSON output to a response, see json-writer.c
+ */
+#define JSON_BUFFER (16 * 1024)
+
+struct JsonWriter {
+    int client_socket;
+    size_t len;
+    char buf[JSON_BUFFER];
+};
+typedef struct JsonWriter JsonWriter;
+
+size_t json_escape(char *dest, const char *src, size_t len);
+
+void json_begin(JsonWriter *json, int client_socket);
+void json_raw(JsonWriter *json, const char *data, size_t len);
+void json_string(JsonWriter *json, const char *s, size_t len);
+void json_int(JsonWriter *json, long long number);
+void json_flush(JsonWriter *json);
+
+#endif
@@ -0,0 +1,93 @@
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+
+
+/**
+ * Every thread counts into its own slot, so counting is a plain add to a
+ * cache line no other thread writes, no lock and no locked instruction.
+ * Slots are only added up when /metrics is scraped, which can see a
+ * count a moment late but never a torn one.
+ *
+ * Threads past MAX_METRIC_SLOTS share the last slot, where an increment
+ * can get lost when two of them count at the same time.
+ */
+#define MAX_METRIC_SLOTS 256
+
+static MetricsSlot metrics_slots[MAX_METRIC_SLOTS];
+static _Atomic int num_metric_slots = 0;
+static _Thread_local MetricsSlot *metrics_slot = NULL;
+
+static MetricsSlot *own_slot(){
+    if(metrics_slot == NULL){
+        int slot = atomic_fetch_add(&num_metric_slots, 1);
+        metrics_slot = &metrics_slots[slot < MAX_METRIC_SLOTS ? slot : MAX_METRIC_SLOTS - 1];
+    }
+    return metrics_slot;
+}
+
+//only the owning thread writes a slot, so this doesn't need a locked add
+static void add(_Atomic uint64_t *counter, uint64_t n){
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+uint64_t metrics_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Counts a request to the route and how long it took
+ */
+void metrics_request(int route, uint64_t nanos){
+    if(route < 0 || route >= MAX_ROUTES){
+        return;
+    }
+    MetricsSlot *slot = own_slot();
+
+    //the smallest bucket 2^k microseconds that holds it
+    uint64_t micros = (nanos + 999) / 1000;
+    int bucket = micros <= 1 ? 0 : 64 - __builtin_clzll(micros - 1);
+    if(bucket >= LATENCY_BUCKETS){
+        bucket = LATENCY_BUCKETS - 1;
+    }
+
+    add(&slot->requests[route], 1);
+    add(&slot->latency[route][bucket], 1);
+    add(&slot->latency_sum[route], nanos);
+}
+
+void metrics_response(int status){
+    if(status >= MIN_STATUS && status < MAX_STATUS){
+        add(&own_slot()->responses[status - MIN_STATUS], 1);
+    }
+}
+
+void metrics_bytes(size_t len){
+    add(&own_slot()->bytes_written, len);
+}
+
+/**
+ * Adds up every thread's slot into total
+ */
+void metrics_sum(MetricsSlot *total){
+    memset(total, 0, sizeof(MetricsSlot));
+
+    int count = atomic_load(&num_metric_slots);
+    for(int i = 0; i < count && i < MAX_METRIC_SLOTS; i++){
+        MetricsSlot *slot = &metrics_slots[i];
+        for(int route = 0; route < MAX_ROUTES; route++){
+            add(&total->requests[route], atomic_load_explicit(&slot->requests[route], memory_order_relaxed));
+            add(&total->latency_sum[route], atomic_load_explicit(&slot->latency_sum[route], memory_order_relaxed));
+            for(int b = 0; b < LATENCY_BUCKETS; b++){
+                add(&total->latency[route][b], atomic_load_explicit(&slot->latency[route][b], memory_order_relaxed));
+            }
+        }
+        for(int s = 0; s < MAX_STATUS - MIN_STATUS; s++){
+            add(&total->responses[s], atomic_load_explicit(&slot->responses[s], memory_order_relaxed));
+        }
+        add(&total->bytes_written, atomic_load_explicit(&slot->bytes_written, memory_order_relaxed));
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * Per-thread counters for /metrics, see metrics.c
+ */
+#define MAX_ROUTES 16
+#define LATENCY_BUCKETS 26      //at most 1us, 2us, 4us, ... 2^24us, then everything slower
+#define MIN_STATUS 100
+#define MAX_STATUS 600
+
+struct MetricsSlot {
+    _Alignas(64) _Atomic uint64_t requests[MAX_ROUTES];
+    _Atomic uint64_t latency[MAX_ROUTES][LATENCY_BUCKETS];     //not cumulative
+    _Atomic uint64_t latency_sum[MAX_ROUTES];                  //nanoseconds
+    _Atomic uint64_t responses[MAX_STATUS - MIN_STATUS];       //by status code
+    _Atomic uint64_t bytes_written;
+};
+typedef struct MetricsSlot MetricsSlot;
+
+uint64_t metrics_now();
+void metrics_request(int route, uint64_t nanos);
+void metrics_response(int status);
+void metrics_bytes(size_t len);
+void metrics_sum(MetricsSlot *total);
+
+#endif
@@ -0,0 +1,183 @@
+#include "url-decode.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+
+/**
+ * GENERAL STRUCTURE OF THE FILE ->
+ *
+ * clean_run()  -- length of the leading bytes that are copied as they are,
+ *                 16 at a time
+ *
+ * utf8_next()  -- checks one decoded byte against the UTF-8 sequence so far
+ *
+ * url_decode() -- decodes a value in place and checks it as it goes
+ */
+
+
+/**
+ * Plain ASCII other than '%', NUL, and '+' in a form body, stays as it is,
+ * so those runs are only moved down over the bytes escapes freed up. With
+ * SSE2 a whole vector is checked at once, the sign bit of a byte doubles
+ * as the test for the start of a UTF-8 sequence.
+ */
+static size_t clean_run(const char *p, size_t len, int form){
+    size_t i = 0;
+    char plus = form ? '+' : '%';
+
+#ifdef __SSE2__
+    const __m128i percent16 = _mm_set1_epi8('%');
+    const __m128i plus16 = _mm_set1_epi8(plus);
+    const __m128i zero16 = _mm_setzero_si128();
+    while(i + 16 <= len){
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, percent16),
+                                                    _mm_cmpeq_epi8(bytes, plus16)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(bytes, zero16), bytes));
+        int mask = _mm_movemask_epi8(special);
+        if(mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#endif
+
+    for(; i < len; i++){
+        unsigned char c = (unsigned char)p[i];
+        if(c >= 0x80 || c == '%' || c == plus || c == '\0'){
+            break;
+        }
+    }
+    return i;
+}
+
+static int hex_value(unsigned char c){
+    if(c >= '0' && c <= '9'){
+        return c - '0';
+    }
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f'){
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+
+/**
+ * UTF-8 is checked byte by byte after decoding, need is the number of
+ * continuation bytes still to come and [lo, hi] the range the next one
+ * has to be in. The narrower ranges after E0, ED, F0 and F4 rule out
+ * overlong forms, surrogates and code points past U+10FFFF.
+ */
+struct Utf8State {
+    int need;
+    unsigned char lo;
+    unsigned char hi;
+};
+typedef struct Utf8State Utf8State;
+
+static int utf8_next(Utf8State *state, unsigned char c){
+    if(state->need > 0){
+        if(c < state->lo || c > state->hi){
+            return 0;
+        }
+        state->need--;
+        state->lo = 0x80;
+        state->hi = 0xbf;
+        return 1;
+    }
+
+    state->lo = 0x80;
+    state->hi = 0xbf;
+    if(c < 0x80){
+        return 1;
+    }
+    if(c >= 0xc2 && c <= 0xdf){
+        state->need = 1;
+    }
+    else if(c >= 0xe0 && c <= 0xef){
+        state->need = 2;
+        if(c == 0xe0){
+            state->lo = 0xa0;
+        }
+        else if(c == 0xed){
+            state->hi = 0x9f;
+        }
+    }
+    else if(c >= 0xf0 && c <= 0xf4){
+        state->need = 3;
+        if(c == 0xf0){
+            state->lo = 0x90;
+        }
+        else if(c == 0xf4){
+            state->hi = 0x8f;
+        }
+    }
+    else{
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Decodes %XX escapes, and '+' to a space for a form body, in place
+ *
+ * The decoded value is never longer, so it is written over the front of
+ * the encoded one. A '%' that isn't followed by two hex digits, a NUL,
+ * raw or as %00, or bytes that don't decode to UTF-8, fail the whole
+ * value, since handlers go on to use it as a C string.
+ *
+ * @return length of the decoded value, -1 if it is malformed
+ */
+ssize_t url_decode(char *data, size_t len, int form){
+    Utf8State utf8 = {0};
+    size_t i = 0, out = 0;
+
+    while(i < len){
+        //runs can only be skipped between characters
+        if(utf8.need == 0){
+            size_t clean = clean_run(data + i, len - i, form);
+            if(out != i){
+                memmove(data + out, data + i, clean);
+            }
+            out += clean;
+            i += clean;
+            if(i == len){
+                break;
+            }
+        }
+
+        unsigned char c = (unsigned char)data[i];
+        if(c == '%'){
+            if(i + 2 >= len){
+                return -1;
+            }
+            int high = hex_value((unsigned char)data[i + 1]);
+            int low = hex_value((unsigned char)data[i + 2]);
+            if(high < 0 || low < 0){
+                return -1;
+            }
+            c = (unsigned char)((high << 4) | low);
+            i += 3;
+        }
+        else{
+            if(c == '+' && form){
+                c = ' ';
+            }
+            i++;
+        }
+
+        if(c == '\0' || !utf8_next(&utf8, c)){
+            return -1;
+        }
+        data[out++] = (char)c;
+    }
+
+    return utf8.need == 0 ? (ssize_t)out : -1;
+}
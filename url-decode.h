@@ -0,0 +1,12 @@
+#ifndef URL_DECODE_H
+#define URL_DECODE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * In-place percent decoding with UTF-8 validation, see url-decode.c
+ */
+ssize_t url_decode(char *data, size_t len, int form);
+
+#endif